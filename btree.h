@@ -1,8 +1,11 @@
 #ifndef __BTREE_H__
 #define __BTREE_H__
 
+#include "keysearch.h"
+#include "pager.h"
 #include "result.h"
 #include "statement.h"
+#include "stringsearch.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -14,27 +17,37 @@
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
 
+/*
+ * Row Record Layout
+ * The id followed by username and email, each stored as a length byte
+ * and the characters without padding or terminator.
+ */
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
 const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-const uint32_t PAGE_SIZE = 4096;
-
-#define TABLE_MAX_PAGES 100
-
-typedef struct {
-  int file_descriptor;
-  uint32_t file_length;
-  uint32_t num_pages;
-  void *pages[TABLE_MAX_PAGES];
-} Pager;
+const uint32_t STRING_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t ROW_MIN_SIZE = ID_SIZE + 2 * STRING_LENGTH_SIZE;
+const uint32_t ROW_MAX_SIZE =
+    ROW_MIN_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
 
-typedef struct {
+typedef struct Table {
   Pager *pager;
   uint32_t root_page_num;
+  struct Table *indexes[NUM_INDEXES]; // NULL where a column has no index
+  /*
+  Keys above rightmost_low_key go into the rightmost leaf, appends find it
+  without a descent. Page 0 until found, see table_rightmost_leaf. In
+  library mode only the thread holding writer reads or changes them:
+  point reads crab down from the root and scans read snapshots.
+  */
+  uint32_t rightmost_page_num;
+  uint32_t rightmost_low_key;
+  /*
+  Library mode, see db_execute. Reads hold the structure latch shared,
+  writes that change the shape of a tree hold it exclusively. writer lets
+  one write run at a time. Only used on the table, not its indexes.
+  */
+  pthread_rwlock_t structure_latch;
+  pthread_mutex_t writer;
 } Table;
 
 typedef struct {
@@ -42,6 +55,11 @@ typedef struct {
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table; // Indicates a position one past the last element
+  /* Readahead along the leaves once the cursor is scanning, see cursor_advance */
+  uint32_t leaves_visited;
+  uint32_t readahead_parent; // Parent of the leaves being prefetched, 0 if none
+  uint32_t readahead_next;   // Its next child to prefetch
+  uint32_t readahead_ahead;  // Prefetched leaves the cursor has not reached
 } Cursor;
 
 typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
@@ -66,23 +84,49 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
     INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                           INTERNAL_NODE_NUM_KEYS_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE +
+    INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_RIGHT_COUNT_SIZE;
 
 /*
  * Internal Node Body Layout
+ * The keys of the cells form one array and their children another right
+ * after it, so a search only reads keys. A third array holds the number
+ * of rows under each child, the right child's is in the header. The
+ * arrays have room for a cell more than a node holds: a node being bulk
+ * loaded keeps its last child as a cell until it is finished.
+ * Cells fill the page. Build with -DINTERNAL_NODE_MAX_KEYS=3 to get deep
+ * trees out of a few rows when testing splits and merges.
  */
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-/* Keep this small for testing */
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
-const uint32_t INTERNAL_NODE_LEFT_SPLIT_COUNT = 2;
-const uint32_t INTERNAL_NODE_RIGHT_SPLIT_COUNT =
-    (INTERNAL_NODE_MAX_CELLS + 1) - INTERNAL_NODE_LEFT_SPLIT_COUNT;
-const uint32_t INTERNAL_NODE_MIN_KEYS = 1;
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE +
+                                         INTERNAL_NODE_KEY_SIZE +
+                                         INTERNAL_NODE_COUNT_SIZE;
+#define INTERNAL_NODE_CELL_CAPACITY(page_size)                                 \
+  (((page_size) - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE)
+#define INTERNAL_NODE_CHILDREN_OFFSET(page_size)                               \
+  (INTERNAL_NODE_HEADER_SIZE +                                                 \
+   INTERNAL_NODE_CELL_CAPACITY(page_size) * INTERNAL_NODE_KEY_SIZE)
+#define INTERNAL_NODE_COUNTS_OFFSET(page_size)                                 \
+  (INTERNAL_NODE_CHILDREN_OFFSET(page_size) +                                  \
+   INTERNAL_NODE_CELL_CAPACITY(page_size) * INTERNAL_NODE_CHILD_SIZE)
+#ifdef INTERNAL_NODE_MAX_KEYS
+#define INTERNAL_NODE_MAX_CELLS(page_size)                                     \
+  ((void)(page_size), (uint32_t)INTERNAL_NODE_MAX_KEYS)
+#else
+#define INTERNAL_NODE_MAX_CELLS(page_size)                                     \
+  (INTERNAL_NODE_CELL_CAPACITY(page_size) - 1)
+#endif
+/* Children kept by the old node of a split, the new node gets the rest */
+#define INTERNAL_NODE_LEFT_SPLIT_COUNT(page_size)                              \
+  ((INTERNAL_NODE_MAX_CELLS(page_size) + 2) / 2)
+#define INTERNAL_NODE_MIN_KEYS(page_size)                                      \
+  (INTERNAL_NODE_MAX_CELLS(page_size) / 2)
 
 /*
  * Leaf Node Header Layout
@@ -92,26 +136,37 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+    LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE;
 
 /*
  * Leaf Node Body Layout
+ * The header is followed by the keys of the cells in order and then by
+ * an array of the same length pointing at their records, which are
+ * packed from the end of the page down towards it. Searches only read
+ * the keys. A slot is a key and its record pointer.
  */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
-const uint32_t LEAF_NODE_MIN_CELLS = LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEAF_NODE_RECORD_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_RECORD_OFFSET_OFFSET = 0;
+const uint32_t LEAF_NODE_RECORD_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_RECORD_SIZE_OFFSET =
+    LEAF_NODE_RECORD_OFFSET_OFFSET + LEAF_NODE_RECORD_OFFSET_SIZE;
+const uint32_t LEAF_NODE_RECORD_POINTER_SIZE =
+    LEAF_NODE_RECORD_OFFSET_SIZE + LEAF_NODE_RECORD_SIZE_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE =
+    LEAF_NODE_KEY_SIZE + LEAF_NODE_RECORD_POINTER_SIZE;
+#define LEAF_NODE_SPACE_FOR_CELLS(page_size)                                   \
+  ((page_size) - LEAF_NODE_HEADER_SIZE)
+#define LEAF_NODE_MAX_CELLS(page_size)                                         \
+  (LEAF_NODE_SPACE_FOR_CELLS(page_size) / (LEAF_NODE_SLOT_SIZE + ROW_MIN_SIZE))
+/* Leaves using less space merge with or borrow from a sibling */
+#define LEAF_NODE_MIN_SPACE_USED(page_size)                                    \
+  (LEAF_NODE_SPACE_FOR_CELLS(page_size) / 4)
 
 NodeType get_node_type(void *node) {
   uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
@@ -143,11 +198,43 @@ uint32_t *internal_node_right_child(void *node) {
   return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+uint32_t *internal_node_right_count(void *node) {
+  return node + INTERNAL_NODE_RIGHT_COUNT_OFFSET;
+}
+
+uint32_t *internal_node_key(void *node, uint32_t key_num) {
+  return node + INTERNAL_NODE_HEADER_SIZE + key_num * INTERNAL_NODE_KEY_SIZE;
+}
+
+/* Child of a cell, unlike internal_node_child never the right child */
+uint32_t *internal_node_cell(Table *table, void *node, uint32_t cell_num) {
+  return node + INTERNAL_NODE_CHILDREN_OFFSET(table->pager->page_size) +
+         cell_num * INTERNAL_NODE_CHILD_SIZE;
 }
 
-uint32_t *internal_node_child(void *node, uint32_t child_num) {
+/* Rows under the child of a cell */
+uint32_t *internal_node_cell_count(Table *table, void *node,
+                                   uint32_t cell_num) {
+  return node + INTERNAL_NODE_COUNTS_OFFSET(table->pager->page_size) +
+         cell_num * INTERNAL_NODE_COUNT_SIZE;
+}
+
+/* Copy cells, keys, children and counts, the ranges may overlap */
+void internal_node_move_cells(Table *table, void *destination,
+                              uint32_t destination_num, void *source,
+                              uint32_t source_num, uint32_t num_cells) {
+  memmove(internal_node_key(destination, destination_num),
+          internal_node_key(source, source_num),
+          num_cells * INTERNAL_NODE_KEY_SIZE);
+  memmove(internal_node_cell(table, destination, destination_num),
+          internal_node_cell(table, source, source_num),
+          num_cells * INTERNAL_NODE_CHILD_SIZE);
+  memmove(internal_node_cell_count(table, destination, destination_num),
+          internal_node_cell_count(table, source, source_num),
+          num_cells * INTERNAL_NODE_COUNT_SIZE);
+}
+
+uint32_t *internal_node_child(Table *table, void *node, uint32_t child_num) {
   uint32_t num_keys = *internal_node_num_keys(node);
   if (child_num > num_keys) {
     printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
@@ -155,12 +242,21 @@ uint32_t *internal_node_child(void *node, uint32_t child_num) {
   } else if (child_num == num_keys) {
     return internal_node_right_child(node);
   } else {
-    return internal_node_cell(node, child_num);
+    return internal_node_cell(table, node, child_num);
   }
 }
 
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-  return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+/* Rows under a child, like internal_node_child */
+uint32_t *internal_node_count(Table *table, void *node, uint32_t child_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys) {
+    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+    exit(EXIT_FAILURE);
+  } else if (child_num == num_keys) {
+    return internal_node_right_count(node);
+  } else {
+    return internal_node_cell_count(table, node, child_num);
+  }
 }
 
 uint32_t *leaf_node_num_cells(void *node) {
@@ -171,53 +267,54 @@ uint32_t *leaf_node_next_leaf(void *node) {
   return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
-void *leaf_node_cell(void *node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+uint32_t *leaf_node_content_start(void *node) {
+  return node + LEAF_NODE_CONTENT_START_OFFSET;
 }
 
 uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_KEY_SIZE;
 }
 
-void *leaf_node_value(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+/* The pointers follow the keys, so they move whenever a cell is added */
+void *leaf_node_record_pointer(void *node, uint32_t cell_num) {
+  return (void *)leaf_node_key(node, *leaf_node_num_cells(node)) +
+         cell_num * LEAF_NODE_RECORD_POINTER_SIZE;
 }
 
-void *get_page(Pager *pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
-  }
+uint16_t *leaf_node_record_offset(void *node, uint32_t cell_num) {
+  return leaf_node_record_pointer(node, cell_num) +
+         LEAF_NODE_RECORD_OFFSET_OFFSET;
+}
 
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void *page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+uint16_t *leaf_node_record_size(void *node, uint32_t cell_num) {
+  return leaf_node_record_pointer(node, cell_num) +
+         LEAF_NODE_RECORD_SIZE_OFFSET;
+}
 
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+void *leaf_node_value(void *node, uint32_t cell_num) {
+  return node + *leaf_node_record_offset(node, cell_num);
+}
 
-    // BUG?? Should be page_num < num_pages?
-    if (page_num < num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+/* Space a cell takes up, slot included */
+uint32_t leaf_node_cell_size(void *node, uint32_t cell_num) {
+  return LEAF_NODE_SLOT_SIZE + *leaf_node_record_size(node, cell_num);
+}
 
-    pager->pages[page_num] = page;
+/* Space between the slots and the records */
+uint32_t leaf_node_free_space(void *node) {
+  uint32_t slots_end = LEAF_NODE_HEADER_SIZE +
+                       *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+  return *leaf_node_content_start(node) - slots_end;
+}
 
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
-    }
+/* Space taken by live cells. Deleted records leave holes until compacted. */
+uint32_t leaf_node_space_used(void *node) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t space_used = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    space_used += leaf_node_cell_size(node, i);
   }
-
-  return pager->pages[page_num];
+  return space_used;
 }
 
 uint32_t get_node_max_key(Table *table, void *node) {
@@ -229,25 +326,191 @@ uint32_t get_node_max_key(Table *table, void *node) {
   case NODE_LEAF:
     return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
   }
+  printf("Unknown node type.\n");
+  exit(EXIT_FAILURE);
+}
+
+/* Rows in the subtree of node */
+uint32_t node_row_count(Table *table, void *node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return *leaf_node_num_cells(node);
+  }
+  uint32_t count = 0;
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    count += *internal_node_count(table, node, i);
+  }
+  return count;
 }
 
+uint32_t row_record_size(Row *row) {
+  return ROW_MIN_SIZE + strlen(row->username) + strlen(row->email);
+}
+
+void serialize_string(char *source, void **destination) {
+  uint8_t length = strlen(source);
+  memcpy(*destination, &length, STRING_LENGTH_SIZE);
+  memcpy(*destination + STRING_LENGTH_SIZE, source, length);
+  *destination += STRING_LENGTH_SIZE + length;
+}
+
+void deserialize_string(void **source, char *destination) {
+  uint8_t length;
+  memcpy(&length, *source, STRING_LENGTH_SIZE);
+  memcpy(destination, *source + STRING_LENGTH_SIZE, length);
+  destination[length] = '\0';
+  *source += STRING_LENGTH_SIZE + length;
+}
+
+/* Writes row_record_size(source) bytes */
 void serialize_row(Row *source, void *destination) {
   memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+  destination += ID_SIZE;
+  serialize_string(source->username, &destination);
+  serialize_string(source->email, &destination);
 }
 
 void deserialize_row(void *source, Row *destination) {
   memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+  source += ID_SIZE;
+  deserialize_string(&source, destination->username);
+  deserialize_string(&source, destination->email);
 }
 
-void initialize_leaf_node(void *node) {
+void initialize_leaf_node(Table *table, void *node) {
   set_node_type(node, NODE_LEAF);
   set_node_root(node, false);
   *leaf_node_num_cells(node) = 0;
   *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
+  *leaf_node_content_start(node) = table->pager->page_size;
+}
+
+/*
+Make room for a slot at cell_num. The record pointers move up by a key,
+those from cell_num on by a pointer as well.
+*/
+void leaf_node_open_slot(void *node, uint32_t cell_num) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  void *pointers = leaf_node_record_pointer(node, 0);
+  memmove(pointers + LEAF_NODE_KEY_SIZE +
+              (cell_num + 1) * LEAF_NODE_RECORD_POINTER_SIZE,
+          pointers + cell_num * LEAF_NODE_RECORD_POINTER_SIZE,
+          (num_cells - cell_num) * LEAF_NODE_RECORD_POINTER_SIZE);
+  memmove(pointers + LEAF_NODE_KEY_SIZE, pointers,
+          cell_num * LEAF_NODE_RECORD_POINTER_SIZE);
+  memmove(leaf_node_key(node, cell_num + 1), leaf_node_key(node, cell_num),
+          (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+  *leaf_node_num_cells(node) = num_cells + 1;
+}
+
+/* Remove the slot at cell_num, the reverse of leaf_node_open_slot */
+void leaf_node_close_slot(void *node, uint32_t cell_num) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  void *pointers = leaf_node_record_pointer(node, 0);
+  memmove(leaf_node_key(node, cell_num), leaf_node_key(node, cell_num + 1),
+          (num_cells - cell_num - 1) * LEAF_NODE_KEY_SIZE);
+  memmove(pointers - LEAF_NODE_KEY_SIZE, pointers,
+          cell_num * LEAF_NODE_RECORD_POINTER_SIZE);
+  memmove(pointers - LEAF_NODE_KEY_SIZE +
+              cell_num * LEAF_NODE_RECORD_POINTER_SIZE,
+          pointers + (cell_num + 1) * LEAF_NODE_RECORD_POINTER_SIZE,
+          (num_cells - cell_num - 1) * LEAF_NODE_RECORD_POINTER_SIZE);
+  *leaf_node_num_cells(node) = num_cells - 1;
+}
+
+/* Add a cell after the last one, the caller has checked there is room */
+void leaf_node_append(void *node, uint32_t key, void *record,
+                      uint32_t record_size) {
+  uint32_t cell_num = *leaf_node_num_cells(node);
+  leaf_node_open_slot(node, cell_num);
+  *leaf_node_content_start(node) -= record_size;
+  memcpy(node + *leaf_node_content_start(node), record, record_size);
+  *leaf_node_key(node, cell_num) = key;
+  *leaf_node_record_offset(node, cell_num) = *leaf_node_content_start(node);
+  *leaf_node_record_size(node, cell_num) = record_size;
+}
+
+/*
+A leaf cell detached from its page, used to move cells between leaves.
+record points into a copy of the page it came from.
+*/
+typedef struct {
+  uint32_t key;
+  void *record;
+  uint32_t record_size;
+} LeafCell;
+
+uint32_t leaf_node_collect(void *node, LeafCell *cells) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    cells[i].key = *leaf_node_key(node, i);
+    cells[i].record = leaf_node_value(node, i);
+    cells[i].record_size = *leaf_node_record_size(node, i);
+  }
+  return num_cells;
+}
+
+/* Replace the cells of node, keeping its header */
+void leaf_node_fill(Table *table, void *node, LeafCell *cells,
+                    uint32_t num_cells) {
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_content_start(node) = table->pager->page_size;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    leaf_node_append(node, cells[i].key, cells[i].record,
+                     cells[i].record_size);
+  }
+}
+
+/* Squeeze out the holes left by deleted records */
+void leaf_node_compact(Table *table, void *node) {
+  uint32_t page_size = table->pager->page_size;
+  uint8_t copy[page_size];
+  LeafCell cells[LEAF_NODE_MAX_CELLS(page_size)];
+  memcpy(copy, node, page_size);
+  uint32_t num_cells = leaf_node_collect(copy, cells);
+  leaf_node_fill(table, node, cells, num_cells);
+}
+
+/* Number of cells to put in the left one of two leaves sharing cells */
+uint32_t leaf_node_split_point(LeafCell *cells, uint32_t num_cells) {
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    total += LEAF_NODE_SLOT_SIZE + cells[i].record_size;
+  }
+  uint32_t split = 0;
+  uint32_t left = 0;
+  while (split < num_cells - 1 && left < total / 2) {
+    left += LEAF_NODE_SLOT_SIZE + cells[split].record_size;
+    split++;
+  }
+  return split > 0 ? split : 1;
+}
+
+/*
+Redistribute the cells of two neighbouring leaves. If they all fit into
+left they are merged there and false is returned, otherwise both end up
+using about the same space.
+*/
+bool leaf_node_rebalance(Table *table, void *left, void *right) {
+  uint32_t page_size = table->pager->page_size;
+  uint8_t left_copy[page_size];
+  uint8_t right_copy[page_size];
+  LeafCell cells[2 * LEAF_NODE_MAX_CELLS(page_size)];
+  memcpy(left_copy, left, page_size);
+  memcpy(right_copy, right, page_size);
+  uint32_t num_cells = leaf_node_collect(left_copy, cells);
+  num_cells += leaf_node_collect(right_copy, cells + num_cells);
+
+  if (leaf_node_space_used(left_copy) + leaf_node_space_used(right_copy) <=
+      LEAF_NODE_SPACE_FOR_CELLS(page_size)) {
+    leaf_node_fill(table, left, cells, num_cells);
+    leaf_node_fill(table, right, cells, 0);
+    return false;
+  }
+  uint32_t split = leaf_node_split_point(cells, num_cells);
+  leaf_node_fill(table, left, cells, split);
+  leaf_node_fill(table, right, cells + split, num_cells - split);
+  return true;
 }
 
 void initialize_internal_node(void *node) {
@@ -256,34 +519,26 @@ void initialize_internal_node(void *node) {
   *internal_node_num_keys(node) = 0;
 }
 
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
-  void *node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-
+Cursor *cursor_at(Table *table, uint32_t page_num, uint32_t cell_num) {
   Cursor *cursor = malloc(sizeof(Cursor));
   cursor->table = table;
   cursor->page_num = page_num;
+  cursor->cell_num = cell_num;
   cursor->end_of_table = false;
+  cursor->leaves_visited = 0;
+  cursor->readahead_parent = 0;
+  cursor->readahead_ahead = 0;
+  return cursor;
+}
 
-  // Binary search
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if (key == key_at_index) {
-      cursor->cell_num = index;
-      return cursor;
-    }
-    if (key < key_at_index) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
-    }
-  }
+Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
+  void *node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
 
-  cursor->cell_num = min_index;
-  return cursor;
+  // First cell with a key >= key, so that the first of several equal keys
+  // is found in index trees
+  return cursor_at(table, page_num,
+                   key_search(leaf_node_key(node, 0), num_cells, key));
 }
 
 uint32_t internal_node_find_key(void *node, uint32_t key) {
@@ -292,30 +547,17 @@ uint32_t internal_node_find_key(void *node, uint32_t key) {
   the given key.
   */
 
-  uint32_t num_keys = *internal_node_num_keys(node);
-
-  /* Binary search */
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; /* there is one more child than key */
-
-  while (min_index != max_index) {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
-      max_index = index;
-    } else {
-      min_index = index + 1;
-    }
-  }
-
-  return min_index;
+  /* First key >= key, past the last one is the right child */
+  return key_search(internal_node_key(node, 0), *internal_node_num_keys(node),
+                    key);
 }
 
-uint32_t internal_node_find_child(void *node, uint32_t child_page_num) {
+uint32_t internal_node_find_child(Table *table, void *node,
+                                  uint32_t child_page_num) {
   uint32_t num_keys = *internal_node_num_keys(node);
   uint32_t i;
   for (i = 0; i < num_keys; i++) {
-    if (*internal_node_child(node, i) == child_page_num) {
+    if (*internal_node_child(table, node, i) == child_page_num) {
       break;
     }
   }
@@ -326,9 +568,8 @@ Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
   void *node = get_page(table->pager, page_num);
 
   uint32_t child_index = internal_node_find_key(node, key);
-  printf("++ @internal_node_find, key(%d), child_index(%d)\n", key,
-         child_index);
-  uint32_t child_num = *internal_node_child(node, child_index);
+  TRACE(TRACE_LEVEL_PATH, TRACE_DESCENT, page_num, key, child_index);
+  uint32_t child_num = *internal_node_child(table, node, child_index);
   void *child = get_page(table->pager, child_num);
   switch (get_node_type(child)) {
   case NODE_LEAF:
@@ -336,12 +577,8 @@ Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
   case NODE_INTERNAL:
     return internal_node_find(table, child_num, key);
   }
-}
-
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_key(node, old_key);
-  if (old_child_index < *internal_node_num_keys(node))
-    *internal_node_key(node, old_child_index) = new_key;
+  printf("Unknown node type.\n");
+  exit(EXIT_FAILURE);
 }
 
 void set_internal_node_key(void *node, uint32_t key_index, uint32_t key) {
@@ -349,12 +586,84 @@ void set_internal_node_key(void *node, uint32_t key_index, uint32_t key) {
     *internal_node_key(node, key_index) = key;
 }
 
+/*
+Walk down the right edge of the tree to the rightmost leaf. Each key on
+the way routes smaller keys elsewhere, so the largest of them bounds the
+keys that reach the leaf from below. Splits and merges forget the result.
+*/
+uint32_t table_rightmost_leaf(Table *table) {
+  if (table->rightmost_page_num == 0) {
+    uint32_t page_num = table->root_page_num;
+    void *node = get_page(table->pager, page_num);
+    uint32_t low_key = 0;
+    while (get_node_type(node) == NODE_INTERNAL) {
+      uint32_t num_keys = *internal_node_num_keys(node);
+      if (num_keys > 0 && *internal_node_key(node, num_keys - 1) > low_key) {
+        low_key = *internal_node_key(node, num_keys - 1);
+      }
+      page_num = *internal_node_right_child(node);
+      node = get_page(table->pager, page_num);
+    }
+    table->rightmost_page_num = page_num;
+    table->rightmost_low_key = low_key;
+  }
+  return table->rightmost_page_num;
+}
+
+/*
+A node grew at its right end: store its new max key in the nearest
+ancestor that keeps one for it. Above that ancestor nothing changes.
+*/
+void node_update_max_key(Table *table, uint32_t page_num, uint32_t max_key) {
+  void *node = get_page(table->pager, page_num);
+  while (!is_node_root(node)) {
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = get_page(table->pager, parent_page_num);
+    uint32_t child_index = internal_node_find_child(table, parent, page_num);
+    if (child_index < *internal_node_num_keys(parent)) {
+      pager_mark_dirty(table->pager, parent_page_num);
+      *internal_node_key(parent, child_index) = max_key;
+      return;
+    }
+    page_num = parent_page_num;
+    node = parent;
+  }
+}
+
+/*
+The rows under a node changed: store its count in its parent, and the
+parent's in the grandparent, up to the root. Every other count must be
+right already, structural changes set the counts of the nodes they move.
+*/
+void node_update_count(Table *table, uint32_t page_num) {
+  void *node = get_page(table->pager, page_num);
+  while (!is_node_root(node)) {
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = get_page(table->pager, parent_page_num);
+    uint32_t *count = internal_node_count(
+        table, parent, internal_node_find_child(table, parent, page_num));
+    uint32_t new_count = node_row_count(table, node);
+    if (*count != new_count) {
+      pager_mark_dirty(table->pager, parent_page_num);
+      *count = new_count;
+    }
+    page_num = parent_page_num;
+    node = parent;
+  }
+}
+
 /*
 Return the position of the given key.
 If the key is not present, return the position
 where it should be inserted
 */
 Cursor *table_find(Table *table, uint32_t key) {
+  // Ids mostly grow, the largest ones skip the descent
+  uint32_t rightmost_page_num = table_rightmost_leaf(table);
+  if (key > table->rightmost_low_key) {
+    return leaf_node_find(table, rightmost_page_num, key);
+  }
+
   uint32_t root_page_num = table->root_page_num;
   void *root_node = get_page(table->pager, root_page_num);
 
@@ -375,137 +684,298 @@ Cursor *table_start(Table *table) {
   return cursor;
 }
 
-void *cursor_value(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
-}
-
-void cursor_advance(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *node = get_page(cursor->table->pager, page_num);
+/*
+Position the cursor on the first row with an id >= key. table_find may
+land past the last cell of a leaf, the row is then at the start of the
+next one.
+*/
+Cursor *table_seek(Table *table, uint32_t key) {
+  Cursor *cursor = table_find(table, key);
 
-  cursor->cell_num += 1;
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    /* Advance to next leaf node */
+  void *node = get_page(table->pager, cursor->page_num);
+  while (cursor->cell_num >= *leaf_node_num_cells(node)) {
     uint32_t next_page_num = *leaf_node_next_leaf(node);
-    printf("page %d next page %d\n", page_num, next_page_num);
     if (next_page_num == 0) {
-      /* This was rightmost leaf */
       cursor->end_of_table = true;
-    } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+      break;
     }
+    pager_unpin(table->pager, cursor->page_num);
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+    node = get_page(table->pager, next_page_num);
   }
+
+  return cursor;
 }
 
-Pager *pager_open(const char *filename) {
-  int fd = open(filename,
-                O_RDWR |     // Read/Write mode
-                    O_CREAT, // Create file if it does not exist
-                S_IWUSR |    // User write permission
-                    S_IRUSR  // User read permission
-                );
+/*
+Order statistics on the pages as they are, for writers, like
+snapshot_rank and snapshot_cursor_seek_nth for readers.
+*/
+
+/* Rows with a key below key */
+uint32_t table_rank(Table *table, uint32_t key) {
+  void *node = get_page(table->pager, table->root_page_num);
+  uint32_t rank = 0;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_key(node, key);
+    for (uint32_t i = 0; i < child_index; i++) {
+      rank += *internal_node_count(table, node, i);
+    }
+    uint32_t child_page_num = *internal_node_child(table, node, child_index);
+    node = get_page(table->pager, child_page_num);
+  }
+  return rank +
+         key_search(leaf_node_key(node, 0), *leaf_node_num_cells(node), key);
+}
 
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+/*
+Position a cursor on the row with n rows before it, or with n the number
+of rows on the end of the last leaf. Where n falls between two leaves
+the cursor goes to the second, unless it is for inserting key and key
+is no larger than the separator between them: the row then goes on the
+end of the first, so that every key stays where internal_node_find_key
+routes it.
+*/
+Cursor *table_seek_nth(Table *table, uint32_t n, bool insert, uint32_t key) {
+  uint32_t page_num = table->root_page_num;
+  void *node = get_page(table->pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t child_index = 0;
+    while (child_index < num_keys) {
+      uint32_t count = *internal_node_count(table, node, child_index);
+      if (n < count || (insert && n == count &&
+                        key <= *internal_node_key(node, child_index))) {
+        break;
+      }
+      n -= count;
+      child_index++;
+    }
+    page_num = *internal_node_child(table, node, child_index);
+    node = get_page(table->pager, page_num);
   }
+  Cursor *cursor = cursor_at(table, page_num, n);
+  cursor->end_of_table = n >= *leaf_node_num_cells(node);
+  return cursor;
+}
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
+void *cursor_value(Cursor *cursor) {
+  uint32_t page_num = cursor->page_num;
+  void *page = get_page(cursor->table->pager, page_num);
+  return leaf_node_value(page, cursor->cell_num);
+}
 
-  Pager *pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
+/* Leaves a cursor steps onto before it counts as scanning */
+#define CURSOR_READAHEAD_THRESHOLD 2
+/* Leaves a scanning cursor keeps prefetched ahead of itself */
+#define CURSOR_READAHEAD_LEAVES 16
 
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
+/*
+Prefetch the leaves after the cursor's one. They are the next children of
+its parent, which knows their page numbers long before the leaf chain
+gets there. A new window goes out once half of the last one was used.
+*/
+void cursor_readahead(Cursor *cursor) {
+  Table *table = cursor->table;
+  Pager *pager = cursor->table->pager;
+  void *leaf = get_page(pager, cursor->page_num);
+  if (is_node_root(leaf)) {
+    return;
+  }
+  uint32_t parent_page_num = *node_parent(leaf);
+  void *parent = get_page(pager, parent_page_num);
+  if (parent_page_num != cursor->readahead_parent) {
+    cursor->readahead_parent = parent_page_num;
+    cursor->readahead_next =
+        internal_node_find_child(table, parent, cursor->page_num) + 1;
+    cursor->readahead_ahead = 0;
+  } else if (cursor->readahead_ahead > 0) {
+    cursor->readahead_ahead--;
+  }
+  if (cursor->readahead_ahead >= CURSOR_READAHEAD_LEAVES / 2) {
+    return;
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+  uint32_t page_nums[CURSOR_READAHEAD_LEAVES];
+  uint32_t num_pages = 0;
+  uint32_t num_children = *internal_node_num_keys(parent) + 1;
+  while (cursor->readahead_ahead + num_pages < CURSOR_READAHEAD_LEAVES &&
+         cursor->readahead_next < num_children) {
+    page_nums[num_pages++] =
+        *internal_node_child(table, parent, cursor->readahead_next++);
   }
+  pager_prefetch(pager, page_nums, num_pages);
+  cursor->readahead_ahead += num_pages;
+}
 
-  return pager;
+/* Move to the first cell of the next leaf, for scans taking whole leaves */
+void cursor_next_leaf(Cursor *cursor) {
+  uint32_t page_num = cursor->page_num;
+  void *node = get_page(cursor->table->pager, page_num);
+  uint32_t next_page_num = *leaf_node_next_leaf(node);
+  TRACE(TRACE_LEVEL_PATH, TRACE_NEXT_LEAF, page_num, next_page_num, 0);
+  if (next_page_num == 0) {
+    /* This was rightmost leaf */
+    cursor->end_of_table = true;
+  } else {
+    /* Scans only hold on to the leaf they are positioned on */
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+    if (++cursor->leaves_visited < CURSOR_READAHEAD_THRESHOLD) {
+      pager_unpin(cursor->table->pager, page_num);
+    } else {
+      pager_unpin_cold(cursor->table->pager, page_num);
+      cursor_readahead(cursor);
+    }
+  }
 }
 
-Table *db_open(const char *filename) {
-  Pager *pager = pager_open(filename);
+void cursor_advance(Cursor *cursor) {
+  void *node = get_page(cursor->table->pager, cursor->page_num);
+
+  cursor->cell_num += 1;
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    cursor_next_leaf(cursor);
+  }
+}
 
+/* The table and its indexes are all trees over the same pager */
+Table *table_new(Pager *pager, uint32_t root_page_num) {
   Table *table = malloc(sizeof(Table));
   table->pager = pager;
-  table->root_page_num = 0;
-
-  if (pager->num_pages == 0) {
-    // New database file. Initialize page 0 as leaf node.
-    void *root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+  table->root_page_num = root_page_num;
+  table->rightmost_page_num = 0;
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    table->indexes[i] = NULL;
   }
-
+  // Writers waiting on readers go first, or a stream of reads starves them
+  pthread_rwlockattr_t attributes;
+  pthread_rwlockattr_init(&attributes);
+  pthread_rwlockattr_setkind_np(&attributes,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&table->structure_latch, &attributes);
+  pthread_rwlockattr_destroy(&attributes);
+  pthread_mutex_init(&table->writer, NULL);
   return table;
 }
 
-void pager_flush(Pager *pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+void table_free(Table *table) {
+  if (table == NULL) {
+    return;
   }
+  pthread_rwlock_destroy(&table->structure_latch);
+  pthread_mutex_destroy(&table->writer);
+  free(table);
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+/*
+Put every page of a tree on the free list. Only internal nodes are read,
+the leaves below them are freed by page number, levels being the number
+of levels from page_num down to the leaves.
+*/
+void tree_free_pages(Table *table, uint32_t page_num, uint32_t levels) {
+  if (levels > 1) {
+    void *node = get_page(table->pager, page_num);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      uint32_t child_page_num = i < num_keys
+                                    ? *internal_node_child(table, node, i)
+                                    : *internal_node_right_child(node);
+      tree_free_pages(table, child_page_num, levels - 1);
+    }
   }
+  pager_free_page(table->pager, page_num);
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+/* Free a tree of the table's pager nothing points to, see index_create */
+void tree_free(Table *table, uint32_t root_page_num) {
+  uint32_t levels = 1;
+  void *node = get_page(table->pager, root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    node = get_page(table->pager, *internal_node_child(table, node, 0));
+    levels++;
   }
+  tree_free_pages(table, root_page_num, levels);
 }
 
-void db_close(Table *table) {
-  Pager *pager = table->pager;
+Table *db_open_with_options(const char *filename, PagerOptions *options) {
+  Pager *pager = pager_open(filename, options);
+  if (options->concurrent) {
+    // Pick the search kernels now rather than in racing threads
+    key_search_kernel();
+    string_find_kernel();
+  }
 
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
+  Table *table = table_new(pager, 0);
+
+  bool new_file = (pager->num_pages == 0);
+  void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+  if (new_file) {
+    // New database file. Write the header and initialize page 1 as leaf node.
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    strcpy(db_header_magic(header), DB_HEADER_MAGIC);
+    *db_header_page_size(header) = pager->page_size;
+    *db_header_root_page(header) = 1;
+    *db_header_freelist_trunk(header) = 0;
+    *db_header_freelist_count(header) = 0;
+    for (uint32_t i = 0; i < DB_HEADER_MAX_INDEXES; i++) {
+      *db_header_index_root(header, i) = 0;
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
-  }
 
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
+    void *root_node = get_page(pager, 1);
+    pager_mark_dirty(pager, 1);
+    initialize_leaf_node(table, root_node);
+    set_node_root(root_node, true);
+  } else if (strcmp(db_header_magic(header), DB_HEADER_MAGIC) != 0) {
+    printf("Db file has no valid header. Unsupported file format.\n");
     exit(EXIT_FAILURE);
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void *page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+  if (*db_header_index_build_root(header) != 0) {
+    // A create index was cut short, its partial tree is of no use
+    tree_free(table, *db_header_index_build_root(header));
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    *db_header_index_build_root(header) = 0;
+  }
+  table->root_page_num = *db_header_root_page(header);
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    uint32_t index_root_page_num = *db_header_index_root(header, i);
+    if (index_root_page_num != 0) {
+      table->indexes[i] = table_new(pager, index_root_page_num);
     }
   }
-  free(pager);
-  free(table);
+  pager_end_statement(pager);
+  if (new_file) {
+    // The page size is read from the file before the log is replayed
+    pager_checkpoint(pager);
+  }
+
+  return table;
+}
+
+Table *db_open(const char *filename) {
+  PagerOptions options = default_pager_options();
+  return db_open_with_options(filename, &options);
+}
+
+void db_close(Table *table) {
+  pager_close(table->pager);
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    table_free(table->indexes[i]);
+  }
+  table_free(table);
 }
 
 /*
-Until we start recycling free pages, new pages will always
+Pages freed by merges are recycled first, otherwise new pages
 go onto the end of the database file
 */
-uint32_t get_unused_page_num(Pager *pager) { return pager->num_pages; }
+uint32_t get_unused_page_num(Pager *pager) {
+  return pager_allocate_page(pager);
+}
 
 void create_new_root(Table *table, uint32_t right_child_page_num) {
+  uint32_t page_size = table->pager->page_size;
   /*
   Handle splitting the root.
   Old root copied to new page, becomes left child.
@@ -513,25 +983,31 @@ void create_new_root(Table *table, uint32_t right_child_page_num) {
   Re-initialize root page to contain the new root node.
   New root node points to two children.
   */
+  table->rightmost_page_num = 0;
 
   void *root = get_page(table->pager, table->root_page_num);
+  pager_mark_dirty(table->pager, table->root_page_num);
   void *right_child = get_page(table->pager, right_child_page_num);
+  pager_mark_dirty(table->pager, right_child_page_num);
   uint32_t left_child_page_num = get_unused_page_num(table->pager);
   void *left_child = get_page(table->pager, left_child_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
 
   /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
+  memcpy(left_child, root, page_size);
   set_node_root(left_child, false);
 
   /* Root node is a new internal node with one key and two children */
   initialize_internal_node(root);
   set_node_root(root, true);
   *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
+  *internal_node_child(table, root, 0) = left_child_page_num;
   // FIXME
   uint32_t left_child_max_key = get_node_max_key(table, left_child);
   *internal_node_key(root, 0) = left_child_max_key;
   *internal_node_right_child(root) = right_child_page_num;
+  *internal_node_count(table, root, 0) = node_row_count(table, left_child);
+  *internal_node_right_count(root) = node_row_count(table, right_child);
   *node_parent(left_child) = table->root_page_num;
   *node_parent(right_child) = table->root_page_num;
 
@@ -540,200 +1016,226 @@ void create_new_root(Table *table, uint32_t right_child_page_num) {
   }
   uint32_t num = *internal_node_num_keys(left_child);
   for (uint32_t i = 0; i < num; i++) {
-    uint32_t child_page_num = *internal_node_child(left_child, i);
+    uint32_t child_page_num = *internal_node_child(table, left_child, i);
     void *child = get_page(table->pager, child_page_num);
+    pager_mark_dirty(table->pager, child_page_num);
     *node_parent(child) = left_child_page_num;
   }
   uint32_t child_page_num = *internal_node_right_child(left_child);
   void *child = get_page(table->pager, child_page_num);
+  pager_mark_dirty(table->pager, child_page_num);
   *node_parent(child) = left_child_page_num;
 }
 
+/* Is the node on the path from the root to the rightmost leaf? */
+bool node_is_right_edge(Table *table, uint32_t page_num) {
+  void *node = get_page(table->pager, page_num);
+  while (!is_node_root(node)) {
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = get_page(table->pager, parent_page_num);
+    if (*internal_node_right_child(parent) != page_num) {
+      return false;
+    }
+    page_num = parent_page_num;
+    node = parent;
+  }
+  return true;
+}
+
 uint32_t internal_node_split(Table *table, uint32_t parent_page_num,
-                             uint32_t child_page_num) {
-  printf("@internal_node_split: parent_page_num(%d), child_page_num(%d)\n",
-         parent_page_num, child_page_num);
+                             uint32_t index, uint32_t child_page_num) {
+  uint32_t page_size = table->pager->page_size;
+  /*
+  Split a full node while adding child_page_num as its child number index.
+  The old node keeps the first INTERNAL_NODE_LEFT_SPLIT_COUNT children and
+  the rest move to a new node, whose page number is returned. A child
+  appended to the right edge of the tree leaves the old node full instead:
+  growing ids never come back to it, half of it would stay empty.
+  */
   void *old_node = get_page(table->pager, parent_page_num);
-  uint32_t old_max = get_node_max_key(table, old_node);
-  uint32_t old_right_child_page_num = *internal_node_right_child(old_node);
-  void *child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(table, child);
-  uint32_t index = internal_node_find_key(old_node, child_max_key);
+  pager_mark_dirty(table->pager, parent_page_num);
   uint32_t new_page_num = get_unused_page_num(table->pager);
+  TRACE(TRACE_LEVEL_STRUCTURE, TRACE_INTERNAL_SPLIT, parent_page_num,
+        new_page_num, child_page_num);
+  STATS_ADD(&table->pager->stats, internal_splits, 1);
   void *new_node = get_page(table->pager, new_page_num);
+  pager_mark_dirty(table->pager, new_page_num);
   initialize_internal_node(new_node);
   set_node_root(new_node, false);
   *node_parent(new_node) = *node_parent(old_node);
 
-  uint32_t right_child_page_num;
-  void *right_child;
-  uint32_t right_child_max_key;
-  bool right_child_split = false;
-  uint32_t t_child_page_num, t_parent_page_num;
-  void *t_child;
-
-  if (index == INTERNAL_NODE_MAX_CELLS) {
-    right_child_page_num = *internal_node_right_child(old_node);
-    right_child = get_page(table->pager, right_child_page_num);
-    right_child_max_key = get_node_max_key(table, right_child);
-    if (child_max_key > right_child_max_key) {
-      right_child_split = true;
+  /* Line up all children with their keys, the new child included */
+  uint32_t num_children = INTERNAL_NODE_MAX_CELLS(page_size) + 2;
+  uint32_t left_split_count = INTERNAL_NODE_LEFT_SPLIT_COUNT(page_size);
+  if (index == num_children - 1 && node_is_right_edge(table, parent_page_num)) {
+    left_split_count = num_children - 2;
+  }
+  uint32_t children[num_children];
+  uint32_t keys[num_children];
+  uint32_t counts[num_children];
+  void *child = get_page(table->pager, child_page_num);
+  uint32_t child_max_key = get_node_max_key(table, child);
+  uint32_t old_right_child_page_num = *internal_node_right_child(old_node);
+  void *old_right_child = get_page(table->pager, old_right_child_page_num);
+  uint32_t old_right_child_max_key = get_node_max_key(table, old_right_child);
+  for (uint32_t i = 0, j = 0; i < num_children; i++) {
+    if (i == index) {
+      children[i] = child_page_num;
+      keys[i] = child_max_key;
+      counts[i] = node_row_count(table, child);
+    } else if (j == INTERNAL_NODE_MAX_CELLS(page_size)) {
+      children[i] = old_right_child_page_num;
+      keys[i] = old_right_child_max_key;
+      counts[i] = *internal_node_right_count(old_node);
+      j++;
+    } else {
+      children[i] = *internal_node_child(table, old_node, j);
+      keys[i] = *internal_node_key(old_node, j);
+      counts[i] = *internal_node_cell_count(table, old_node, j);
+      j++;
     }
   }
 
-  *internal_node_num_keys(old_node) = INTERNAL_NODE_LEFT_SPLIT_COUNT;
-  *internal_node_num_keys(new_node) = INTERNAL_NODE_RIGHT_SPLIT_COUNT;
-  for (int32_t i = INTERNAL_NODE_MAX_CELLS; i >= 0; i--) {
-    void *destination_node;
-    if (i >= INTERNAL_NODE_LEFT_SPLIT_COUNT) {
+  *internal_node_num_keys(old_node) = left_split_count - 1;
+  *internal_node_num_keys(new_node) = num_children - left_split_count - 1;
+  for (uint32_t i = 0; i < num_children; i++) {
+    void *destination_node = old_node;
+    uint32_t destination_page_num = parent_page_num;
+    uint32_t index_within_node = i;
+    if (i >= left_split_count) {
       destination_node = new_node;
-      t_parent_page_num = new_page_num;
-    } else {
-      destination_node = old_node;
-      t_parent_page_num = parent_page_num;
+      destination_page_num = new_page_num;
+      index_within_node = i - left_split_count;
     }
-    uint32_t index_within_node = i % INTERNAL_NODE_LEFT_SPLIT_COUNT;
-    void *destination = internal_node_cell(destination_node, index_within_node);
-    if (i == index) {
-      if (!right_child_split) {
-        *internal_node_child(destination_node, index_within_node) =
-            child_page_num;
-        *internal_node_key(destination_node, index_within_node) = child_max_key;
-      } else {
-        *internal_node_child(destination_node, index_within_node) =
-            right_child_page_num;
-        *internal_node_key(destination_node, index_within_node) =
-            right_child_max_key;
-      }
-    } else if (i > index) {
-      memcpy(destination, internal_node_cell(old_node, i - 1),
-             INTERNAL_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, internal_node_cell(old_node, i),
-             INTERNAL_NODE_CELL_SIZE);
+    *internal_node_child(table, destination_node, index_within_node) =
+        children[i];
+    *internal_node_count(table, destination_node, index_within_node) =
+        counts[i];
+    if (index_within_node < *internal_node_num_keys(destination_node)) {
+      *internal_node_key(destination_node, index_within_node) = keys[i];
     }
 
-    t_child_page_num =
-        *internal_node_child(destination_node, index_within_node);
-    t_child = get_page(table->pager, t_child_page_num);
-    *node_parent(t_child) = t_parent_page_num;
-  }
-
-  // Copy the rightmost cell's child as right child
-  *internal_node_right_child(old_node) =
-      *internal_node_child(old_node, INTERNAL_NODE_LEFT_SPLIT_COUNT - 1);
-  *internal_node_num_keys(old_node) = INTERNAL_NODE_LEFT_SPLIT_COUNT - 1;
-  *internal_node_num_keys(new_node) = INTERNAL_NODE_RIGHT_SPLIT_COUNT;
-  if (right_child_split) {
-    *internal_node_right_child(new_node) = child_page_num;
-    t_child = get_page(table->pager, child_page_num);
-    *node_parent(t_child) = new_page_num;
-  } else {
-    *internal_node_right_child(new_node) = old_right_child_page_num;
-    t_child = get_page(table->pager, old_right_child_page_num);
-    *node_parent(t_child) = new_page_num;
+    void *t_child = get_page(table->pager, children[i]);
+    pager_mark_dirty(table->pager, children[i]);
+    *node_parent(t_child) = destination_page_num;
   }
 
   return new_page_num;
 }
 
 void internal_node_insert(Table *table, uint32_t parent_page_num,
+                          uint32_t left_child_page_num,
                           uint32_t child_page_num) {
+  uint32_t page_size = table->pager->page_size;
   /*
-  Add a new child/key pair to parent that corresponds to child
+  Add a new child/key pair to parent that corresponds to child.
+  The child goes right after left_child, the node it was split from.
+  Placing it by position rather than by key keeps equal keys in order.
   */
 
+  table->rightmost_page_num = 0;
   void *parent = get_page(table->pager, parent_page_num);
   uint32_t original_num_keys = *internal_node_num_keys(parent);
+  uint32_t index =
+      internal_node_find_child(table, parent, left_child_page_num) + 1;
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    uint32_t old_max = get_node_max_key(table, parent);
+  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS(page_size)) {
     uint32_t new_page_num =
-        internal_node_split(table, parent_page_num, child_page_num);
+        internal_node_split(table, parent_page_num, index, child_page_num);
 
     if (is_node_root(parent)) {
       return create_new_root(table, new_page_num);
     } else {
-      parent_page_num = *node_parent(parent);
+      uint32_t grandparent_page_num = *node_parent(parent);
       uint32_t new_max = get_node_max_key(table, parent);
-      parent = get_page(table->pager, parent_page_num);
-      update_internal_node_key(parent, old_max, new_max);
-      internal_node_insert(table, parent_page_num, new_page_num);
+      void *grandparent = get_page(table->pager, grandparent_page_num);
+      pager_mark_dirty(table->pager, grandparent_page_num);
+      uint32_t parent_index =
+          internal_node_find_child(table, grandparent, parent_page_num);
+      set_internal_node_key(grandparent, parent_index, new_max);
+      *internal_node_count(table, grandparent, parent_index) =
+          node_row_count(table, parent);
+      internal_node_insert(table, grandparent_page_num, parent_page_num,
+                           new_page_num);
     }
     return;
   }
 
   void *child = get_page(table->pager, child_page_num);
   uint32_t child_max_key = get_node_max_key(table, child);
-  uint32_t index = internal_node_find_key(parent, child_max_key);
 
+  pager_mark_dirty(table->pager, parent_page_num);
   *internal_node_num_keys(parent) = original_num_keys + 1;
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void *right_child = get_page(table->pager, right_child_page_num);
 
-  if (child_max_key > get_node_max_key(table, right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+  if (index > original_num_keys) {
+    /* Split the right child, the new child replaces it */
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    void *right_child = get_page(table->pager, right_child_page_num);
+    *internal_node_child(table, parent, original_num_keys) =
+        right_child_page_num;
     *internal_node_key(parent, original_num_keys) =
         get_node_max_key(table, right_child);
+    *internal_node_count(table, parent, original_num_keys) =
+        *internal_node_right_count(parent);
     *internal_node_right_child(parent) = child_page_num;
+    *internal_node_right_count(parent) = node_row_count(table, child);
   } else {
     /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void *destination = internal_node_cell(parent, i);
-      void *source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-    }
-    *internal_node_child(parent, index) = child_page_num;
+    internal_node_move_cells(table, parent, index + 1, parent, index,
+                             original_num_keys - index);
+    *internal_node_child(table, parent, index) = child_page_num;
     *internal_node_key(parent, index) = child_max_key;
+    *internal_node_count(table, parent, index) = node_row_count(table, child);
   }
 }
 
 void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
+  Table *table = cursor->table;
+  uint32_t page_size = table->pager->page_size;
   /*
-  Create a new node and move half the cells over.
+  Create a new node and move the upper half of the cells over.
   Insert the new value in one of the two nodes.
   Update parent or create a new parent.
   */
 
   void *old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(cursor->table, old_node);
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
   uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
   void *new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
+  pager_mark_dirty(cursor->table->pager, new_page_num);
+  TRACE(TRACE_LEVEL_STRUCTURE, TRACE_LEAF_SPLIT, cursor->page_num,
+        new_page_num, key);
+  STATS_ADD(&cursor->table->pager->stats, leaf_splits, 1);
+  initialize_leaf_node(table, new_node);
   *node_parent(new_node) = *node_parent(old_node);
   *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
   *leaf_node_next_leaf(old_node) = new_page_num;
 
   /*
-  All existing keys plus new key should should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
+  All existing cells plus the new one are divided between old (left) and
+  new (right) nodes so that both use about the same space. A row appended
+  past the end of the rightmost leaf goes into the new node on its own,
+  leaving the old one full for good.
   */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void *destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
-    } else {
-      destination_node = old_node;
-    }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void *destination = leaf_node_cell(destination_node, index_within_node);
-
-    if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
-    }
-  }
-
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  bool append = *leaf_node_next_leaf(new_node) == 0 &&
+                cursor->cell_num == *leaf_node_num_cells(old_node);
+  uint8_t old_copy[page_size];
+  uint8_t record[ROW_MAX_SIZE];
+  LeafCell cells[LEAF_NODE_MAX_CELLS(page_size) + 1];
+  memcpy(old_copy, old_node, page_size);
+  serialize_row(value, record);
+  uint32_t num_cells = leaf_node_collect(old_copy, cells);
+  memmove(&cells[cursor->cell_num + 1], &cells[cursor->cell_num],
+          (num_cells - cursor->cell_num) * sizeof(LeafCell));
+  cells[cursor->cell_num].key = key;
+  cells[cursor->cell_num].record = record;
+  cells[cursor->cell_num].record_size = row_record_size(value);
+  num_cells++;
+
+  uint32_t split =
+      append ? num_cells - 1 : leaf_node_split_point(cells, num_cells);
+  leaf_node_fill(table, old_node, cells, split);
+  leaf_node_fill(table, new_node, cells + split, num_cells - split);
 
   if (is_node_root(old_node)) {
     return create_new_root(cursor->table, new_page_num);
@@ -741,96 +1243,611 @@ void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
     uint32_t parent_page_num = *node_parent(old_node);
     uint32_t new_max = get_node_max_key(cursor->table, old_node);
     void *parent = get_page(cursor->table->pager, parent_page_num);
-
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    pager_mark_dirty(cursor->table->pager, parent_page_num);
+
+    set_internal_node_key(
+        parent, internal_node_find_child(table, parent, cursor->page_num),
+        new_max);
+    internal_node_insert(cursor->table, parent_page_num, cursor->page_num,
+                         new_page_num);
+    node_update_count(cursor->table, cursor->page_num);
+    node_update_count(cursor->table, new_page_num);
     return;
   }
 }
 
+/* Does a record fit, compacting the leaf if need be? */
+bool leaf_node_has_room(Table *table, void *node, uint32_t record_size) {
+  uint32_t page_size = table->pager->page_size;
+  return LEAF_NODE_SPACE_FOR_CELLS(page_size) - leaf_node_space_used(node) >=
+         LEAF_NODE_SLOT_SIZE + record_size;
+}
+
 void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
+  Table *table = cursor->table;
   void *node = get_page(cursor->table->pager, cursor->page_num);
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
+
+  uint32_t record_size = row_record_size(value);
+  if (leaf_node_free_space(node) < LEAF_NODE_SLOT_SIZE + record_size) {
+    if (!leaf_node_has_room(table, node, record_size)) {
+      // Node full
+      leaf_node_split_and_insert(cursor, key, value);
+      return;
+    }
+    leaf_node_compact(table, node);
+  }
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    // Node full
-    leaf_node_split_and_insert(cursor, key, value);
+  leaf_node_open_slot(node, cursor->cell_num);
+  *leaf_node_content_start(node) -= record_size;
+  serialize_row(value, node + *leaf_node_content_start(node));
+  *(leaf_node_key(node, cursor->cell_num)) = key;
+  *leaf_node_record_offset(node, cursor->cell_num) =
+      *leaf_node_content_start(node);
+  *leaf_node_record_size(node, cursor->cell_num) = record_size;
+  node_update_count(cursor->table, cursor->page_num);
+}
+
+/*
+Page number of the leaf key belongs in, like table_find, and the largest
+key that leaf may hold: the tightest separator above it, UINT32_MAX along
+the right edge of the tree.
+*/
+uint32_t table_find_leaf(Table *table, uint32_t key, uint32_t *max_key) {
+  uint32_t page_num = table->root_page_num;
+  void *node = get_page(table->pager, page_num);
+  *max_key = UINT32_MAX;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_key(node, key);
+    TRACE(TRACE_LEVEL_PATH, TRACE_DESCENT, page_num, key, child_index);
+    if (child_index < *internal_node_num_keys(node) &&
+        *internal_node_key(node, child_index) < *max_key) {
+      *max_key = *internal_node_key(node, child_index);
+    }
+    page_num = *internal_node_child(table, node, child_index);
+    node = get_page(table->pager, page_num);
+  }
+  return page_num;
+}
+
+void table_unlatch_page(Table *table, uint32_t page_num) {
+  pager_release(table->pager, page_num);
+  pager_unlatch(table->pager, page_num);
+}
+
+/*
+Library mode reads. Descend to the leaf key belongs in with latch
+crabbing: each child is latched shared before its parent is released, so
+a leaf the writer splits is seen whole before or after, never with its
+upper half moved out and not yet in the parent. The leaf comes back
+latched and pinned, table_unlatch_page lets go of it.
+*/
+uint32_t table_latch_leaf(Table *table, uint32_t key, void **leaf) {
+  Pager *pager = table->pager;
+  uint32_t page_num = table->root_page_num;
+  pager_latch_shared(pager, page_num);
+  void *node = pager_acquire(pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_num =
+        *internal_node_child(table, node, internal_node_find_key(node, key));
+    pager_latch_shared(pager, child_num);
+    void *child = pager_acquire(pager, child_num);
+    table_unlatch_page(table, page_num);
+    page_num = child_num;
+    node = child;
+  }
+  *leaf = node;
+  return page_num;
+}
+
+/*
+Library mode writes beside readers. Latch the pages inserting key
+changes: its leaf, and the leaf's parent as well when the leaf is full
+and splits. A split going on past the parent, or splitting the root,
+changes the shape of the tree and is refused. The writer is the only
+thread changing pages, it finds the leaf and reads it without latches
+and only keeps readers out while it writes. The first latch taken is
+waited for, later ones are given up on when busy, see
+pager_latch_exclusive. Latched pages are added to latched.
+Returns false if the insert has to be done under the exclusive
+structure latch.
+*/
+bool table_latch_leaf_for_insert(Table *table, uint32_t page_num,
+                                 uint32_t record_size, uint32_t *latched,
+                                 uint32_t *num_latched) {
+  uint32_t page_size = table->pager->page_size;
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+
+  uint32_t pages[2];
+  uint32_t num_pages = 0;
+  if (!leaf_node_has_room(table, node, record_size)) {
+    if (is_node_root(node)) {
+      return false;
+    }
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = get_page(pager, parent_page_num);
+    if (*internal_node_num_keys(parent) >= INTERNAL_NODE_MAX_CELLS(page_size)) {
+      return false;
+    }
+    pages[num_pages++] = parent_page_num;
+  }
+  pages[num_pages++] = page_num;
+
+  for (uint32_t i = 0; i < num_pages; i++) {
+    if (!pager_latch_exclusive(pager, pages[i], *num_latched > 0)) {
+      return false;
+    }
+    latched[(*num_latched)++] = pages[i];
+  }
+  return true;
+}
+
+/*
+Latch for inserting key, see table_latch_leaf_for_insert. Returns a
+cursor at the insert position, or NULL if the insert has to be done
+under the exclusive structure latch.
+*/
+Cursor *table_latch_for_insert(Table *table, uint32_t key, uint32_t record_size,
+                               uint32_t *latched, uint32_t *num_latched) {
+  uint32_t max_key;
+  uint32_t page_num = table_find_leaf(table, key, &max_key);
+  if (!table_latch_leaf_for_insert(table, page_num, record_size, latched,
+                                   num_latched)) {
+    return NULL;
+  }
+  return leaf_node_find(table, page_num, key);
+}
+
+/*
+Library mode scans over a snapshot, see pager_read_snapshot. The cursor
+reads each page into a copy of its own and takes no latches: the writer
+never waits for it, and it sees the tree as it was when the snapshot
+began however far the writer has got since.
+*/
+typedef struct {
+  Table *table;
+  uint64_t snapshot;
+  uint32_t page_num;
+  uint32_t cell_num;
+  bool end_of_table;
+  void *node; // page_num as of the snapshot
+} SnapshotCursor;
+
+/* Step onto the next leaf while the cursor is past the cells of its one */
+void snapshot_cursor_skip_empty(SnapshotCursor *cursor) {
+  Pager *pager = cursor->table->pager;
+  while (cursor->cell_num >= *leaf_node_num_cells(cursor->node)) {
+    uint32_t next_page_num = *leaf_node_next_leaf(cursor->node);
+    if (next_page_num == 0) {
+      cursor->end_of_table = true;
+      return;
+    }
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+    pager_read_snapshot(pager, next_page_num, cursor->snapshot, cursor->node);
+  }
+}
+
+/* Position a cursor on the first row with an id >= key, like table_seek */
+SnapshotCursor *snapshot_seek(Table *table, uint64_t snapshot, uint32_t key) {
+  uint32_t page_size = table->pager->page_size;
+  Pager *pager = table->pager;
+  SnapshotCursor *cursor = malloc(sizeof(SnapshotCursor));
+  cursor->table = table;
+  cursor->snapshot = snapshot;
+  cursor->page_num = table->root_page_num;
+  cursor->end_of_table = false;
+  cursor->node = malloc(page_size);
+  pager_read_snapshot(pager, cursor->page_num, snapshot, cursor->node);
+  while (get_node_type(cursor->node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_key(cursor->node, key);
+    TRACE(TRACE_LEVEL_PATH, TRACE_DESCENT, cursor->page_num, key, child_index);
+    cursor->page_num = *internal_node_child(table, cursor->node, child_index);
+    pager_read_snapshot(pager, cursor->page_num, snapshot, cursor->node);
+  }
+  cursor->cell_num = key_search(leaf_node_key(cursor->node, 0),
+                                *leaf_node_num_cells(cursor->node), key);
+  snapshot_cursor_skip_empty(cursor);
+  return cursor;
+}
+
+void *snapshot_cursor_value(SnapshotCursor *cursor) {
+  return leaf_node_value(cursor->node, cursor->cell_num);
+}
+
+void snapshot_cursor_advance(SnapshotCursor *cursor) {
+  cursor->cell_num += 1;
+  snapshot_cursor_skip_empty(cursor);
+}
+
+/* Move to the first row of the next leaf that has any */
+void snapshot_cursor_next_leaf(SnapshotCursor *cursor) {
+  cursor->cell_num = *leaf_node_num_cells(cursor->node);
+  snapshot_cursor_skip_empty(cursor);
+}
+
+void snapshot_cursor_free(SnapshotCursor *cursor) {
+  free(cursor->node);
+  free(cursor);
+}
+
+/*
+Order statistics over a snapshot, from the row counts internal nodes keep
+of their children. Each reads one page per level of the tree. Outside
+library mode the pager's commit_seq reads the table as it is.
+*/
+
+/* Rows in the table */
+uint32_t snapshot_count(Table *table, uint64_t snapshot) {
+  uint32_t page_size = table->pager->page_size;
+  void *node = malloc(page_size);
+  pager_read_snapshot(table->pager, table->root_page_num, snapshot, node);
+  uint32_t count = node_row_count(table, node);
+  free(node);
+  return count;
+}
+
+/* Rows with an id below key: the rank of key among the ids */
+uint32_t snapshot_rank(Table *table, uint64_t snapshot, uint32_t key) {
+  uint32_t page_size = table->pager->page_size;
+  Pager *pager = table->pager;
+  void *node = malloc(page_size);
+  pager_read_snapshot(pager, table->root_page_num, snapshot, node);
+  uint32_t rank = 0;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    // Children left of the one key belongs in only hold smaller ids
+    uint32_t child_index = internal_node_find_key(node, key);
+    for (uint32_t i = 0; i < child_index; i++) {
+      rank += *internal_node_cell_count(table, node, i);
+    }
+    pager_read_snapshot(pager, *internal_node_child(table, node, child_index),
+                        snapshot, node);
+  }
+  rank += key_search(leaf_node_key(node, 0), *leaf_node_num_cells(node), key);
+  free(node);
+  return rank;
+}
+
+/* Rows with an id up to high */
+uint32_t snapshot_count_to(Table *table, uint64_t snapshot, uint32_t high) {
+  return high == UINT32_MAX ? snapshot_count(table, snapshot)
+                            : snapshot_rank(table, snapshot, high + 1);
+}
+
+/* Rows with ids from low to high */
+uint32_t snapshot_count_range(Table *table, uint64_t snapshot, uint32_t low,
+                              uint32_t high) {
+  return snapshot_count_to(table, snapshot, high) -
+         snapshot_rank(table, snapshot, low);
+}
+
+/*
+Move a cursor onto the row with n rows before it, the reverse of
+snapshot_rank. It ends up past the end if the table has no more than n
+rows.
+*/
+void snapshot_cursor_seek_nth(SnapshotCursor *cursor, uint32_t n) {
+  Table *table = cursor->table;
+  Pager *pager = cursor->table->pager;
+  cursor->page_num = cursor->table->root_page_num;
+  cursor->end_of_table = false;
+  pager_read_snapshot(pager, cursor->page_num, cursor->snapshot, cursor->node);
+  while (get_node_type(cursor->node) == NODE_INTERNAL) {
+    void *node = cursor->node;
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t child_index = 0;
+    while (child_index < num_keys &&
+           n >= *internal_node_cell_count(table, node, child_index)) {
+      n -= *internal_node_cell_count(table, node, child_index);
+      child_index++;
+    }
+    cursor->page_num = *internal_node_child(table, node, child_index);
+    pager_read_snapshot(pager, cursor->page_num, cursor->snapshot, node);
+  }
+  cursor->cell_num = n;
+  snapshot_cursor_skip_empty(cursor);
+}
+
+SnapshotCursor *snapshot_seek_nth(Table *table, uint64_t snapshot,
+                                  uint32_t n) {
+  uint32_t page_size = table->pager->page_size;
+  SnapshotCursor *cursor = malloc(sizeof(SnapshotCursor));
+  cursor->table = table;
+  cursor->snapshot = snapshot;
+  cursor->node = malloc(page_size);
+  snapshot_cursor_seek_nth(cursor, n);
+  return cursor;
+}
+
+/* Find the id of the row with n rows before it. Returns false past the end */
+bool snapshot_nth_key(Table *table, uint64_t snapshot, uint32_t n,
+                      uint32_t *key) {
+  SnapshotCursor *cursor = snapshot_seek_nth(table, snapshot, n);
+  bool found = !(cursor->end_of_table);
+  if (found) {
+    *key = *leaf_node_key(cursor->node, cursor->cell_num);
+  }
+  snapshot_cursor_free(cursor);
+  return found;
+}
+
+/*
+Reverse scans. Leaves only link to the next one, so a cursor steps back
+to the leaf before by the rank of the first row of its own, which costs
+two descents of the tree per leaf rather than one read.
+*/
+
+/* Position a cursor on the last row with an id <= key, like table_seek */
+SnapshotCursor *snapshot_seek_last(Table *table, uint64_t snapshot,
+                                   uint32_t key) {
+  uint32_t rank = snapshot_count_to(table, snapshot, key);
+  // With no such row, UINT32_MAX is past the end
+  return snapshot_seek_nth(table, snapshot, rank - 1);
+}
+
+/* Move to the last row of the leaf before */
+void snapshot_cursor_prev_leaf(SnapshotCursor *cursor) {
+  uint32_t rank = snapshot_rank(cursor->table, cursor->snapshot,
+                                *leaf_node_key(cursor->node, 0));
+  if (rank == 0) {
+    cursor->end_of_table = true;
     return;
   }
+  snapshot_cursor_seek_nth(cursor, rank - 1);
+}
 
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
+/* Shape of a tree, see tree_stats */
+typedef struct {
+  uint32_t height; // Levels, 1 for a lone leaf
+  uint32_t internal_pages;
+  uint32_t leaf_pages;
+  uint64_t rows;
+  uint64_t leaf_space;      // Bytes for cells in the leaves
+  uint64_t leaf_space_used; // Bytes of live cells in the leaves
+} TreeStats;
+
+void tree_stats_visit(Table *table, uint64_t snapshot, uint32_t page_num,
+                      uint32_t depth, TreeStats *stats) {
+  uint32_t page_size = table->pager->page_size;
+  void *node = malloc(page_size);
+  pager_read_snapshot(table->pager, page_num, snapshot, node);
+  if (depth > stats->height) {
+    stats->height = depth;
+  }
+  if (get_node_type(node) == NODE_LEAF) {
+    stats->leaf_pages++;
+    stats->rows += *leaf_node_num_cells(node);
+    stats->leaf_space += LEAF_NODE_SPACE_FOR_CELLS(page_size);
+    stats->leaf_space_used += leaf_node_space_used(node);
+  } else {
+    stats->internal_pages++;
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      uint32_t child_page_num = i < num_keys
+                                    ? *internal_node_child(table, node, i)
+                                    : *internal_node_right_child(node);
+      tree_stats_visit(table, snapshot, child_page_num, depth + 1, stats);
     }
   }
+  free(node);
+}
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+/* Walk every page of the tree as of snapshot, for .stats */
+void tree_stats(Table *table, uint64_t snapshot, TreeStats *stats) {
+  memset(stats, 0, sizeof(TreeStats));
+  tree_stats_visit(table, snapshot, table->root_page_num, 1, stats);
+}
+
+/* Share of the room for cells in the leaves that live cells take */
+double tree_stats_fill_factor(TreeStats *stats) {
+  if (stats->leaf_space == 0) {
+    return 0;
+  }
+  return (double)stats->leaf_space_used / stats->leaf_space;
+}
+
+/*
+Merge cells sorted by key into a leaf that may hold all of their keys.
+If the result does not fit, the leaf is split once into as many leaves of
+about equal size as it takes, and the new ones are hung into the tree
+right after it. With unique set, cells whose key is already present are
+skipped and get a NULL record. Returns the number of cells inserted.
+*/
+uint32_t leaf_node_insert_cells(Table *table, uint32_t page_num,
+                                LeafCell *cells, uint32_t num_cells,
+                                bool unique) {
+  uint32_t page_size = table->pager->page_size;
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+
+  uint8_t copy[page_size];
+  LeafCell existing[LEAF_NODE_MAX_CELLS(page_size)];
+  memcpy(copy, node, page_size);
+  uint32_t num_existing = leaf_node_collect(copy, existing);
+
+  LeafCell *merged = malloc((num_existing + num_cells) * sizeof(LeafCell));
+  uint32_t num_merged = 0;
+  uint32_t num_inserted = 0;
+  uint32_t total = 0;
+  uint32_t i = 0;
+  uint32_t j = 0;
+  while (i < num_existing || j < num_cells) {
+    LeafCell *cell;
+    if (j == num_cells ||
+        (i < num_existing && existing[i].key <= cells[j].key)) {
+      cell = &existing[i++];
+    } else if (unique && num_merged > 0 &&
+               merged[num_merged - 1].key == cells[j].key) {
+      // Already in the leaf or earlier in the batch
+      cells[j++].record = NULL;
+      continue;
+    } else {
+      cell = &cells[j++];
+      num_inserted++;
+    }
+    merged[num_merged++] = *cell;
+    total += LEAF_NODE_SLOT_SIZE + cell->record_size;
+  }
+
+  /*
+  Cut the cells into leaves. Each takes an even share of what is left
+  over the pages still needed, so none goes over a page. Rows appended to
+  the rightmost leaf fill every page but the last, as a split would.
+  */
+  uint32_t next_leaf_page_num = *leaf_node_next_leaf(node);
+  bool append = next_leaf_page_num == 0 &&
+                (num_existing == 0 ||
+                 existing[num_existing - 1].key < cells[0].key);
+  uint32_t *leaf_page_nums = malloc(num_merged * sizeof(uint32_t));
+  uint32_t num_leaves = 0;
+  uint32_t first = 0;
+  while (first < num_merged) {
+    uint32_t leaves_left =
+        (total + LEAF_NODE_SPACE_FOR_CELLS(page_size) - 1) /
+        LEAF_NODE_SPACE_FOR_CELLS(page_size);
+    uint32_t share = append ? LEAF_NODE_SPACE_FOR_CELLS(page_size)
+                            : (total + leaves_left - 1) / leaves_left;
+    uint32_t count = 0;
+    uint32_t used = 0;
+    while (first + count < num_merged) {
+      uint32_t size = LEAF_NODE_SLOT_SIZE + merged[first + count].record_size;
+      if (count > 0 && used + size > share) {
+        break;
+      }
+      used += size;
+      count++;
+    }
+
+    void *leaf = node;
+    uint32_t leaf_page_num = page_num;
+    if (num_leaves > 0) {
+      leaf_page_num = get_unused_page_num(pager);
+      leaf = get_page(pager, leaf_page_num);
+      pager_mark_dirty(pager, leaf_page_num);
+      TRACE(TRACE_LEVEL_STRUCTURE, TRACE_LEAF_SPLIT, page_num, leaf_page_num,
+            merged[first].key);
+      STATS_ADD(&pager->stats, leaf_splits, 1);
+      initialize_leaf_node(table, leaf);
+    }
+    leaf_node_fill(table, leaf, merged + first, count);
+    leaf_page_nums[num_leaves++] = leaf_page_num;
+    first += count;
+    total -= used;
+  }
+  free(merged);
+
+  for (uint32_t k = 0; k < num_leaves; k++) {
+    void *leaf = get_page(pager, leaf_page_nums[k]);
+    *leaf_node_next_leaf(leaf) =
+        k + 1 < num_leaves ? leaf_page_nums[k + 1] : next_leaf_page_num;
+  }
+  // Hang each new leaf after the one before it, like a split would
+  for (uint32_t k = 1; k < num_leaves; k++) {
+    uint32_t left_page_num = leaf_page_nums[k - 1];
+    void *left = get_page(pager, left_page_num);
+    void *leaf = get_page(pager, leaf_page_nums[k]);
+    if (is_node_root(left)) {
+      create_new_root(table, leaf_page_nums[k]);
+      continue;
+    }
+    uint32_t parent_page_num = *node_parent(left);
+    void *parent = get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    *node_parent(leaf) = parent_page_num;
+    if (k == 1) {
+      set_internal_node_key(
+          parent, internal_node_find_child(table, parent, left_page_num),
+          get_node_max_key(table, left));
+    }
+    internal_node_insert(table, parent_page_num, left_page_num,
+                         leaf_page_nums[k]);
+    // Unlike a split, a new right child raises its parent's max key
+    node_update_max_key(table, leaf_page_nums[k],
+                        get_node_max_key(table, leaf));
+  }
+  for (uint32_t k = 0; k < num_leaves; k++) {
+    node_update_count(table, leaf_page_nums[k]);
+  }
+  free(leaf_page_nums);
+  return num_inserted;
+}
+
+/*
+qsort order for table_insert_batch. Cells with equal keys keep the order
+of their records, so the first of them is the one a unique batch keeps.
+*/
+int leaf_cell_compare(const void *a, const void *b) {
+  const LeafCell *left = a;
+  const LeafCell *right = b;
+  if (left->key != right->key) {
+    return left->key < right->key ? -1 : 1;
+  }
+  return (left->record > right->record) - (left->record < right->record);
+}
+
+/*
+Insert cells sorted by key a leaf at a time: one descent finds the leaf
+for the first cell left and every following cell that leaf may hold goes
+in with it. See leaf_node_insert_cells for unique.
+*/
+uint32_t table_insert_batch(Table *table, LeafCell *cells, uint32_t num_cells,
+                            bool unique) {
+  uint32_t num_inserted = 0;
+  uint32_t i = 0;
+  while (i < num_cells) {
+    uint32_t max_key;
+    uint32_t page_num = table_find_leaf(table, cells[i].key, &max_key);
+    uint32_t end = i + 1;
+    while (end < num_cells && cells[end].key <= max_key) {
+      end++;
+    }
+    num_inserted +=
+        leaf_node_insert_cells(table, page_num, cells + i, end - i, unique);
+    i = end;
+  }
+  return num_inserted;
 }
 
 bool node_merge_then_split(Table *table, uint32_t page_num,
                            uint32_t left_child_index,
                            uint32_t right_child_index) {
+  uint32_t page_size = table->pager->page_size;
+  table->rightmost_page_num = 0;
   void *node = get_page(table->pager, page_num);
-  uint32_t left_child_page_num = *internal_node_child(node, left_child_index);
-  uint32_t right_child_page_num = *internal_node_child(node, right_child_index);
+  pager_mark_dirty(table->pager, page_num);
+  uint32_t left_child_page_num =
+      *internal_node_child(table, node, left_child_index);
+  uint32_t right_child_page_num =
+      *internal_node_child(table, node, right_child_index);
   void *left_child = get_page(table->pager, left_child_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
   void *right_child = get_page(table->pager, right_child_page_num);
+  pager_mark_dirty(table->pager, right_child_page_num);
+  TRACE(TRACE_LEVEL_STRUCTURE, TRACE_MERGE, page_num, left_child_page_num,
+        right_child_page_num);
+  STATS_ADD(&table->pager->stats, merges, 1);
 
   if (get_node_type(left_child) == NODE_LEAF) {
-    uint32_t left_child_num_cells = *leaf_node_num_cells(left_child);
-    uint32_t right_child_num_cells = *leaf_node_num_cells(right_child);
-    uint32_t left_split_num =
-        (left_child_num_cells + right_child_num_cells) / 2;
-    uint32_t right_split_num =
-        (left_child_num_cells + right_child_num_cells) - left_split_num;
-    if (left_split_num < LEAF_NODE_MIN_CELLS) {
-      // merge to the left child and then hang it the right_child_index
+    if (!leaf_node_rebalance(table, left_child, right_child)) {
+      // merged to the left child, hang it on right_child_index
       // so we can delete the left_child_index cell
-      for (uint32_t i = 0; i < right_child_num_cells; i++) {
-        memcpy(leaf_node_cell(left_child, i + left_child_num_cells),
-               leaf_node_cell(right_child, i), LEAF_NODE_CELL_SIZE);
-      }
-      *leaf_node_num_cells(left_child) =
-          left_child_num_cells + right_child_num_cells;
-      *internal_node_child(node, right_child_index) = left_child_page_num;
+      *internal_node_child(table, node, right_child_index) =
+          left_child_page_num;
+      *internal_node_count(table, node, right_child_index) =
+          *leaf_node_num_cells(left_child);
       *leaf_node_next_leaf(left_child) = *leaf_node_next_leaf(right_child);
-      table->pager->pages[right_child_page_num] = NULL;
-      free(right_child);
+      pager_free_page(table->pager, right_child_page_num);
       return false; // no split
-    } else {
-      if (left_child_num_cells < left_split_num) {
-        // move some cells from right child to left child
-        uint32_t n = left_split_num - left_child_num_cells;
-        for (uint32_t i = 0; i < n; i++) {
-          memcpy(leaf_node_cell(left_child, left_child_num_cells + i),
-                 leaf_node_cell(right_child, i), LEAF_NODE_CELL_SIZE);
-        }
-        for (uint32_t i = n; i < right_child_num_cells; i++) {
-          memcpy(leaf_node_cell(right_child, i - n),
-                 leaf_node_cell(right_child, i), LEAF_NODE_CELL_SIZE);
-        }
-      } else {
-        uint32_t n = left_child_num_cells - left_split_num;
-        for (uint32_t i = right_child_num_cells - 1; i >= 0; i--) {
-          memcpy(leaf_node_cell(right_child, i + n),
-                 leaf_node_cell(right_child, i), LEAF_NODE_CELL_SIZE);
-        }
-        for (uint32_t i = 0; i < n; i++) {
-          memcpy(leaf_node_cell(right_child, i),
-                 leaf_node_cell(left_child, left_split_num + i),
-                 LEAF_NODE_CELL_SIZE);
-        }
-      }
-      *leaf_node_num_cells(left_child) = left_split_num;
-      *leaf_node_num_cells(right_child) = right_split_num;
-      uint32_t new_max = get_node_max_key(table, left_child);
-      *internal_node_key(node, left_child_index) = new_max;
-      return true;
     }
+    uint32_t new_max = get_node_max_key(table, left_child);
+    *internal_node_key(node, left_child_index) = new_max;
+    *internal_node_count(table, node, left_child_index) =
+        *leaf_node_num_cells(left_child);
+    *internal_node_count(table, node, right_child_index) =
+        *leaf_node_num_cells(right_child);
+    return true;
   }
   // merge then split internal nodes
   else {
@@ -843,35 +1860,37 @@ bool node_merge_then_split(Table *table, uint32_t page_num,
     uint32_t t_child_page_num = *internal_node_right_child(left_child);
     void *t_child = get_page(table->pager, t_child_page_num);
     uint32_t virtual_key = get_node_max_key(table, t_child);
-    printf("page %d, right_child %d, key %d\n", left_child_page_num,
-           t_child_page_num, virtual_key);
     // need to merge and no split
-    if (left_split_num < INTERNAL_NODE_MIN_KEYS) {
+    if (left_split_num < INTERNAL_NODE_MIN_KEYS(page_size)) {
+      uint32_t t_child_count = *internal_node_right_count(left_child);
       *internal_node_right_child(left_child) =
           *internal_node_right_child(right_child);
+      *internal_node_right_count(left_child) =
+          *internal_node_right_count(right_child);
       *internal_node_num_keys(left_child) =
           left_child_num_keys + 1 + right_child_num_keys;
       *internal_node_key(left_child, left_child_num_keys) = virtual_key;
-      *internal_node_child(left_child, left_child_num_keys) = t_child_page_num;
+      *internal_node_child(table, left_child, left_child_num_keys) =
+          t_child_page_num;
+      *internal_node_count(table, left_child, left_child_num_keys) =
+          t_child_count;
+      internal_node_move_cells(table, left_child, left_child_num_keys + 1,
+                               right_child, 0, right_child_num_keys);
       for (uint32_t i = 0; i < right_child_num_keys; i++) {
-        memcpy(internal_node_cell(left_child, left_child_num_keys + 1 + i),
-               internal_node_cell(right_child, i), INTERNAL_NODE_CELL_SIZE);
-        uint32_t child_page_num = *internal_node_child(right_child, i);
+        uint32_t child_page_num = *internal_node_child(table, right_child, i);
         void *child = get_page(table->pager, child_page_num);
+        pager_mark_dirty(table->pager, child_page_num);
         *node_parent(child) = left_child_page_num;
       }
-      *internal_node_child(node, right_child_index) = left_child_page_num;
-      table->pager->pages[right_child_page_num] = NULL;
-      free(right_child);
-
-      for (uint32_t i = 0; i < *internal_node_num_keys(left_child); i++) {
-        uint32_t key = *internal_node_key(left_child, i);
-        uint32_t child = *internal_node_child(left_child, i);
-        printf("page %d, i %d, key %d, child %d\n", left_child_page_num, i, key,
-               child);
-      }
-      printf("page %d, right child: %d\n", left_child_page_num,
-             *internal_node_right_child(left_child));
+      uint32_t child_page_num = *internal_node_right_child(left_child);
+      void *child = get_page(table->pager, child_page_num);
+      pager_mark_dirty(table->pager, child_page_num);
+      *node_parent(child) = left_child_page_num;
+      *internal_node_child(table, node, right_child_index) =
+          left_child_page_num;
+      *internal_node_count(table, node, right_child_index) =
+          node_row_count(table, left_child);
+      pager_free_page(table->pager, right_child_page_num);
       return false;
     }
     // merge then split
@@ -879,54 +1898,70 @@ bool node_merge_then_split(Table *table, uint32_t page_num,
       if (left_child_num_keys < left_split_num) {
         // move some keys from right_child to left_child
         // but first make the virtual_key as a real key
+        uint32_t t_child_count = *internal_node_right_count(left_child);
         *internal_node_num_keys(left_child) = left_split_num;
         *internal_node_key(left_child, left_child_num_keys) = virtual_key;
-        *internal_node_child(left_child, left_child_num_keys) =
+        *internal_node_child(table, left_child, left_child_num_keys) =
             t_child_page_num;
+        *internal_node_count(table, left_child, left_child_num_keys) =
+            t_child_count;
         uint32_t n = left_split_num - left_child_num_keys;
         for (uint32_t i = 0; i < n; i++) {
           uint32_t key = *internal_node_key(right_child, i);
-          uint32_t child_page_num = *internal_node_child(right_child, i);
+          uint32_t child_page_num = *internal_node_child(table, right_child, i);
+          uint32_t count = *internal_node_count(table, right_child, i);
           if (i + 1 == n) {
             *internal_node_right_child(left_child) = child_page_num;
+            *internal_node_right_count(left_child) = count;
+            // The moved child's key now separates left_child from right_child
+            *internal_node_key(node, left_child_index) = key;
           } else {
-            *internal_node_child(left_child, left_child_num_keys + i + 1) =
-                child_page_num;
+            *internal_node_child(table, left_child,
+                                 left_child_num_keys + i + 1) = child_page_num;
             *internal_node_key(left_child, left_child_num_keys + i + 1) = key;
+            *internal_node_count(table, left_child,
+                                 left_child_num_keys + i + 1) = count;
           }
           void *child = get_page(table->pager, child_page_num);
+          pager_mark_dirty(table->pager, child_page_num);
           *node_parent(child) = left_child_page_num;
         }
-        for (uint32_t i = n; i < right_child_num_keys; i++) {
-          memcpy(internal_node_cell(right_child, i - n),
-                 internal_node_cell(right_child, i), INTERNAL_NODE_CELL_SIZE);
-        }
+        internal_node_move_cells(table, right_child, 0, right_child, n,
+                                 right_child_num_keys - n);
         *internal_node_num_keys(right_child) = right_split_num;
       } else {
         *internal_node_num_keys(right_child) = right_split_num;
         uint32_t n = left_child_num_keys - left_split_num;
-        for (uint32_t i = right_child_num_keys - 1; i >= 0; i--) {
-          memcpy(internal_node_cell(right_child, i + n),
-                 internal_node_cell(right_child, i), INTERNAL_NODE_CELL_SIZE);
-        }
+        internal_node_move_cells(table, right_child, n, right_child, 0,
+                                 right_child_num_keys);
         for (uint32_t i = 0; i < n; i++) {
           if (i == n - 1) {
             *internal_node_key(right_child, i) = virtual_key;
-            *internal_node_child(right_child, i) = t_child_page_num;
+            *internal_node_child(table, right_child, i) = t_child_page_num;
+            *internal_node_count(table, right_child, i) =
+                *internal_node_right_count(left_child);
           } else {
-            memcpy(internal_node_cell(right_child, i),
-                   internal_node_cell(left_child, left_split_num + 1 + i),
-                   INTERNAL_NODE_CELL_SIZE);
+            internal_node_move_cells(table, right_child, i, left_child,
+                                     left_split_num + 1 + i, 1);
           }
-          uint32_t child_page_num = *internal_node_child(right_child, i);
+          uint32_t child_page_num = *internal_node_child(table, right_child, i);
           void *child = get_page(table->pager, child_page_num);
+          pager_mark_dirty(table->pager, child_page_num);
           *node_parent(child) = right_child_page_num;
         }
+        *internal_node_key(node, left_child_index) =
+            *internal_node_key(left_child, left_split_num);
         uint32_t new_right_child_page_num =
-            *internal_node_child(left_child, left_split_num);
+            *internal_node_child(table, left_child, left_split_num);
         *internal_node_right_child(left_child) = new_right_child_page_num;
+        *internal_node_right_count(left_child) =
+            *internal_node_cell_count(table, left_child, left_split_num);
         *internal_node_num_keys(left_child) = left_split_num;
       }
+      *internal_node_count(table, node, left_child_index) =
+          node_row_count(table, left_child);
+      *internal_node_count(table, node, right_child_index) =
+          node_row_count(table, right_child);
       return true;
     }
   }
@@ -934,14 +1969,16 @@ bool node_merge_then_split(Table *table, uint32_t page_num,
 
 void internal_node_delete(Table *table, uint32_t page_num,
                           uint32_t child_index) {
+  uint32_t page_size = table->pager->page_size;
   void *node = get_page(table->pager, page_num);
+  pager_mark_dirty(table->pager, page_num);
   uint32_t num_keys = *internal_node_num_keys(node);
-  for (uint32_t i = child_index + 1; i < num_keys; i++) {
-    memcpy(internal_node_cell(node, i - 1), internal_node_cell(node, i),
-           INTERNAL_NODE_CELL_SIZE);
+  if (child_index + 1 < num_keys) {
+    internal_node_move_cells(table, node, child_index, node, child_index + 1,
+                             num_keys - child_index - 1);
   }
   *internal_node_num_keys(node) = num_keys - 1;
-  if (num_keys - 1 < INTERNAL_NODE_MIN_KEYS) {
+  if (num_keys - 1 < INTERNAL_NODE_MIN_KEYS(page_size)) {
     if (is_node_root(node)) {
       if (num_keys - 1 > 0)
         return;
@@ -950,35 +1987,32 @@ void internal_node_delete(Table *table, uint32_t page_num,
       uint32_t right_child_page_num = *internal_node_right_child(node);
       void *right_child = get_page(table->pager, right_child_page_num);
       if (get_node_type(right_child) == NODE_LEAF) {
-        initialize_leaf_node(node);
+        memcpy(node, right_child, page_size);
         set_node_root(node, true);
-        uint32_t num_cells = *leaf_node_num_cells(right_child);
-        for (uint32_t i = 0; i < num_cells; i++) {
-          memcpy(leaf_node_cell(node, i), leaf_node_cell(right_child, i),
-                 LEAF_NODE_CELL_SIZE);
-        }
-        *leaf_node_num_cells(node) = *leaf_node_num_cells(right_child);
-        table->pager->pages[right_child_page_num] = NULL;
-        free(right_child);
+        pager_free_page(table->pager, right_child_page_num);
       } else {
         uint32_t num_keys = *internal_node_num_keys(right_child);
+        internal_node_move_cells(table, node, 0, right_child, 0, num_keys);
         for (uint32_t i = 0; i < num_keys; i++) {
-          memcpy(internal_node_cell(node, i),
-                 internal_node_cell(right_child, i), INTERNAL_NODE_CELL_SIZE);
-          uint32_t child_page_num = *internal_node_child(right_child, i);
+          uint32_t child_page_num = *internal_node_child(table, right_child, i);
           void *child = get_page(table->pager, child_page_num);
+          pager_mark_dirty(table->pager, child_page_num);
           *node_parent(child) = page_num;
         }
-        *internal_node_right_child(node) =
-            *internal_node_right_child(right_child);
+        uint32_t child_page_num = *internal_node_right_child(right_child);
+        void *child = get_page(table->pager, child_page_num);
+        pager_mark_dirty(table->pager, child_page_num);
+        *node_parent(child) = page_num;
+        *internal_node_right_child(node) = child_page_num;
+        *internal_node_right_count(node) =
+            *internal_node_right_count(right_child);
         *internal_node_num_keys(node) = *internal_node_num_keys(right_child);
-        table->pager->pages[right_child_page_num] = NULL;
-        free(right_child);
+        pager_free_page(table->pager, right_child_page_num);
       }
     } else {
       uint32_t parent_page_num = *node_parent(node);
       void *parent = get_page(table->pager, parent_page_num);
-      uint32_t child_index = internal_node_find_child(parent, page_num);
+      uint32_t child_index = internal_node_find_child(table, parent, page_num);
       uint32_t num_keys = *internal_node_num_keys(parent);
       if (child_index >= num_keys)
         child_index -= 1;
@@ -992,28 +2026,39 @@ void internal_node_delete(Table *table, uint32_t page_num,
 }
 
 void leaf_node_delete(Cursor *cursor) {
+  Table *table = cursor->table;
+  uint32_t page_size = table->pager->page_size;
   void *node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
   uint32_t old_max = get_node_max_key(cursor->table, node);
-  for (uint32_t i = cursor->cell_num + 1; i < num_cells; i++) {
-    memcpy(leaf_node_cell(node, i - 1), leaf_node_cell(node, i),
-           LEAF_NODE_CELL_SIZE);
+  if (*leaf_node_record_offset(node, cursor->cell_num) ==
+      *leaf_node_content_start(node)) {
+    // Lowest record, give its space back right away
+    *leaf_node_content_start(node) +=
+        *leaf_node_record_size(node, cursor->cell_num);
   }
-  *(leaf_node_num_cells(node)) = num_cells - 1;
-  uint32_t new_max = get_node_max_key(cursor->table, node);
+  leaf_node_close_slot(node, cursor->cell_num);
 
   if (is_node_root(node))
     return;
+  node_update_count(cursor->table, cursor->page_num);
+  // A leaf split off the right edge may hold a single row and end up empty,
+  // its old max stays an upper bound until the merge below removes it
+  uint32_t new_max = *leaf_node_num_cells(node) > 0
+                         ? get_node_max_key(cursor->table, node)
+                         : old_max;
 
   uint32_t parent_page_num = *node_parent(node);
   void *parent = get_page(cursor->table->pager, parent_page_num);
-  uint32_t child_index = internal_node_find_child(parent, cursor->page_num);
+  pager_mark_dirty(cursor->table->pager, parent_page_num);
+  uint32_t child_index =
+      internal_node_find_child(table, parent, cursor->page_num);
   uint32_t num_keys = *internal_node_num_keys(parent);
   if (old_max != new_max) {
     set_internal_node_key(parent, child_index, new_max);
   }
 
-  if (num_cells > LEAF_NODE_MIN_CELLS) {
+  if (leaf_node_space_used(node) >= LEAF_NODE_MIN_SPACE_USED(page_size)) {
     return;
   }
 
@@ -1029,4 +2074,349 @@ void leaf_node_delete(Cursor *cursor) {
   }
 }
 
+/*
+Bulk loading. Rows sorted by id are packed into leaves up to the fill
+factor and the internal levels, always packed full, are built bottom-up
+as the leaves are finished, so every page is written once and in file order. Each level
+keeps its two newest nodes open: when the input ends the last node may be
+short and borrows from its left neighbour. The new pages are not logged,
+a checkpoint makes them durable before the root is switched over.
+*/
+#define BULK_LOAD_DEFAULT_FILL_FACTOR 0.9
+
+typedef struct {
+  uint32_t prev_page_num; // Finished node waiting to be pushed up, 0 if none
+  uint32_t prev_max_key;
+  uint32_t page_num; // Node being filled, 0 if none
+  uint32_t max_key;
+  uint32_t num_children; // Children (cells on the leaf level) of page_num
+} BulkLoadLevel;
+
+typedef struct {
+  Table *table;
+  uint32_t leaf_fill;    // Bytes of cells per leaf
+  BulkLoadLevel *levels; // levels[0] are the leaves
+  uint32_t num_levels;
+  uint32_t num_rows;
+  uint32_t num_duplicates;
+  /* Rows that arrived out of order, inserted one by one at the end */
+  Row *stragglers;
+  uint32_t num_stragglers;
+  uint32_t stragglers_capacity;
+} BulkLoader;
+
+bool table_is_empty(Table *table) {
+  void *root = get_page(table->pager, table->root_page_num);
+  return get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+}
+
+/* Returns NULL if the table already has rows */
+BulkLoader *bulk_load_begin(Table *table, double fill_factor) {
+  uint32_t page_size = table->pager->page_size;
+  if (!table_is_empty(table)) {
+    return NULL;
+  }
+  if (fill_factor < 0.5) {
+    fill_factor = 0.5;
+  } else if (fill_factor > 1.0) {
+    fill_factor = 1.0;
+  }
+
+  BulkLoader *loader = malloc(sizeof(BulkLoader));
+  loader->table = table;
+  loader->leaf_fill = LEAF_NODE_SPACE_FOR_CELLS(page_size) * fill_factor;
+  loader->levels = calloc(1, sizeof(BulkLoadLevel));
+  loader->num_levels = 1;
+  loader->num_rows = 0;
+  loader->num_duplicates = 0;
+  loader->stragglers = NULL;
+  loader->num_stragglers = 0;
+  loader->stragglers_capacity = 0;
+
+  pager_end_statement(table->pager);
+  table->pager->unlogged = true;
+  return loader;
+}
+
+/*
+While a node is being built all of its children are kept as cells, the
+last one only becomes the right child once the node is finished
+*/
+void bulk_load_finish_internal(Table *table, uint32_t page_num) {
+  void *node = get_page(table->pager, page_num);
+  pager_mark_dirty(table->pager, page_num);
+  uint32_t num_children = *internal_node_num_keys(node);
+  *internal_node_right_child(node) =
+      *internal_node_child(table, node, num_children - 1);
+  *internal_node_right_count(node) =
+      *internal_node_count(table, node, num_children - 1);
+  *internal_node_num_keys(node) = num_children - 1;
+}
+
+void bulk_load_push(BulkLoader *loader, uint32_t level, uint32_t child_page_num,
+                    uint32_t child_max_key);
+
+/* Hand the finished node of a level to the level above */
+void bulk_load_push_prev(BulkLoader *loader, uint32_t level) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+  uint32_t page_num = loader->levels[level].prev_page_num;
+  uint32_t max_key = loader->levels[level].prev_max_key;
+  loader->levels[level].prev_page_num = 0;
+
+  if (level > 0) {
+    bulk_load_finish_internal(loader->table, page_num);
+  }
+  bulk_load_push(loader, level + 1, page_num, max_key);
+  /* Nothing changes below the open nodes, let the pool write it out */
+  pager_unpin(pager, page_num);
+}
+
+void bulk_load_push(BulkLoader *loader, uint32_t level, uint32_t child_page_num,
+                    uint32_t child_max_key) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+  if (level == loader->num_levels) {
+    loader->num_levels++;
+    loader->levels =
+        realloc(loader->levels, loader->num_levels * sizeof(BulkLoadLevel));
+    memset(&loader->levels[level], 0, sizeof(BulkLoadLevel));
+  }
+
+  BulkLoadLevel *l = &loader->levels[level];
+  if (l->page_num == 0 ||
+      l->num_children == INTERNAL_NODE_MAX_CELLS(pager->page_size) + 1) {
+    if (l->page_num != 0) {
+      l->prev_page_num = l->page_num;
+      l->prev_max_key = l->max_key;
+    }
+    l->page_num = get_unused_page_num(pager);
+    l->num_children = 0;
+    void *new_node = get_page(pager, l->page_num);
+    pager_mark_dirty(pager, l->page_num);
+    initialize_internal_node(new_node);
+  }
+
+  void *node = get_page(pager, l->page_num);
+  pager_mark_dirty(pager, l->page_num);
+  *internal_node_num_keys(node) = l->num_children + 1;
+  *internal_node_child(table, node, l->num_children) = child_page_num;
+  *internal_node_key(node, l->num_children) = child_max_key;
+
+  void *child = get_page(pager, child_page_num);
+  pager_mark_dirty(pager, child_page_num);
+  *node_parent(child) = l->page_num;
+  *internal_node_count(table, node, l->num_children) =
+      node_row_count(table, child);
+  l->num_children++;
+  l->max_key = child_max_key;
+
+  if (l->num_children == INTERNAL_NODE_MIN_KEYS(pager->page_size) + 1 &&
+      l->prev_page_num != 0) {
+    bulk_load_push_prev(loader, level);
+  }
+}
+
+void bulk_load_add(BulkLoader *loader, Row *row) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+  BulkLoadLevel *leaves = &loader->levels[0];
+
+  if (loader->num_rows > 0 && row->id <= leaves->max_key) {
+    if (loader->num_stragglers == loader->stragglers_capacity) {
+      loader->stragglers_capacity =
+          loader->stragglers_capacity ? loader->stragglers_capacity * 2 : 64;
+      loader->stragglers = realloc(loader->stragglers,
+                                   loader->stragglers_capacity * sizeof(Row));
+    }
+    loader->stragglers[loader->num_stragglers++] = *row;
+    return;
+  }
+
+  uint32_t record_size = row_record_size(row);
+  uint32_t space_used = 0;
+  if (leaves->page_num != 0) {
+    void *leaf = get_page(pager, leaves->page_num);
+    space_used = LEAF_NODE_SPACE_FOR_CELLS(pager->page_size) -
+                 leaf_node_free_space(leaf);
+  }
+  if (leaves->page_num == 0 ||
+      space_used + LEAF_NODE_SLOT_SIZE + record_size > loader->leaf_fill) {
+    uint32_t page_num = get_unused_page_num(pager);
+    void *new_leaf = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    initialize_leaf_node(table, new_leaf);
+    if (leaves->page_num != 0) {
+      void *leaf = get_page(pager, leaves->page_num);
+      pager_mark_dirty(pager, leaves->page_num);
+      *leaf_node_next_leaf(leaf) = page_num;
+      leaves->prev_page_num = leaves->page_num;
+      leaves->prev_max_key = leaves->max_key;
+    }
+    leaves->page_num = page_num;
+    leaves->num_children = 0;
+    space_used = 0;
+  }
+
+  void *leaf = get_page(pager, leaves->page_num);
+  pager_mark_dirty(pager, leaves->page_num);
+  uint8_t record[ROW_MAX_SIZE];
+  serialize_row(row, record);
+  leaf_node_append(leaf, row->id, record, record_size);
+  leaves->num_children++;
+  leaves->max_key = row->id;
+  loader->num_rows++;
+
+  space_used += LEAF_NODE_SLOT_SIZE + record_size;
+  if (space_used >= LEAF_NODE_MIN_SPACE_USED(pager->page_size) &&
+      leaves->prev_page_num != 0) {
+    bulk_load_push_prev(loader, 0);
+  }
+}
+
+/* The input ended with a short last leaf, merge it into or borrow from prev */
+void bulk_load_fix_last_leaf(BulkLoader *loader) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+  BulkLoadLevel *leaves = &loader->levels[0];
+  void *prev = get_page(pager, leaves->prev_page_num);
+  pager_mark_dirty(pager, leaves->prev_page_num);
+  void *leaf = get_page(pager, leaves->page_num);
+  pager_mark_dirty(pager, leaves->page_num);
+
+  if (!leaf_node_rebalance(table, prev, leaf)) {
+    *leaf_node_next_leaf(prev) = 0;
+    pager_free_page(pager, leaves->page_num);
+    leaves->page_num = leaves->prev_page_num;
+    leaves->num_children = *leaf_node_num_cells(prev);
+    leaves->prev_page_num = 0;
+    return;
+  }
+  leaves->num_children = *leaf_node_num_cells(leaf);
+  leaves->prev_max_key =
+      *leaf_node_key(prev, *leaf_node_num_cells(prev) - 1);
+}
+
+/* An internal node was left with too few children, take some from prev */
+void bulk_load_fix_last_internal(BulkLoader *loader, uint32_t level) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+  BulkLoadLevel *l = &loader->levels[level];
+  void *prev = get_page(pager, l->prev_page_num);
+  pager_mark_dirty(pager, l->prev_page_num);
+  void *node = get_page(pager, l->page_num);
+  pager_mark_dirty(pager, l->page_num);
+  uint32_t num_prev = *internal_node_num_keys(prev);
+  uint32_t moved =
+      INTERNAL_NODE_MIN_KEYS(pager->page_size) + 1 - l->num_children;
+
+  internal_node_move_cells(table, node, moved, node, 0, l->num_children);
+  internal_node_move_cells(table, node, 0, prev, num_prev - moved, moved);
+  l->num_children += moved;
+  *internal_node_num_keys(node) = l->num_children;
+  *internal_node_num_keys(prev) = num_prev - moved;
+  l->prev_max_key = *internal_node_key(prev, num_prev - moved - 1);
+
+  for (uint32_t i = 0; i < moved; i++) {
+    uint32_t child_page_num = *internal_node_cell(table, node, i);
+    void *child = get_page(pager, child_page_num);
+    pager_mark_dirty(pager, child_page_num);
+    *node_parent(child) = l->page_num;
+  }
+}
+
+/* Copy the top node of the new tree over the (empty) root page */
+void bulk_load_install_root(BulkLoader *loader, uint32_t page_num) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+  void *root = get_page(pager, table->root_page_num);
+  pager_mark_dirty(pager, table->root_page_num);
+  memcpy(root, node, pager->page_size);
+  set_node_root(root, true);
+  table->rightmost_page_num = 0;
+
+  if (get_node_type(root) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(root);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      uint32_t child_page_num = *internal_node_child(table, root, i);
+      void *child = get_page(pager, child_page_num);
+      pager_mark_dirty(pager, child_page_num);
+      *node_parent(child) = table->root_page_num;
+    }
+  }
+  pager_free_page(pager, page_num);
+}
+
+/* Rows that did not fit the sorted stream go through the normal insert */
+void bulk_load_insert_stragglers(BulkLoader *loader) {
+  Table *table = loader->table;
+  for (uint32_t i = 0; i < loader->num_stragglers; i++) {
+    Row *row = &loader->stragglers[i];
+    Cursor *cursor = table_find(table, row->id);
+    void *node = get_page(table->pager, cursor->page_num);
+    if (cursor->cell_num < *leaf_node_num_cells(node) &&
+        *leaf_node_key(node, cursor->cell_num) == row->id) {
+      loader->num_duplicates++;
+    } else {
+      leaf_node_insert(cursor, row->id, row);
+      loader->num_rows++;
+    }
+    free(cursor);
+    pager_end_statement(table->pager);
+  }
+}
+
+/*
+Finish the open nodes level by level, install the top one as the root and
+free the loader. Returns the number of rows loaded.
+*/
+uint32_t bulk_load_finish(BulkLoader *loader, uint32_t *num_duplicates) {
+  Table *table = loader->table;
+  Pager *pager = table->pager;
+
+  if (loader->levels[0].page_num != 0) {
+    if (loader->levels[0].prev_page_num != 0) {
+      bulk_load_fix_last_leaf(loader);
+    }
+    for (uint32_t level = 0;; level++) {
+      BulkLoadLevel *l = &loader->levels[level];
+      if (level > 0 &&
+          l->num_children < INTERNAL_NODE_MIN_KEYS(pager->page_size) + 1 &&
+          l->prev_page_num != 0) {
+        bulk_load_fix_last_internal(loader, level);
+      }
+      if (l->prev_page_num != 0) {
+        bulk_load_push_prev(loader, level);
+      }
+      l = &loader->levels[level];
+      if (level > 0) {
+        bulk_load_finish_internal(loader->table, l->page_num);
+      }
+      if (level + 1 == loader->num_levels) {
+        /* Only node left on the highest level */
+        pager_checkpoint(pager);
+        pager->unlogged = false;
+        bulk_load_install_root(loader, l->page_num);
+        break;
+      }
+      uint32_t page_num = l->page_num;
+      bulk_load_push(loader, level + 1, page_num, l->max_key);
+      pager_unpin(pager, page_num);
+    }
+  }
+  pager->unlogged = false;
+  pager_end_statement(pager);
+
+  bulk_load_insert_stragglers(loader);
+  uint32_t num_rows = loader->num_rows;
+  if (num_duplicates != NULL) {
+    *num_duplicates = loader->num_duplicates;
+  }
+  free(loader->stragglers);
+  free(loader->levels);
+  free(loader);
+  return num_rows;
+}
+
 #endif
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Must supply a test file name and a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char *testfname = argv[1];
+  char *dbfname = argv[2];
+  double fill_factor = BULK_LOAD_DEFAULT_FILL_FACTOR;
+  if (argc > 3) {
+    fill_factor = atof(argv[3]);
+  }
+
+  Table *table = db_open(dbfname);
+  bool loaded = load_file(table, testfname, fill_factor);
+  db_close(table);
+  return loaded ? 0 : 1;
+}
@@ -2,229 +2,636 @@
 #define __DB_H__
 
 #include "btree.h"
+#include "filter.h"
+#include "index.h"
+#include "order.h"
+#include "output.h"
+#include "parser.h"
+#include "scan.h"
 #include "shell.h"
 #include <stdio.h>
 
+/*
+Bulk load a file of "id username email" lines as written by test.py.
+Lines that do not parse are reported by number and skipped, the rest
+still load. Returns false if the file could not be loaded.
+*/
+bool load_file(Table *table, const char *filename, double fill_factor) {
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    printf("Unable to open file '%s'.\n", filename);
+    return false;
+  }
+  BulkLoader *loader = bulk_load_begin(table, fill_factor);
+  if (loader == NULL) {
+    printf("Error: Table must be empty to bulk load.\n");
+    fclose(fp);
+    return false;
+  }
+
+  int id;
+  Row row;
+  uint32_t skipped = 0;
+  uint32_t malformed = 0;
+  uint32_t line_num = 0;
+  char *line = NULL;
+  size_t line_length = 0;
+  while (getline(&line, &line_length, fp) != -1) {
+    line_num++;
+    int n = sscanf(line, "%d %32s %255s", &id, row.username, row.email);
+    if (n == EOF)
+      continue;
+    if (n != 3) {
+      printf("Syntax error. Could not parse line %d.\n", line_num);
+      malformed++;
+      continue;
+    }
+    if (id < 0) {
+      skipped++;
+      continue;
+    }
+    row.id = id;
+    bulk_load_add(loader, &row);
+  }
+  free(line);
+  fclose(fp);
+
+  uint32_t duplicates;
+  uint32_t num_rows = bulk_load_finish(loader, &duplicates);
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    if (table->indexes[i] != NULL) {
+      index_build(table, i);
+    }
+  }
+  pager_end_statement(table->pager);
+  printf("Loaded %d rows.\n", num_rows);
+  if (duplicates + skipped > 0) {
+    printf("Skipped %d duplicate and %d negative ids.\n", duplicates, skipped);
+  }
+  if (malformed > 0) {
+    printf("Skipped %d lines that could not be parsed.\n", malformed);
+  }
+  return true;
+}
+
+void print_tree_stats(const char *name, Table *table) {
+  TreeStats stats;
+  tree_stats(table, table->pager->commit_seq, &stats);
+  printf("%-9s height %u, %u internal and %u leaf pages, %llu rows, "
+         "%.1f%% full\n",
+         name, stats.height, stats.internal_pages, stats.leaf_pages,
+         (unsigned long long)stats.rows, 100 * tree_stats_fill_factor(&stats));
+}
+
+/* Print what .stats shows, times in microseconds */
+void print_stats(Table *table) {
+  Stats stats;
+  stats_copy(&stats, &table->pager->stats);
+  uint64_t lookups = stats.page_hits + stats.page_misses;
+  printf("Cache: %llu hits, %llu misses, %.1f%% hit rate\n",
+         (unsigned long long)stats.page_hits,
+         (unsigned long long)stats.page_misses,
+         lookups > 0 ? 100.0 * stats.page_hits / lookups : 0.0);
+  printf("I/O: %llu bytes read, %llu written, %llu to the WAL\n",
+         (unsigned long long)stats.bytes_read,
+         (unsigned long long)stats.bytes_written,
+         (unsigned long long)stats.wal_bytes_written);
+  printf("Structure: %llu leaf splits, %llu internal splits, %llu merges\n",
+         (unsigned long long)stats.leaf_splits,
+         (unsigned long long)stats.internal_splits,
+         (unsigned long long)stats.merges);
+
+  print_tree_stats("table", table);
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    if (table->indexes[i] != NULL) {
+      print_tree_stats(INDEX_COLUMN_NAMES[i], table->indexes[i]);
+    }
+  }
+
+  printf("%-13s %8s %10s %10s %10s %10s %10s %10s\n", "statement", "count",
+         "mean", "p50", "p90", "p99", "p99.9", "max");
+  for (uint32_t i = 0; i < NUM_STATEMENT_TYPES; i++) {
+    Histogram *latency = &stats.latency[i];
+    if (latency->count == 0) {
+      continue;
+    }
+    printf("%-13s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           STATEMENT_TYPE_NAMES[i], (unsigned long long)latency->count,
+           latency->sum / 1000.0 / latency->count,
+           histogram_percentile(latency, 0.5) / 1000.0,
+           histogram_percentile(latency, 0.9) / 1000.0,
+           histogram_percentile(latency, 0.99) / 1000.0,
+           histogram_percentile(latency, 0.999) / 1000.0,
+           latency->max / 1000.0);
+  }
+  pager_unpin_all(table->pager);
+}
+
 MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
   if (strcmp(input_buffer->buffer, ".exit") == 0) {
     close_input_buffer(input_buffer);
+    output_to(NULL);
     db_close(table);
     exit(EXIT_SUCCESS);
   } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
     printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
+    print_tree(table, table->root_page_num, 0);
+    pager_unpin_all(table->pager);
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".page") == 0) {
     printf("Page:\n");
-    print_tree(table->pager, 6, 0);
+    print_tree(table, 6, 0);
+    pager_unpin_all(table->pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".checkpoint") == 0) {
+    uint32_t pages_written = pager_checkpoint(table->pager);
+    printf("Checkpoint: %d pages written.\n", pages_written);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".load ", 6) == 0) {
+    char filename[256];
+    double fill_factor = BULK_LOAD_DEFAULT_FILL_FACTOR;
+    if (sscanf(input_buffer->buffer + 6, "%255s %lf", filename, &fill_factor) <
+        1) {
+      printf("Usage: .load <file> [fill factor]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    load_file(table, filename, fill_factor);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".mode") == 0) {
+    printf("Mode: %s\n", OUTPUT_MODE_NAMES[output_mode]);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".mode ", 6) == 0) {
+    OutputMode mode = output_mode_named(input_buffer->buffer + 6);
+    if (mode == NUM_OUTPUT_MODES) {
+      printf("Usage: .mode table|csv|tsv|binary\n");
+    } else {
+      output_mode = mode;
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".output") == 0) {
+    output_to(NULL);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".output ", 8) == 0) {
+    output_to(input_buffer->buffer + 8);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".trace") == 0) {
+    trace_print();
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".trace on") == 0 ||
+             strcmp(input_buffer->buffer, ".trace off") == 0) {
+    if (TRACE_LEVEL == 0) {
+      printf("Tracing is compiled out, build with -DTRACE_LEVEL=3.\n");
+    }
+    trace_enabled = strcmp(input_buffer->buffer, ".trace on") == 0;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+    print_stats(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats reset") == 0) {
+    stats_reset(&table->pager->stats);
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
     printf("Constants:\n");
-    print_constants();
+    print_constants(table->pager->page_size);
     return META_COMMAND_SUCCESS;
   } else {
     return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
 }
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
-  statement->type = STATEMENT_INSERT;
-  statement->row_to_insert = malloc(sizeof(Row));
+ExecuteResult execute_insert(Statement *statement, Table *table) {
+  Row *row_to_insert = statement->row_to_insert;
+  uint32_t key_to_insert = row_to_insert->id;
+  Cursor *cursor = table_find(table, key_to_insert);
 
-  char *keyword = strtok(input_buffer->buffer, " ");
-  char *id_string = strtok(NULL, " ");
-  char *username = strtok(NULL, " ");
-  char *email = strtok(NULL, " ");
+  void *node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+  if (cursor->cell_num < num_cells) {
+    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+    if (key_at_index == key_to_insert) {
+      printf("ooops!\n");
+      return EXECUTE_DUPLICATE_KEY;
+    }
   }
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
-  }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
-  }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
-  }
+  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
 
-  statement->row_to_insert->id = id;
-  strcpy(statement->row_to_insert->username, username);
-  strcpy(statement->row_to_insert->email, email);
+  free(cursor);
+
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    if (table->indexes[i] != NULL) {
+      index_insert(table->indexes[i], i, row_to_insert);
+    }
+  }
 
-  return PREPARE_SUCCESS;
+  return EXECUTE_SUCCESS;
 }
 
-PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement) {
-  statement->type = STATEMENT_SELECT;
-  statement->row_to_insert = NULL;
-  statement->where = NULL;
+/*
+insert values: the rows are sorted by id and go into the tree a leaf at a
+time. Ids already in the table, or repeated in the batch, are skipped.
+*/
+ExecuteResult execute_insert_values(Statement *statement, Table *table) {
+  uint32_t num_rows = statement->num_rows;
+  Row *rows = malloc(num_rows * sizeof(Row));
+  uint8_t *records = malloc(num_rows * ROW_MAX_SIZE);
+  LeafCell *cells = malloc(num_rows * sizeof(LeafCell));
+  statement_rows(statement, rows);
+  for (uint32_t i = 0; i < num_rows; i++) {
+    cells[i].key = rows[i].id;
+    cells[i].record = records + i * ROW_MAX_SIZE;
+    cells[i].record_size = row_record_size(&rows[i]);
+    serialize_row(&rows[i], cells[i].record);
+  }
+  qsort(cells, num_rows, sizeof(LeafCell), leaf_cell_compare);
+  uint32_t num_inserted = table_insert_batch(table, cells, num_rows, true);
 
-  char *t = strtok(input_buffer->buffer, " ");
-  bool has_where_clause = false;
-  char *column_name = NULL;
-  char *operator= NULL;
-  char *value = NULL;
-  while (t != NULL) {
-    if (has_where_clause) {
-      if (column_name == NULL) {
-        column_name = t;
-      } else if (operator== NULL) {
-        operator= t;
-      } else if (value == NULL) {
-        value = t;
-      }
+  // Only the rows that went in are indexed, in place of the batch
+  uint32_t num_indexed = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if (cells[i].record != NULL) {
+      deserialize_row(cells[i].record, &rows[num_indexed++]);
     }
-    if (strcmp(t, "where") == 0) {
-      has_where_clause = true;
-    }
-    t = strtok(NULL, " ");
   }
-  if (has_where_clause) {
-    statement->where = malloc(sizeof(WhereClause));
-    strcpy(statement->where->column_name, column_name);
-    strcpy(statement->where->operator, operator);
-    if (value[0] == '"') {
-      statement->where->value_type = STRING;
-      statement->where->value = value;
-    } else {
-      statement->where->value_type = INT;
-      statement->where->value = malloc(sizeof(int));
-      *(int *)statement->where->value = atoi(value);
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    if (table->indexes[i] != NULL) {
+      index_insert_batch(table->indexes[i], i, rows, num_indexed);
     }
   }
+  free(cells);
+  free(records);
+  free(rows);
 
-  return PREPARE_SUCCESS;
+  printf("Inserted %d rows.\n", num_inserted);
+  if (num_inserted < num_rows) {
+    printf("Skipped %d duplicate ids.\n", num_rows - num_inserted);
+  }
+  return EXECUTE_SUCCESS;
 }
 
-PrepareResult prepare_delete(InputBuffer *input_buffer, Statement *statement) {
-  statement->type = STATEMENT_DELETE;
-  statement->row_to_insert = NULL;
-  statement->where = NULL;
-
-  char *t = strtok(input_buffer->buffer, " ");
-  bool has_where_clause = false;
-  char *column_name = NULL;
-  char *operator= NULL;
-  char *value = NULL;
-  while (t != NULL) {
-    if (has_where_clause) {
-      if (column_name == NULL) {
-        column_name = t;
-      } else if (operator== NULL) {
-        operator= t;
-      } else if (value == NULL) {
-        value = t;
-      }
+/*
+Closed range of ids holding every row the condition can match: and
+narrows it, or widens it to cover both sides. Predicates on other columns
+do not bound it. Returns false if no row can match.
+*/
+bool where_id_bounds(WhereClause *where, uint32_t *low, uint32_t *high) {
+  uint32_t left_low, left_high, right_low, right_high;
+  bool left, right;
+  switch (where->type) {
+  case WHERE_AND:
+    if (!where_id_bounds(where->left, &left_low, &left_high) ||
+        !where_id_bounds(where->right, &right_low, &right_high)) {
+      return false;
     }
-    if (strcmp(t, "where") == 0) {
-      has_where_clause = true;
+    *low = left_low > right_low ? left_low : right_low;
+    *high = left_high < right_high ? left_high : right_high;
+    return *low <= *high;
+  case WHERE_OR:
+    left = where_id_bounds(where->left, &left_low, &left_high);
+    right = where_id_bounds(where->right, &right_low, &right_high);
+    if (!left || !right) {
+      *low = left ? left_low : right_low;
+      *high = left ? left_high : right_high;
+      return left || right;
     }
-    t = strtok(NULL, " ");
+    *low = left_low < right_low ? left_low : right_low;
+    *high = left_high > right_high ? left_high : right_high;
+    return true;
+  case WHERE_PREDICATE:
+  default:
+    break;
   }
-  if (has_where_clause) {
-    statement->where = malloc(sizeof(WhereClause));
-    strcpy(statement->where->column_name, column_name);
-    strcpy(statement->where->operator, operator);
-    if (value[0] == '"') {
-      statement->where->value_type = STRING;
-      statement->where->value = value;
-    } else {
-      statement->where->value_type = INT;
-      statement->where->value = malloc(sizeof(int));
-      *(int *)statement->where->value = atoi(value);
-    }
+  if (strcmp(where->column_name, "id") == 0) {
+    return where_id_range(where, low, high);
   }
+  *low = 0;
+  *high = UINT32_MAX;
+  return true;
+}
 
-  return PREPARE_SUCCESS;
+/*
+Is the condition made of predicates on id joined by and? It then selects
+exactly the ids in where_id_bounds.
+*/
+bool where_is_id_range(WhereClause *where) {
+  if (where->type == WHERE_AND) {
+    return where_is_id_range(where->left) && where_is_id_range(where->right);
+  }
+  return where->type == WHERE_PREDICATE &&
+         strcmp(where->column_name, "id") == 0 && where->value_type == INT;
 }
 
-PrepareResult prepare_statement(InputBuffer *input_buffer,
-                                Statement *statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
+/* What a select prints, see select_print_row */
+typedef struct {
+  bool count;        // count(*), the rows are only counted
+  bool descending;   // The rows are scanned from high down to low
+  TopK *top;         // Rows to order before printing, see order.h
+  uint32_t skip;     // Rows still to skip for the offset
+  uint32_t limit;    // See Statement
+  uint32_t num_rows; // Rows printed or counted
+  ResultWriter writer;
+} SelectOutput;
+
+/*
+Print a selected row, or skip or count it, or keep it to order later.
+Returns false at the limit.
+*/
+bool select_print_row(Row *row, SelectOutput *output) {
+  if (output->top != NULL) {
+    top_k_add(output->top, row);
+    return true;
   }
-  if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-    return prepare_select(input_buffer, statement);
+  if (output->skip > 0) {
+    output->skip--;
+    return true;
   }
-  if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
-    return prepare_delete(input_buffer, statement);
+  if (!output->count) {
+    result_write_row(&output->writer, row);
   }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+  output->num_rows++;
+  return output->num_rows < output->limit;
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-  Row *row_to_insert = statement->row_to_insert;
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor *cursor = table_find(table, key_to_insert);
-
-  void *node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+/*
+Print the rows of a leaf from cell_num on, see leaf_node_filter. Rows
+skipped or counted are not deserialized. Returns false once the select
+is done: the leaf holds ids past high or the limit is reached.
+*/
+bool select_leaf(void *node, uint32_t cell_num, uint32_t high,
+                 WhereClause *where, SelectOutput *output) {
+  uint32_t cells[LEAF_NODE_MAX_CELLS(PAGE_SIZE_MAX)];
+  bool past_high;
+  uint32_t num_selected =
+      leaf_node_filter(node, cell_num, high, where, cells, &past_high);
+  uint32_t first = output->skip < num_selected ? output->skip : num_selected;
+  output->skip -= first;
+  if (output->count) {
+    output->num_rows += num_selected - first;
+    return !past_high;
+  }
+  Row row;
+  for (uint32_t i = first; i < num_selected; i++) {
+    uint8_t *record = leaf_node_value(node, cells[i]);
+    if (output->top != NULL && !top_k_accepts(output->top, record)) {
+      continue;
+    }
+    deserialize_row(record, &row);
+    if (!select_print_row(&row, output)) {
+      return false;
+    }
+  }
+  return !past_high;
+}
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      printf("ooops!\n");
-      return EXECUTE_DUPLICATE_KEY;
+/*
+Print the rows of a leaf up to cell_num with ids from low, last first.
+Returns false once the select is done: the leaf holds ids below low or
+the limit is reached.
+*/
+bool select_leaf_reverse(void *node, uint32_t cell_num, uint32_t low,
+                         WhereClause *where, SelectOutput *output) {
+  uint32_t cells[LEAF_NODE_MAX_CELLS(PAGE_SIZE_MAX)];
+  bool past_high;
+  uint32_t first_cell = key_search(leaf_node_key(node, 0), cell_num + 1, low);
+  uint32_t num_selected =
+      leaf_node_filter(node, first_cell, *leaf_node_key(node, cell_num), where,
+                       cells, &past_high);
+  uint32_t skipped = output->skip < num_selected ? output->skip : num_selected;
+  output->skip -= skipped;
+  Row row;
+  for (uint32_t i = num_selected - skipped; i > 0; i--) {
+    deserialize_row(leaf_node_value(node, cells[i - 1]), &row);
+    if (!select_print_row(&row, output)) {
+      return false;
     }
   }
+  return first_cell == 0;
+}
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+/* Print the rows with ids from high down to low, for order by id desc */
+void select_reverse(Table *table, uint64_t snapshot, WhereClause *where,
+                    uint32_t low, uint32_t high, SelectOutput *output) {
+  SnapshotCursor *cursor = snapshot_seek_last(table, snapshot, high);
+  while (!(cursor->end_of_table) &&
+         select_leaf_reverse(cursor->node, cursor->cell_num, low, where,
+                             output)) {
+    snapshot_cursor_prev_leaf(cursor);
+  }
+  snapshot_cursor_free(cursor);
+}
 
-  free(cursor);
+/*
+Look the rows up through the index on column, in value order. Equal
+values are one run of cells, and so are the values starting with what a
+like pattern has before its first wildcard.
+*/
+void select_by_index(Table *table, IndexColumn column, WhereClause *where,
+                     SelectOutput *output) {
+  Table *index = table->indexes[column];
+  char *pattern = where->value;
+  bool like = strcmp(where->operator, "like") == 0;
+  size_t prefix_length = like ? strcspn(pattern, "%_") : strlen(pattern);
+  char prefix[COLUMN_EMAIL_SIZE + 1];
+  snprintf(prefix, sizeof(prefix), "%.*s", (int)prefix_length, pattern);
 
-  return EXECUTE_SUCCESS;
+  Row entry, row;
+  bool more = true;
+  Cursor *cursor = index_seek(index, column, prefix, 0);
+  while (!(cursor->end_of_table) && more) {
+    deserialize_row(cursor_value(cursor), &entry);
+    char *value = index_column_value(&entry, column);
+    if (like ? strncmp(value, prefix, prefix_length) != 0
+             : strcmp(value, pattern) != 0) {
+      break;
+    }
+    if (where_string_matches(where, value)) {
+      Cursor *row_cursor = table_find(table, entry.id);
+      deserialize_row(cursor_value(row_cursor), &row);
+      more = select_print_row(&row, output);
+      pager_unpin(table->pager, row_cursor->page_num);
+      free(row_cursor);
+    }
+    cursor_advance(cursor);
+  }
+  free(cursor);
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table) {
-  Cursor *cursor = table_start(table);
+/*
+The index that answers the condition, NUM_INDEXES if it takes a scan. A
+like pattern has to start with characters, not a wildcard.
+*/
+IndexColumn select_index(WhereClause *where, Table *table) {
+  if (where != NULL && where->type == WHERE_PREDICATE &&
+      (strcmp(where->operator, "=") == 0 ||
+       (strcmp(where->operator, "like") == 0 &&
+        strcspn(where->value, "%_") > 0))) {
+    IndexColumn column = index_column(where->column_name);
+    if (column != NUM_INDEXES && table->indexes[column] != NULL) {
+      return column;
+    }
+  }
+  return NUM_INDEXES;
+}
 
+/*
+Print the rows of a parallel scan. Returns false if the table is too
+small for one, see parallel_scan, or the select stops early: a limit is
+better served by a scan that stops there.
+*/
+bool select_parallel(Table *table, uint64_t snapshot, WhereClause *where,
+                     uint32_t low, uint32_t high, SelectOutput *output) {
+  if (output->count || output->limit != UINT32_MAX) {
+    return false;
+  }
+  ParallelScan *scan = parallel_scan(table, snapshot, low, high, where);
+  if (scan == NULL) {
+    return false;
+  }
   Row row;
-  // select all
-  if (statement->where == NULL) {
-    while (!(cursor->end_of_table)) {
-      deserialize_row(cursor_value(cursor), &row);
-      printf("page %d", cursor->page_num);
-      print_row(&row);
-      cursor_advance(cursor);
+  while (parallel_scan_next(scan, &row)) {
+    select_print_row(&row, output);
+  }
+  parallel_scan_free(scan);
+  return true;
+}
+
+/*
+Set up the output of a select and the ids to scan, from low to high or
+the other way round. Rows that will not come in the order asked for, as
+they do by id from a scan, are ordered through a TopK. Over a plain
+range of ids, a count or an offset is answered from the row counts of
+the tree without walking the rows, see snapshot_rank. Returns false if
+there is nothing to scan.
+*/
+bool select_begin(Statement *statement, Table *table, uint64_t snapshot,
+                  bool by_index, uint32_t *low, uint32_t *high,
+                  SelectOutput *output) {
+  WhereClause *where = statement->where;
+  output->count = statement->count;
+  output->descending = false;
+  output->top = NULL;
+  output->skip = statement->offset;
+  output->limit = statement->limit;
+  output->num_rows = 0;
+  result_writer_begin(&output->writer, output->count);
+  *low = 0;
+  *high = UINT32_MAX;
+  if ((where != NULL && !where_id_bounds(where, low, high)) ||
+      output->limit == 0) {
+    return false;
+  }
+  if (statement->order_by[0] != '\0' &&
+      (by_index || strcmp(statement->order_by, "id") != 0)) {
+    uint64_t capacity = (uint64_t)output->skip + output->limit;
+    output->top = top_k_new(statement->order_by, statement->descending,
+                            capacity < UINT32_MAX ? capacity : UINT32_MAX);
+    output->skip = 0;
+    output->limit = UINT32_MAX;
+    return true;
+  }
+  output->descending = statement->descending;
+  if (where != NULL && !where_is_id_range(where)) {
+    return true;
+  }
+
+  if (output->count) {
+    output->num_rows = snapshot_count_range(table, snapshot, *low, *high);
+    return false;
+  }
+  if (output->skip > 0 && output->descending) {
+    // The row skip rows before the last one up to high
+    uint32_t end = snapshot_count_to(table, snapshot, *high);
+    uint32_t key;
+    if (end <= output->skip ||
+        !snapshot_nth_key(table, snapshot, end - 1 - output->skip, &key)) {
+      return false;
     }
-  } else {
-    // select with where clause
-    if (strcmp(statement->where->column_name, "id") == 0) {
-      uint32_t id = *(int *)(statement->where->value);
-      cursor = table_find(table, id);
-      void *node = get_page(table->pager, cursor->page_num);
-      uint32_t num_cells = *leaf_node_num_cells(node);
-      if (cursor->cell_num >= num_cells) {
-        printf("Not found!\n");
-      } else {
-        deserialize_row(cursor_value(cursor), &row);
-        if (row.id == id) {
-          printf("page %d", cursor->page_num);
-          print_row(&row);
-        } else {
-          printf("Not found!\n");
-        }
+    output->skip = 0;
+    *high = key;
+  } else if (output->skip > 0) {
+    uint64_t n = (uint64_t)snapshot_rank(table, snapshot, *low) + output->skip;
+    uint32_t key;
+    if (n > UINT32_MAX || !snapshot_nth_key(table, snapshot, n, &key)) {
+      return false;
+    }
+    output->skip = 0;
+    *low = key;
+  }
+  return *low <= *high;
+}
+
+/*
+Print what is left, the count or the rows kept to order, and write out
+the result.
+*/
+void select_end(Statement *statement, SelectOutput *output) {
+  WhereClause *where = statement->where;
+  TopK *top = output->top;
+  if (top != NULL) {
+    output->top = NULL;
+    output->skip = statement->offset;
+    output->limit = statement->limit;
+    top_k_sort(top);
+    for (uint32_t i = 0; i < top->num_rows; i++) {
+      if (!select_print_row(&top->rows[i], output)) {
+        break;
       }
     }
+    top_k_free(top);
   }
+  if (output->count) {
+    result_write_count(&output->writer, output->num_rows);
+  }
+  result_writer_end(&output->writer);
+  if (!output->count && output->num_rows == 0 && where != NULL &&
+      where->type == WHERE_PREDICATE &&
+      strcmp(where->column_name, "id") == 0 &&
+      strcmp(where->operator, "=") == 0) {
+    printf("Not found!\n");
+  }
+}
 
-  free(cursor);
+ExecuteResult execute_select(Statement *statement, Table *table) {
+  WhereClause *where = statement->where;
+  uint64_t snapshot = table->pager->commit_seq;
+  IndexColumn column = select_index(where, table);
+  uint32_t low, high;
+  SelectOutput output;
+  if (select_begin(statement, table, snapshot, column != NUM_INDEXES, &low,
+                   &high, &output)) {
+    if (column != NUM_INDEXES) {
+      select_by_index(table, column, where, &output);
+    } else if (output.descending) {
+      select_reverse(table, snapshot, where, low, high, &output);
+    } else if (!select_parallel(table, snapshot, where, low, high, &output)) {
+      // Seek to the low end of the ids, then take the leaves one by one
+      Cursor *cursor = table_seek(table, low);
+      while (!(cursor->end_of_table) &&
+             select_leaf(get_page(table->pager, cursor->page_num),
+                         cursor->cell_num, high, where, &output)) {
+        cursor_next_leaf(cursor);
+      }
+      free(cursor);
+    }
+  }
+  select_end(statement, &output);
 
   return EXECUTE_SUCCESS;
 }
 
 ExecuteResult execute_delete(Statement *statement, Table *table) {
-  Cursor *cursor = table_start(table);
   Row row;
+  if (statement->where == NULL || statement->where->type != WHERE_PREDICATE ||
+      strcmp(statement->where->column_name, "id") != 0 ||
+      strcmp(statement->where->operator, "=") != 0 ||
+      statement->where->value_type != INT) {
+    return EXECUTE_UNSUPPORTED_DELETE;
+  }
   // select with where clause
   if (strcmp(statement->where->column_name, "id") == 0) {
     uint32_t id = *(int *)(statement->where->value);
-    cursor = table_find(table, id);
+    Cursor *cursor = table_find(table, id);
     void *node = get_page(table->pager, cursor->page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
     if (cursor->cell_num >= num_cells) {
@@ -232,29 +639,289 @@ ExecuteResult execute_delete(Statement *statement, Table *table) {
     } else {
       deserialize_row(cursor_value(cursor), &row);
       if (row.id == id) {
-        printf("page %d", cursor->page_num);
-        print_row(&row);
-        printf("delete row of id: %d\n", id);
+        TRACE(TRACE_LEVEL_PATH, TRACE_DELETE, cursor->page_num, id,
+              cursor->cell_num);
         leaf_node_delete(cursor);
+        for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+          if (table->indexes[i] != NULL) {
+            index_delete(table->indexes[i], i, &row);
+          }
+        }
       } else {
         printf("Not found!\n");
       }
     }
+    free(cursor);
   }
-  free(cursor);
 
   return EXECUTE_SUCCESS;
 }
 
+ExecuteResult execute_create_index(Statement *statement, Table *table) {
+  if (table->indexes[statement->index_column] != NULL) {
+    return EXECUTE_INDEX_EXISTS;
+  }
+  index_create(table, statement->index_column);
+  return EXECUTE_SUCCESS;
+}
+
 ExecuteResult execute_statement(Statement *statement, Table *table) {
+  uint64_t start = stats_now();
+  ExecuteResult result;
   switch (statement->type) {
   case (STATEMENT_INSERT):
-    return execute_insert(statement, table);
+    if (statement->values != NULL) {
+      result = execute_insert_values(statement, table);
+    } else {
+      result = execute_insert(statement, table);
+    }
+    break;
   case (STATEMENT_SELECT):
-    return execute_select(statement, table);
+    result = execute_select(statement, table);
+    break;
   case (STATEMENT_DELETE):
-    return execute_delete(statement, table);
+    result = execute_delete(statement, table);
+    break;
+  case (STATEMENT_CREATE_INDEX):
+    result = execute_create_index(statement, table);
+    break;
+  default:
+    printf("Unknown statement type %d.\n", statement->type);
+    exit(EXIT_FAILURE);
+  }
+
+  // Pages fetched by the statement may be evicted from now on
+  pager_end_statement(table->pager);
+  stats_record_statement(&table->pager->stats, statement->type, start);
+  return result;
+}
+
+/*
+Library mode, for a table opened with PagerOptions.concurrent. Any number
+of threads read through db_read_row and db_read_range while db_execute
+runs statements, one at a time. Point reads hold the structure latch
+shared and crab page latches down the tree. A single-row insert that
+stays in its leaves, or splits them into parents with room, is written
+under page latches beside them. Any other statement takes the structure
+latch exclusively: it waits for the point reads in flight and new ones
+wait for it.
+
+Range reads and selects that scan read a snapshot instead, see
+SnapshotCursor. They take no latches past the start, so writers never
+wait for them however long they run, and they see no statement that
+committed after they began. db_snapshot_begin lets several reads share
+one snapshot. db_count_range and db_read_nth read a snapshot as well,
+but only a page per level of the tree, see snapshot_rank.
+*/
+
+/* Called for each row read, returns false to stop. Must not use the table */
+typedef bool (*RowVisitor)(Row *row, void *arg);
+
+bool db_read_row(Table *table, uint32_t id, Row *row) {
+  pthread_rwlock_rdlock(&table->structure_latch);
+  void *node;
+  uint32_t page_num = table_latch_leaf(table, id, &node);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell_num = key_search(leaf_node_key(node, 0), num_cells, id);
+  bool found = cell_num < num_cells && *leaf_node_key(node, cell_num) == id;
+  if (found) {
+    deserialize_row(leaf_node_value(node, cell_num), row);
+  }
+  table_unlatch_page(table, page_num);
+  pthread_rwlock_unlock(&table->structure_latch);
+  return found;
+}
+
+/* Everything committed so far, until db_snapshot_end */
+uint64_t db_snapshot_begin(Table *table) {
+  return pager_snapshot_begin(table->pager);
+}
+
+void db_snapshot_end(Table *table, uint64_t snapshot) {
+  pager_snapshot_end(table->pager, snapshot);
+}
+
+/* Visit the rows of the snapshot with ids from low to high */
+uint32_t db_read_snapshot(Table *table, uint64_t snapshot, uint32_t low,
+                          uint32_t high, RowVisitor visit, void *arg) {
+  uint32_t num_rows = 0;
+  Row row;
+  SnapshotCursor *cursor = snapshot_seek(table, snapshot, low);
+  while (!(cursor->end_of_table)) {
+    deserialize_row(snapshot_cursor_value(cursor), &row);
+    if (row.id > high) {
+      break;
+    }
+    num_rows++;
+    if (!visit(&row, arg)) {
+      break;
+    }
+    snapshot_cursor_advance(cursor);
+  }
+  snapshot_cursor_free(cursor);
+  return num_rows;
+}
+
+/* Visit the rows with ids from low to high. Returns the number visited */
+uint32_t db_read_range(Table *table, uint32_t low, uint32_t high,
+                       RowVisitor visit, void *arg) {
+  uint64_t snapshot = db_snapshot_begin(table);
+  uint32_t num_rows = db_read_snapshot(table, snapshot, low, high, visit, arg);
+  db_snapshot_end(table, snapshot);
+  return num_rows;
+}
+
+/* Number of rows with ids from low to high */
+uint32_t db_count_range(Table *table, uint32_t low, uint32_t high) {
+  if (low > high) {
+    return 0;
+  }
+  uint64_t snapshot = db_snapshot_begin(table);
+  uint32_t count = snapshot_count_range(table, snapshot, low, high);
+  db_snapshot_end(table, snapshot);
+  return count;
+}
+
+/* The row with n rows before it in id order. Returns false past the end */
+bool db_read_nth(Table *table, uint32_t n, Row *row) {
+  uint64_t snapshot = db_snapshot_begin(table);
+  uint32_t key;
+  bool found = snapshot_nth_key(table, snapshot, n, &key);
+  if (found) {
+    SnapshotCursor *cursor = snapshot_seek(table, snapshot, key);
+    deserialize_row(snapshot_cursor_value(cursor), row);
+    snapshot_cursor_free(cursor);
+  }
+  db_snapshot_end(table, snapshot);
+  return found;
+}
+
+/* Counters and statement latencies so far, see stats.h */
+void db_stats(Table *table, Stats *stats) {
+  stats_copy(stats, &table->pager->stats);
+}
+
+void db_stats_reset(Table *table) { stats_reset(&table->pager->stats); }
+
+/* Shape of the table, walking every page of it in a snapshot */
+void db_tree_stats(Table *table, TreeStats *stats) {
+  uint64_t snapshot = db_snapshot_begin(table);
+  tree_stats(table, snapshot, stats);
+  db_snapshot_end(table, snapshot);
+}
+
+/* A select that scans the table, over a snapshot, see execute_select */
+ExecuteResult execute_select_snapshot(Statement *statement, Table *table,
+                                      uint64_t snapshot) {
+  WhereClause *where = statement->where;
+  uint32_t low, high;
+  SelectOutput output;
+  if (select_begin(statement, table, snapshot, false, &low, &high, &output)) {
+    if (output.descending) {
+      select_reverse(table, snapshot, where, low, high, &output);
+    } else if (!select_parallel(table, snapshot, where, low, high, &output)) {
+      SnapshotCursor *cursor = snapshot_seek(table, snapshot, low);
+      while (!(cursor->end_of_table) &&
+             select_leaf(cursor->node, cursor->cell_num, high, where,
+                         &output)) {
+        snapshot_cursor_next_leaf(cursor);
+      }
+      snapshot_cursor_free(cursor);
+    }
+  }
+  select_end(statement, &output);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+Insert a row beside the readers, see table_latch_for_insert. The table
+and every index must take it in place, or nothing is changed and false
+is returned.
+*/
+bool execute_insert_latched(Statement *statement, Table *table,
+                            ExecuteResult *result) {
+  Row *row = statement->row_to_insert;
+  uint32_t latched[2 * (NUM_INDEXES + 1)];
+  uint32_t num_latched = 0;
+  Cursor *index_cursors[NUM_INDEXES] = {NULL};
+  Row entries[NUM_INDEXES];
+  uint32_t keys[NUM_INDEXES];
+
+  *result = EXECUTE_SUCCESS;
+  Cursor *cursor = table_latch_for_insert(table, row->id, row_record_size(row),
+                                          latched, &num_latched);
+  bool in_place = cursor != NULL;
+  if (in_place) {
+    void *node = get_page(table->pager, cursor->page_num);
+    if (cursor->cell_num < *leaf_node_num_cells(node) &&
+        *leaf_node_key(node, cursor->cell_num) == row->id) {
+      *result = EXECUTE_DUPLICATE_KEY;
+    }
+  }
+  for (uint32_t i = 0; i < NUM_INDEXES && in_place; i++) {
+    if (table->indexes[i] != NULL && *result == EXECUTE_SUCCESS) {
+      keys[i] = index_entry(i, row, &entries[i]);
+      index_cursors[i] = index_latch_for_insert(table->indexes[i], i,
+                                                &entries[i], latched,
+                                                &num_latched);
+      in_place = index_cursors[i] != NULL;
+    }
+  }
+
+  if (in_place && *result == EXECUTE_SUCCESS) {
+    leaf_node_insert(cursor, row->id, row);
+    for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+      if (index_cursors[i] != NULL) {
+        leaf_node_insert(index_cursors[i], keys[i], &entries[i]);
+      }
+    }
+  }
+  for (uint32_t i = 0; i < num_latched; i++) {
+    pager_unlatch(table->pager, latched[i]);
+  }
+  free(cursor);
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    free(index_cursors[i]);
+  }
+  return in_place;
+}
+
+ExecuteResult db_execute(Table *table, Statement *statement) {
+  uint64_t start = stats_now();
+  ExecuteResult result;
+  if (statement->type == STATEMENT_SELECT) {
+    // Whether an index answers it only changes under the exclusive latch
+    pthread_rwlock_rdlock(&table->structure_latch);
+    bool scan = select_index(statement->where, table) == NUM_INDEXES;
+    uint64_t snapshot = scan ? db_snapshot_begin(table) : 0;
+    pthread_rwlock_unlock(&table->structure_latch);
+    if (scan) {
+      result = execute_select_snapshot(statement, table, snapshot);
+      db_snapshot_end(table, snapshot);
+      stats_record_statement(&table->pager->stats, statement->type, start);
+      return result;
+    }
+  }
+
+  pthread_mutex_lock(&table->writer);
+
+  pthread_rwlock_rdlock(&table->structure_latch);
+  bool done = statement->type == STATEMENT_INSERT &&
+              statement->values == NULL &&
+              execute_insert_latched(statement, table, &result);
+  if (done) {
+    pager_end_statement(table->pager);
+    stats_record_statement(&table->pager->stats, statement->type, start);
+  }
+  pthread_rwlock_unlock(&table->structure_latch);
+
+  if (!done) {
+    pthread_rwlock_wrlock(&table->structure_latch);
+    result = execute_statement(statement, table);
+    pthread_rwlock_unlock(&table->structure_latch);
   }
+  pthread_mutex_unlock(&table->writer);
+  return result;
 }
 
 #endif
@@ -0,0 +1,285 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include "btree.h"
+#include "index.h"
+
+/*
+Where conditions. Scans evaluate them a leaf at a time on the records in
+the page: every predicate runs over the whole batch of cells before the
+next one does, reading column values where they are stored, and only
+the rows left selected are deserialized. String predicates are picked
+apart once per batch into the cheapest match that does the job.
+*/
+
+/*
+Turn a where clause on id into the closed range of ids it selects.
+Returns false if no id can match.
+*/
+bool where_id_range(WhereClause *where, uint32_t *low, uint32_t *high) {
+  if (where->value_type != INT) {
+    return false;
+  }
+  int64_t value = *(int *)where->value;
+  int64_t from = 0;
+  int64_t to = UINT32_MAX;
+  if (strcmp(where->operator, "=") == 0) {
+    from = value;
+    to = value;
+  } else if (strcmp(where->operator, "<") == 0) {
+    to = value - 1;
+  } else if (strcmp(where->operator, "<=") == 0) {
+    to = value;
+  } else if (strcmp(where->operator, ">") == 0) {
+    from = value + 1;
+  } else if (strcmp(where->operator, ">=") == 0) {
+    from = value;
+  } else if (strcmp(where->operator, "between") == 0) {
+    from = value;
+    to = *(int *)where->upper_value;
+  } else {
+    return false;
+  }
+
+  if (from < 0) {
+    from = 0;
+  }
+  if (from > to) {
+    return false;
+  }
+  *low = from;
+  *high = to;
+  return true;
+}
+
+typedef enum {
+  MATCH_EQUAL,
+  MATCH_PREFIX,
+  MATCH_SUFFIX,
+  MATCH_CONTAINS,
+  MATCH_LIKE,   // A pattern with wildcards inside, see like_matches
+  MATCH_COMPARE // <, <=, >, >= and between
+} MatchType;
+
+/* A string predicate picked apart, see string_match_init */
+typedef struct {
+  MatchType type;
+  const char *needle;
+  uint32_t needle_length;
+} StringMatch;
+
+void string_match_init(WhereClause *where, StringMatch *match) {
+  const char *value = where->value;
+  uint32_t length = strlen(value);
+  match->needle = value;
+  match->needle_length = length;
+  if (strcmp(where->operator, "contains") == 0) {
+    match->type = MATCH_CONTAINS;
+  } else if (strcmp(where->operator, "like") == 0) {
+    // Only a leading or trailing % gets a match of its own
+    bool leading = length > 0 && value[0] == '%';
+    bool trailing = length > leading && value[length - 1] == '%';
+    uint32_t inner_length = length - leading - trailing;
+    if (memchr(value + leading, '%', inner_length) != NULL ||
+        memchr(value + leading, '_', inner_length) != NULL) {
+      match->type = MATCH_LIKE;
+      return;
+    }
+    match->needle = value + leading;
+    match->needle_length = inner_length;
+    match->type = leading ? (trailing ? MATCH_CONTAINS : MATCH_SUFFIX)
+                          : (trailing ? MATCH_PREFIX : MATCH_EQUAL);
+  } else if (strcmp(where->operator, "=") == 0) {
+    match->type = MATCH_EQUAL;
+  } else {
+    match->type = MATCH_COMPARE;
+  }
+}
+
+/* strcmp for a value that is not NUL-terminated */
+int string_compare(const char *value, uint32_t length, const char *other) {
+  uint32_t other_length = strlen(other);
+  int order =
+      memcmp(value, other, length < other_length ? length : other_length);
+  if (order != 0) {
+    return order;
+  }
+  return (length > other_length) - (length < other_length);
+}
+
+/* % matches any run of characters and _ any one character */
+bool like_matches(const char *pattern, uint32_t pattern_length,
+                  const char *value, uint32_t length) {
+  uint32_t p = 0, v = 0;
+  // Where to resume after the last %, if the characters after it mismatch
+  uint32_t star_p = UINT32_MAX, star_v = 0;
+  while (v < length) {
+    if (p < pattern_length && pattern[p] == '%') {
+      star_p = ++p;
+      star_v = v;
+    } else if (p < pattern_length &&
+               (pattern[p] == '_' || pattern[p] == value[v])) {
+      p++;
+      v++;
+    } else if (star_p != UINT32_MAX) {
+      p = star_p;
+      v = ++star_v;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern_length && pattern[p] == '%') {
+    p++;
+  }
+  return p == pattern_length;
+}
+
+bool string_matches(WhereClause *where, StringMatch *match, const char *value,
+                    uint32_t length) {
+  uint32_t needle_length = match->needle_length;
+  switch (match->type) {
+  case MATCH_EQUAL:
+    return length == needle_length &&
+           memcmp(value, match->needle, length) == 0;
+  case MATCH_PREFIX:
+    return length >= needle_length &&
+           memcmp(value, match->needle, needle_length) == 0;
+  case MATCH_SUFFIX:
+    return length >= needle_length &&
+           memcmp(value + length - needle_length, match->needle,
+                  needle_length) == 0;
+  case MATCH_CONTAINS:
+    return string_find(value, length, match->needle, needle_length);
+  case MATCH_LIKE:
+    return like_matches(match->needle, needle_length, value, length);
+  case MATCH_COMPARE:
+  default:
+    break;
+  }
+  int order = string_compare(value, length, where->value);
+  if (strcmp(where->operator, "<") == 0) {
+    return order < 0;
+  } else if (strcmp(where->operator, "<=") == 0) {
+    return order <= 0;
+  } else if (strcmp(where->operator, ">") == 0) {
+    return order > 0;
+  } else if (strcmp(where->operator, ">=") == 0) {
+    return order >= 0;
+  } else if (strcmp(where->operator, "between") == 0) {
+    return order >= 0 &&
+           string_compare(value, length, where->upper_value) <= 0;
+  }
+  return false;
+}
+
+/* Does value satisfy "column <operator> value" or "column like pattern"? */
+bool where_string_matches(WhereClause *where, char *value) {
+  StringMatch match;
+  string_match_init(where, &match);
+  return string_matches(where, &match, value, strlen(value));
+}
+
+bool where_row_matches(WhereClause *where, Row *row) {
+  switch (where->type) {
+  case WHERE_AND:
+    return where_row_matches(where->left, row) &&
+           where_row_matches(where->right, row);
+  case WHERE_OR:
+    return where_row_matches(where->left, row) ||
+           where_row_matches(where->right, row);
+  case WHERE_PREDICATE:
+  default:
+    break;
+  }
+  if (strcmp(where->column_name, "id") == 0) {
+    uint32_t low, high;
+    return where_id_range(where, &low, &high) && row->id >= low &&
+           row->id <= high;
+  }
+  return where_string_matches(
+      where, index_column_value(row, index_column(where->column_name)));
+}
+
+/* A column of a record as stored in a leaf, see serialize_row */
+const char *record_column(const uint8_t *record, IndexColumn column,
+                          uint32_t *length) {
+  const uint8_t *value = record + ID_SIZE;
+  if (column == INDEX_EMAIL) {
+    value += STRING_LENGTH_SIZE + value[0];
+  }
+  *length = value[0];
+  return (const char *)value + STRING_LENGTH_SIZE;
+}
+
+/* Set selected[i] to whether records[i] satisfies where */
+void where_filter_batch(WhereClause *where, uint8_t **records,
+                        uint32_t num_rows, uint8_t *selected) {
+  if (where->type != WHERE_PREDICATE) {
+    uint8_t right[num_rows];
+    where_filter_batch(where->left, records, num_rows, selected);
+    where_filter_batch(where->right, records, num_rows, right);
+    for (uint32_t i = 0; i < num_rows; i++) {
+      selected[i] = where->type == WHERE_AND ? selected[i] & right[i]
+                                             : selected[i] | right[i];
+    }
+    return;
+  }
+
+  if (strcmp(where->column_name, "id") == 0) {
+    uint32_t low, high, id;
+    bool any = where_id_range(where, &low, &high);
+    for (uint32_t i = 0; i < num_rows; i++) {
+      memcpy(&id, records[i] + ID_OFFSET, ID_SIZE);
+      selected[i] = any && id >= low && id <= high;
+    }
+    return;
+  }
+
+  IndexColumn column = index_column(where->column_name);
+  StringMatch match;
+  string_match_init(where, &match);
+  for (uint32_t i = 0; i < num_rows; i++) {
+    uint32_t length;
+    const char *value = record_column(records[i], column, &length);
+    selected[i] = string_matches(where, &match, value, length);
+  }
+}
+
+/*
+Cells of a leaf from cell_num on with ids up to high that satisfy where,
+which may be NULL. Their numbers go to cells. Sets past_high if the leaf
+holds ids above high. Returns the number of cells.
+*/
+uint32_t leaf_node_filter(void *node, uint32_t cell_num, uint32_t high,
+                          WhereClause *where, uint32_t *cells,
+                          bool *past_high) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t end = num_cells;
+  if (cell_num < num_cells && high < UINT32_MAX) {
+    end = cell_num + key_search(leaf_node_key(node, cell_num),
+                                num_cells - cell_num, high + 1);
+  }
+  *past_high = end < num_cells;
+  if (cell_num >= end) {
+    return 0;
+  }
+
+  uint32_t num_rows = end - cell_num;
+  uint8_t *records[num_rows];
+  uint8_t selected[num_rows];
+  for (uint32_t i = 0; i < num_rows; i++) {
+    records[i] = leaf_node_value(node, cell_num + i);
+    selected[i] = true;
+  }
+  if (where != NULL) {
+    where_filter_batch(where, records, num_rows, selected);
+  }
+  uint32_t num_selected = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    cells[num_selected] = cell_num + i;
+    num_selected += selected[i];
+  }
+  return num_selected;
+}
+
+#endif
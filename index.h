@@ -0,0 +1,204 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include "btree.h"
+
+/*
+Secondary indexes. Each index is a B+tree of its own over the table's
+pager and node layout. A cell holds the row id and the full column
+value, and cells sort by value and then by id, so every row has a place
+of its own. The tree's key of a cell is the first four bytes of the
+value read big-endian, which sort like the values do on those bytes.
+It routes a search to the run of cells sharing them, and a binary
+search over the ranks in the run (see table_seek_nth) compares the
+values and ids to land on the exact cell.
+*/
+
+/* Rows indexed per statement while building, bounds the pinned pages */
+#define INDEX_BUILD_BATCH_ROWS 1000
+
+const char *INDEX_COLUMN_NAMES[] = {"username", "email"};
+
+/* Returns NUM_INDEXES if the column has no index support */
+IndexColumn index_column(const char *column_name) {
+  for (uint32_t i = 0; i < NUM_INDEXES; i++) {
+    if (strcmp(column_name, INDEX_COLUMN_NAMES[i]) == 0) {
+      return i;
+    }
+  }
+  return NUM_INDEXES;
+}
+
+char *index_column_value(Row *row, IndexColumn column) {
+  switch (column) {
+  case INDEX_USERNAME:
+    return row->username;
+  case INDEX_EMAIL:
+  default:
+    return row->email;
+  }
+}
+
+uint32_t index_key(const char *value) {
+  uint32_t key = 0;
+  for (uint32_t i = 0; i < sizeof(key); i++) {
+    key <<= 8;
+    if (*value != '\0') {
+      key |= (uint8_t)*value++;
+    }
+  }
+  return key;
+}
+
+/* The cell a row has in an index, returns its key */
+uint32_t index_entry(IndexColumn column, Row *row, Row *entry) {
+  memset(entry, 0, sizeof(Row));
+  entry->id = row->id;
+  strcpy(index_column_value(entry, column), index_column_value(row, column));
+  return index_key(index_column_value(row, column));
+}
+
+/* Compare the cell of an index to value and id */
+int index_entry_compare(void *record, IndexColumn column, const char *value,
+                        uint32_t id) {
+  Row entry;
+  deserialize_row(record, &entry);
+  int result = strcmp(index_column_value(&entry, column), value);
+  if (result != 0) {
+    return result;
+  }
+  return entry.id < id ? -1 : entry.id > id;
+}
+
+/* Cells before value and id: those with a smaller key, and in the run
+   sharing its key those smaller by index_entry_compare */
+uint32_t index_rank(Table *index, IndexColumn column, const char *value,
+                    uint32_t id) {
+  uint32_t key = index_key(value);
+  uint32_t low = table_rank(index, key);
+  uint32_t high;
+  if (key == UINT32_MAX) {
+    void *root = get_page(index->pager, index->root_page_num);
+    high = node_row_count(index, root);
+  } else {
+    high = table_rank(index, key + 1);
+  }
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    Cursor *cursor = table_seek_nth(index, mid, false, 0);
+    int result = index_entry_compare(cursor_value(cursor), column, value, id);
+    free(cursor);
+    if (result < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* Cursor on the first cell not smaller than value and id */
+Cursor *index_seek(Table *index, IndexColumn column, const char *value,
+                   uint32_t id) {
+  return table_seek_nth(index, index_rank(index, column, value, id), false, 0);
+}
+
+/* Cursor where the cell of entry goes */
+Cursor *index_find(Table *index, IndexColumn column, Row *entry) {
+  char *value = index_column_value(entry, column);
+  uint32_t rank = index_rank(index, column, value, entry->id);
+  return table_seek_nth(index, rank, true, index_key(value));
+}
+
+void index_insert(Table *index, IndexColumn column, Row *row) {
+  Row entry;
+  uint32_t key = index_entry(column, row, &entry);
+  Cursor *cursor = index_find(index, column, &entry);
+  leaf_node_insert(cursor, key, &entry);
+  free(cursor);
+}
+
+/*
+Index the rows of a batch. Each goes in on its own: table_insert_batch
+merges cells by key alone and would not keep the order of values and
+ids in a run sharing a key.
+*/
+void index_insert_batch(Table *index, IndexColumn column, Row *rows,
+                        uint32_t num_rows) {
+  for (uint32_t i = 0; i < num_rows; i++) {
+    index_insert(index, column, &rows[i]);
+  }
+}
+
+/*
+Library mode, see table_latch_for_insert. Latch for inserting the cell
+of entry, returns a cursor where it goes or NULL.
+*/
+Cursor *index_latch_for_insert(Table *index, IndexColumn column, Row *entry,
+                               uint32_t *latched, uint32_t *num_latched) {
+  Cursor *cursor = index_find(index, column, entry);
+  if (!table_latch_leaf_for_insert(index, cursor->page_num,
+                                   row_record_size(entry), latched,
+                                   num_latched)) {
+    free(cursor);
+    return NULL;
+  }
+  return cursor;
+}
+
+void index_delete(Table *index, IndexColumn column, Row *row) {
+  char *value = index_column_value(row, column);
+  Cursor *cursor = index_seek(index, column, value, row->id);
+  if (!(cursor->end_of_table) &&
+      index_entry_compare(cursor_value(cursor), column, value, row->id) == 0) {
+    leaf_node_delete(cursor);
+  }
+  free(cursor);
+}
+
+/* Add every row of the table to one of its (empty) indexes */
+void index_build(Table *table, IndexColumn column) {
+  Table *index = table->indexes[column];
+  Cursor *cursor = table_start(table);
+
+  Row row;
+  uint32_t num_rows = 0;
+  while (!(cursor->end_of_table)) {
+    deserialize_row(cursor_value(cursor), &row);
+    index_insert(index, column, &row);
+    if (++num_rows % INDEX_BUILD_BATCH_ROWS == 0) {
+      pager_end_statement(table->pager);
+    }
+    cursor_advance(cursor);
+  }
+  free(cursor);
+}
+
+/*
+Create the index and fill it. The build commits every
+INDEX_BUILD_BATCH_ROWS rows, so it is not atomic, but the header only
+lists the index once it is complete. Until then it records the root as
+the index being built, and a crash midway leaves the partial tree to
+db_open, which frees its pages.
+*/
+void index_create(Table *table, IndexColumn column) {
+  Pager *pager = table->pager;
+  uint32_t root_page_num = get_unused_page_num(pager);
+  void *root = get_page(pager, root_page_num);
+  pager_mark_dirty(pager, root_page_num);
+  initialize_leaf_node(table, root);
+  set_node_root(root, true);
+  void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+  *db_header_index_build_root(header) = root_page_num;
+
+  table->indexes[column] = table_new(pager, root_page_num);
+  index_build(table, column);
+
+  header = get_page(pager, DB_HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+  *db_header_index_root(header, column) = root_page_num;
+  *db_header_index_build_root(header) = 0;
+}
+
+#endif
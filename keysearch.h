@@ -0,0 +1,114 @@
+#ifndef __KEYSEARCH_H__
+#define __KEYSEARCH_H__
+
+#include <stdint.h>
+
+/*
+Key search over the sorted key array of a node. key_search returns the
+number of keys below the one searched for, which is where it is or would
+be inserted. A branch-free binary search narrows the array down to one
+block and a SIMD compare finishes it: the lanes holding smaller keys are
+turned into a bit mask and counted. The block kernel is picked on first
+use from what the CPU supports, with a scalar loop as the fallback.
+*/
+
+/* Keys left to the block kernel, two AVX2 compares */
+#define KEY_SEARCH_BLOCK 16
+
+typedef uint32_t (*KeySearchBlock)(const uint32_t *keys, uint32_t num_keys,
+                                   uint32_t key);
+
+uint32_t key_search_block_scalar(const uint32_t *keys, uint32_t num_keys,
+                                 uint32_t key) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    count += keys[i] < key;
+  }
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+There is no unsigned compare, flipping the sign bit of both sides makes
+the signed one order them the same way
+*/
+__attribute__((target("avx2"))) uint32_t
+key_search_block_avx2(const uint32_t *keys, uint32_t num_keys, uint32_t key) {
+  const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+  __m256i needle = _mm256_xor_si256(_mm256_set1_epi32(key), sign);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 8 <= num_keys; i += 8) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+    __m256i below = _mm256_cmpgt_epi32(needle, _mm256_xor_si256(block, sign));
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(below)));
+  }
+  return count + key_search_block_scalar(keys + i, num_keys - i, key);
+}
+
+__attribute__((target("sse4.2,popcnt"))) uint32_t
+key_search_block_sse42(const uint32_t *keys, uint32_t num_keys, uint32_t key) {
+  const __m128i sign = _mm_set1_epi32(INT32_MIN);
+  __m128i needle = _mm_xor_si128(_mm_set1_epi32(key), sign);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= num_keys; i += 4) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(keys + i));
+    __m128i below = _mm_cmpgt_epi32(needle, _mm_xor_si128(block, sign));
+    count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(below)));
+  }
+  return count + key_search_block_scalar(keys + i, num_keys - i, key);
+}
+#endif
+
+uint32_t key_search_block_resolve(const uint32_t *keys, uint32_t num_keys,
+                                  uint32_t key);
+
+/* Starts out as the resolver, which replaces itself on the first call */
+KeySearchBlock key_search_block = key_search_block_resolve;
+
+uint32_t key_search_block_resolve(const uint32_t *keys, uint32_t num_keys,
+                                  uint32_t key) {
+  key_search_block = key_search_block_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    key_search_block = key_search_block_avx2;
+  } else if (__builtin_cpu_supports("sse4.2") &&
+             __builtin_cpu_supports("popcnt")) {
+    key_search_block = key_search_block_sse42;
+  }
+#endif
+  return key_search_block(keys, num_keys, key);
+}
+
+/* Name of the kernel in use, for .constants */
+const char *key_search_kernel() {
+  if (key_search_block == key_search_block_resolve) {
+    key_search_block_resolve(NULL, 0, 0);
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (key_search_block == key_search_block_avx2) {
+    return "avx2";
+  } else if (key_search_block == key_search_block_sse42) {
+    return "sse4.2";
+  }
+#endif
+  return "scalar";
+}
+
+uint32_t key_search(const uint32_t *keys, uint32_t num_keys, uint32_t key) {
+  const uint32_t *base = keys;
+  uint32_t n = num_keys;
+  while (n > KEY_SEARCH_BLOCK) {
+    // Keys before base are below key, keys from base + n on are not
+    uint32_t half = n / 2;
+    base = (base[half] < key) ? base + half : base;
+    n -= half;
+  }
+  return (base - keys) + key_search_block(base, n, key);
+}
+
+#endif
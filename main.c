@@ -1,13 +1,66 @@
 #include "db.h"
 
+void print_usage(const char *program) {
+  printf("Usage: %s [options] <database file>\n"
+         "  --cache-size=<size>         Memory for the buffer pool\n"
+         "  --page-size=<size>          Page size of a new database\n"
+         "  --checkpoint-interval=<n>   Statements between checkpoints\n"
+         "  --scan-threads=<n>          Threads for scans without an index\n"
+         "  --sync=off|normal|full      When the WAL is synced\n"
+         "  --no-wal                    Write pages in place\n"
+         "  --mmap                      Map the file instead of a cache\n"
+         "  --no-io-uring               Use pread and pwrite only\n",
+         program);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
+  PagerOptions options = default_pager_options();
+  char *filename = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+      options.cache_size = parse_size(argv[i] + 13);
+    } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+      options.page_size = parse_size(argv[i] + 12);
+    } else if (strncmp(argv[i], "--checkpoint-interval=", 22) == 0) {
+      options.checkpoint_interval = atoi(argv[i] + 22);
+    } else if (strncmp(argv[i], "--scan-threads=", 15) == 0) {
+      options.scan_threads = atoi(argv[i] + 15);
+    } else if (strcmp(argv[i], "--sync=off") == 0) {
+      options.sync_mode = WAL_SYNC_OFF;
+    } else if (strcmp(argv[i], "--sync=normal") == 0) {
+      options.sync_mode = WAL_SYNC_NORMAL;
+    } else if (strcmp(argv[i], "--sync=full") == 0) {
+      options.sync_mode = WAL_SYNC_FULL;
+    } else if (strcmp(argv[i], "--no-wal") == 0) {
+      options.use_wal = false;
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.backend = PAGER_BACKEND_MMAP;
+    } else if (strcmp(argv[i], "--no-io-uring") == 0) {
+      options.use_io_uring = false;
+    } else if (strcmp(argv[i], "--help") == 0) {
+      print_usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    } else if (argv[i][0] == '-') {
+      // Rather than open a database named after a mistyped option
+      printf("Unknown option '%s'.\n", argv[i]);
+      print_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    } else if (filename != NULL) {
+      printf("Only one database filename may be given.\n");
+      print_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (filename == NULL) {
     printf("Must supply a database filename.\n");
+    print_usage(argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  char *filename = argv[1];
-  Table *table = db_open(filename);
+  Table *table = db_open_with_options(filename, &options);
 
   InputBuffer *input_buffer = new_input_buffer();
   while (true) {
@@ -40,6 +93,9 @@ int main(int argc, char *argv[]) {
     case (PREPARE_UNRECOGNIZED_STATEMENT):
       printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
       continue;
+    case (PREPARE_STATEMENT_TOO_LONG):
+      printf("Statement is too long.\n");
+      continue;
     }
 
     // Remove Later
@@ -61,6 +117,12 @@ int main(int argc, char *argv[]) {
     case (EXECUTE_DUPLICATE_KEY):
       printf("Error: Duplicate key.\n");
       break;
+    case (EXECUTE_INDEX_EXISTS):
+      printf("Error: Index already exists.\n");
+      break;
+    case (EXECUTE_UNSUPPORTED_DELETE):
+      printf("Error: Only delete where id = N is supported.\n");
+      break;
     }
   }
 }
@@ -0,0 +1,146 @@
+#ifndef __ORDER_H__
+#define __ORDER_H__
+
+#include "filter.h"
+#include "index.h"
+
+/*
+Order by for rows that do not come in that order: by a column other than
+id, or by id through an index. The rows a select keeps go through a heap
+of the first k in the order asked for, k being the offset plus the limit,
+with the one that comes last on top. A row coming after it is dropped,
+most of them before they are deserialized, and only the k left are
+sorted at the end.
+*/
+
+typedef struct {
+  IndexColumn column; // NUM_INDEXES orders by id
+  bool descending;
+  uint32_t capacity; // k, UINT32_MAX keeps every row
+  Row *rows;         // A heap, the row that comes last first
+  uint32_t num_rows;
+  uint32_t allocated;
+} TopK;
+
+TopK *top_k_new(const char *column_name, bool descending, uint32_t capacity) {
+  TopK *top = malloc(sizeof(TopK));
+  top->column = index_column(column_name);
+  top->descending = descending;
+  top->capacity = capacity;
+  top->rows = NULL;
+  top->num_rows = 0;
+  top->allocated = 0;
+  return top;
+}
+
+/*
+Order of the row with the given id and column value against row. Rows
+with equal values stay in id order.
+*/
+int top_k_compare(TopK *top, uint32_t id, const char *value, uint32_t length,
+                  Row *row) {
+  int order = (id > row->id) - (id < row->id);
+  if (top->column != NUM_INDEXES) {
+    int value_order =
+        string_compare(value, length, index_column_value(row, top->column));
+    if (value_order != 0) {
+      return top->descending ? -value_order : value_order;
+    }
+    return order;
+  }
+  return top->descending ? -order : order;
+}
+
+int top_k_compare_rows(TopK *top, Row *row, Row *other) {
+  const char *value = NULL;
+  uint32_t length = 0;
+  if (top->column != NUM_INDEXES) {
+    value = index_column_value(row, top->column);
+    length = strlen(value);
+  }
+  return top_k_compare(top, row->id, value, length, other);
+}
+
+void top_k_swap(TopK *top, uint32_t i, uint32_t j) {
+  Row swap = top->rows[i];
+  top->rows[i] = top->rows[j];
+  top->rows[j] = swap;
+}
+
+void top_k_sift_down(TopK *top, uint32_t i, uint32_t num_rows) {
+  for (;;) {
+    uint32_t last = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < num_rows &&
+        top_k_compare_rows(top, &top->rows[left], &top->rows[last]) > 0) {
+      last = left;
+    }
+    if (right < num_rows &&
+        top_k_compare_rows(top, &top->rows[right], &top->rows[last]) > 0) {
+      last = right;
+    }
+    if (last == i) {
+      return;
+    }
+    top_k_swap(top, i, last);
+    i = last;
+  }
+}
+
+/* Would a record from a leaf make it into the heap? */
+bool top_k_accepts(TopK *top, uint8_t *record) {
+  if (top->num_rows < top->capacity) {
+    return true;
+  }
+  uint32_t id;
+  memcpy(&id, record + ID_OFFSET, ID_SIZE);
+  const char *value = NULL;
+  uint32_t length = 0;
+  if (top->column != NUM_INDEXES) {
+    value = record_column(record, top->column, &length);
+  }
+  return top_k_compare(top, id, value, length, &top->rows[0]) < 0;
+}
+
+void top_k_add(TopK *top, Row *row) {
+  if (top->num_rows == top->capacity) {
+    if (top_k_compare_rows(top, row, &top->rows[0]) >= 0) {
+      return;
+    }
+    top->rows[0] = *row;
+    top_k_sift_down(top, 0, top->num_rows);
+    return;
+  }
+
+  if (top->num_rows == top->allocated) {
+    uint64_t allocated = 2 * (uint64_t)top->allocated + 64;
+    top->allocated = allocated < top->capacity ? allocated : top->capacity;
+    top->rows = realloc(top->rows, top->allocated * sizeof(Row));
+  }
+  uint32_t i = top->num_rows++;
+  top->rows[i] = *row;
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (top_k_compare_rows(top, &top->rows[i], &top->rows[parent]) <= 0) {
+      break;
+    }
+    top_k_swap(top, i, parent);
+    i = parent;
+  }
+}
+
+/* Sort the rows kept in place, in the order asked for */
+void top_k_sort(TopK *top) {
+  for (uint32_t n = top->num_rows; n > 1; n--) {
+    top_k_swap(top, 0, n - 1);
+    top_k_sift_down(top, 0, n - 1);
+  }
+}
+
+void top_k_free(TopK *top) {
+  free(top->rows);
+  free(top);
+}
+
+#endif
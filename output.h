@@ -0,0 +1,240 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include "btree.h"
+#include <stdio.h>
+
+/*
+Select results. Rows are formatted by hand into a buffer that goes out in
+large writes, rather than through a printf per row, in one of these modes:
+
+  table   (1, user1, person1@example.com), the default
+  csv     A header line, then 1,user1,person1@example.com. Fields holding
+          a comma, a quote or a line break are quoted, quotes doubled.
+  tsv     A header line, then the fields separated by tabs. Tabs, line
+          breaks and backslashes in a field are escaped as \t, \n, \r, \\.
+  binary  For each row, its size as a uint32 and then the record as stored
+          in the leaves, see serialize_row. No header.
+
+The result of a count(*) is a row of its own: (N) in table mode, a header
+and N in csv and tsv, and a size of 4 followed by N as a uint32 in binary.
+*/
+
+#define RESULT_BUFFER_SIZE (64 * 1024)
+/* Longest row in any mode, with every character of a field escaped */
+#define RESULT_ROW_MAX_SIZE                                                    \
+  (2 * (COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE) + 32)
+
+typedef enum {
+  OUTPUT_TABLE,
+  OUTPUT_CSV,
+  OUTPUT_TSV,
+  OUTPUT_BINARY,
+  NUM_OUTPUT_MODES
+} OutputMode;
+
+const char *OUTPUT_MODE_NAMES[] = {"table", "csv", "tsv", "binary"};
+
+/* Where selects write, set by .mode and .output */
+OutputMode output_mode = OUTPUT_TABLE;
+FILE *output_file = NULL; // NULL for stdout
+
+/* Returns NUM_OUTPUT_MODES if there is no mode of that name */
+OutputMode output_mode_named(const char *name) {
+  for (uint32_t i = 0; i < NUM_OUTPUT_MODES; i++) {
+    if (strcmp(name, OUTPUT_MODE_NAMES[i]) == 0) {
+      return i;
+    }
+  }
+  return NUM_OUTPUT_MODES;
+}
+
+/*
+Send the results of later selects to a file, or back to stdout if
+filename is NULL. Returns false if the file could not be opened.
+*/
+bool output_to(const char *filename) {
+  if (output_file != NULL) {
+    fclose(output_file);
+    output_file = NULL;
+  }
+  if (filename == NULL) {
+    return true;
+  }
+  output_file = fopen(filename, "wb");
+  if (output_file == NULL) {
+    printf("Unable to open file '%s'.\n", filename);
+    return false;
+  }
+  return true;
+}
+
+typedef struct {
+  OutputMode mode;
+  FILE *file;
+  char *buffer;
+  uint32_t length;
+} ResultWriter;
+
+void result_flush(ResultWriter *writer) {
+  if (writer->length > 0 &&
+      fwrite(writer->buffer, 1, writer->length, writer->file) !=
+          writer->length) {
+    printf("Error writing results: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  writer->length = 0;
+}
+
+/* Room for size more bytes at the end of the buffer */
+char *result_reserve(ResultWriter *writer, uint32_t size) {
+  if (writer->length + size > RESULT_BUFFER_SIZE) {
+    result_flush(writer);
+  }
+  return writer->buffer + writer->length;
+}
+
+char *format_uint(char *p, uint32_t value) {
+  char digits[10];
+  uint32_t length = 0;
+  do {
+    digits[length++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (length > 0) {
+    *p++ = digits[--length];
+  }
+  return p;
+}
+
+char *format_string(char *p, const char *value) {
+  size_t length = strlen(value);
+  memcpy(p, value, length);
+  return p + length;
+}
+
+char *format_csv_field(char *p, const char *value) {
+  if (value[strcspn(value, ",\"\r\n")] == '\0') {
+    return format_string(p, value);
+  }
+  *p++ = '"';
+  for (; *value != '\0'; value++) {
+    if (*value == '"') {
+      *p++ = '"';
+    }
+    *p++ = *value;
+  }
+  *p++ = '"';
+  return p;
+}
+
+char *format_tsv_field(char *p, const char *value) {
+  for (; *value != '\0'; value++) {
+    switch (*value) {
+    case '\t':
+      *p++ = '\\';
+      *p++ = 't';
+      break;
+    case '\n':
+      *p++ = '\\';
+      *p++ = 'n';
+      break;
+    case '\r':
+      *p++ = '\\';
+      *p++ = 'r';
+      break;
+    case '\\':
+      *p++ = '\\';
+      *p++ = '\\';
+      break;
+    default:
+      *p++ = *value;
+    }
+  }
+  return p;
+}
+
+/* Start the result of a select, or of a count(*) if count is set */
+void result_writer_begin(ResultWriter *writer, bool count) {
+  writer->mode = output_mode;
+  writer->file = output_file != NULL ? output_file : stdout;
+  writer->buffer = malloc(RESULT_BUFFER_SIZE);
+  writer->length = 0;
+  char *p = writer->buffer;
+  if (writer->mode == OUTPUT_CSV) {
+    p = format_string(p, count ? "count\n" : "id,username,email\n");
+  } else if (writer->mode == OUTPUT_TSV) {
+    p = format_string(p, count ? "count\n" : "id\tusername\temail\n");
+  }
+  writer->length = p - writer->buffer;
+}
+
+void result_write_row(ResultWriter *writer, Row *row) {
+  char *start = result_reserve(writer, RESULT_ROW_MAX_SIZE);
+  char *p = start;
+  uint32_t size;
+  switch (writer->mode) {
+  case OUTPUT_CSV:
+    p = format_uint(p, row->id);
+    *p++ = ',';
+    p = format_csv_field(p, row->username);
+    *p++ = ',';
+    p = format_csv_field(p, row->email);
+    break;
+  case OUTPUT_TSV:
+    p = format_uint(p, row->id);
+    *p++ = '\t';
+    p = format_tsv_field(p, row->username);
+    *p++ = '\t';
+    p = format_tsv_field(p, row->email);
+    break;
+  case OUTPUT_BINARY:
+    size = row_record_size(row);
+    memcpy(p, &size, sizeof(uint32_t));
+    serialize_row(row, p + sizeof(uint32_t));
+    writer->length += sizeof(uint32_t) + size;
+    return;
+  case OUTPUT_TABLE:
+  default:
+    *p++ = '(';
+    p = format_uint(p, row->id);
+    p = format_string(p, ", ");
+    p = format_string(p, row->username);
+    p = format_string(p, ", ");
+    p = format_string(p, row->email);
+    *p++ = ')';
+  }
+  *p++ = '\n';
+  writer->length += p - start;
+}
+
+void result_write_count(ResultWriter *writer, uint32_t count) {
+  char *start = result_reserve(writer, 2 * sizeof(uint32_t) + 16);
+  char *p = start;
+  uint32_t size = sizeof(uint32_t);
+  switch (writer->mode) {
+  case OUTPUT_BINARY:
+    memcpy(p, &size, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &count, sizeof(uint32_t));
+    writer->length += 2 * sizeof(uint32_t);
+    return;
+  case OUTPUT_TABLE:
+    *p++ = '(';
+    p = format_uint(p, count);
+    *p++ = ')';
+    break;
+  default:
+    p = format_uint(p, count);
+  }
+  *p++ = '\n';
+  writer->length += p - start;
+}
+
+/* Write out what is left of the result */
+void result_writer_end(ResultWriter *writer) {
+  result_flush(writer);
+  fflush(writer->file);
+  free(writer->buffer);
+}
+
+#endif
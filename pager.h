@@ -0,0 +1,1552 @@
+#ifndef __PAGER_H__
+#define __PAGER_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+#include "wal.h"
+
+/* Page sizes a database can be created with, powers of two in between */
+#define PAGE_SIZE_MIN 4096
+#define PAGE_SIZE_MAX 65536
+#define PAGE_SIZE_DEFAULT 4096
+
+/* Buffer pool budget used when the caller does not pick one */
+#define PAGER_DEFAULT_CACHE_SIZE (4 * 1024 * 1024)
+/* A split touches a handful of pages at once, so never go below this */
+#define PAGER_MIN_CACHE_PAGES 16
+#define PAGER_NO_FRAME UINT32_MAX
+/* Address space reserved for the mapping so it never has to move */
+#define PAGER_MMAP_RESERVE (1ULL << 40)
+#define PAGER_MMAP_MIN_GROWTH (1024 * 1024)
+/* Longest run of consecutive pages written by one pwritev or writev */
+#define PAGER_MAX_RUN_PAGES 256
+/* Tag bit of write completions, the rest of the tag is the length written */
+#define PAGER_IO_WRITE (1ULL << 63)
+/* Page latches of library mode, shared by the page numbers equal mod this */
+#define PAGER_LATCH_STRIPES 1024
+/* Statements between two automatic checkpoints */
+#define PAGER_DEFAULT_CHECKPOINT_INTERVAL 1000
+
+/*
+ * Database Header Layout (page 0)
+ */
+#define DB_HEADER_PAGE_NUM 0
+const char DB_HEADER_MAGIC[] = "sqlittle v5";
+const uint32_t DB_HEADER_MAGIC_SIZE = 16;
+const uint32_t DB_HEADER_MAGIC_OFFSET = 0;
+const uint32_t DB_HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_PAGE_SIZE_OFFSET =
+    DB_HEADER_MAGIC_OFFSET + DB_HEADER_MAGIC_SIZE;
+const uint32_t DB_HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_ROOT_PAGE_OFFSET =
+    DB_HEADER_PAGE_SIZE_OFFSET + DB_HEADER_PAGE_SIZE_SIZE;
+const uint32_t DB_HEADER_FREELIST_TRUNK_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_FREELIST_TRUNK_OFFSET =
+    DB_HEADER_ROOT_PAGE_OFFSET + DB_HEADER_ROOT_PAGE_SIZE;
+const uint32_t DB_HEADER_FREELIST_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_FREELIST_COUNT_OFFSET =
+    DB_HEADER_FREELIST_TRUNK_OFFSET + DB_HEADER_FREELIST_TRUNK_SIZE;
+/* Root pages of the secondary indexes, 0 where there is none */
+#define DB_HEADER_MAX_INDEXES 8
+const uint32_t DB_HEADER_INDEX_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_INDEX_ROOTS_OFFSET =
+    DB_HEADER_FREELIST_COUNT_OFFSET + DB_HEADER_FREELIST_COUNT_SIZE;
+/*
+Pages in use as of the last commit. The file may be longer, the mmap
+backend grows it ahead, and pager_open cuts it back. 0 in files written
+before it was kept, whose length is taken instead.
+*/
+const uint32_t DB_HEADER_NUM_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_NUM_PAGES_OFFSET =
+    DB_HEADER_INDEX_ROOTS_OFFSET +
+    DB_HEADER_MAX_INDEXES * DB_HEADER_INDEX_ROOT_SIZE;
+/* Root of an index create index is still filling, 0 when there is none */
+const uint32_t DB_HEADER_INDEX_BUILD_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_INDEX_BUILD_ROOT_OFFSET =
+    DB_HEADER_NUM_PAGES_OFFSET + DB_HEADER_NUM_PAGES_SIZE;
+
+/*
+ * Freelist Trunk Page Layout
+ * A trunk page lists free pages and links to the next trunk page.
+ */
+const uint32_t FREELIST_NEXT_TRUNK_SIZE = sizeof(uint32_t);
+const uint32_t FREELIST_NEXT_TRUNK_OFFSET = 0;
+const uint32_t FREELIST_NUM_LEAVES_SIZE = sizeof(uint32_t);
+const uint32_t FREELIST_NUM_LEAVES_OFFSET =
+    FREELIST_NEXT_TRUNK_OFFSET + FREELIST_NEXT_TRUNK_SIZE;
+const uint32_t FREELIST_HEADER_SIZE =
+    FREELIST_NEXT_TRUNK_SIZE + FREELIST_NUM_LEAVES_SIZE;
+#define FREELIST_MAX_LEAVES(page_size)                                         \
+  (((page_size) - FREELIST_HEADER_SIZE) / sizeof(uint32_t))
+
+/* Bits of Pager.dirty_map */
+#define PAGER_DIRTY 1           // Modified since the last checkpoint
+#define PAGER_DIRTY_STATEMENT 2 // Modified by the running statement
+
+typedef enum {
+  PAGER_BACKEND_CACHE, // pread, or io_uring reads, into the buffer pool
+  PAGER_BACKEND_MMAP   // Page pointers straight from a mapping of the file
+} PagerBackend;
+
+typedef struct {
+  PagerBackend backend;
+  size_t cache_size; // Memory budget of the buffer pool, in bytes
+  uint32_t checkpoint_interval; // 0 disables automatic checkpoints
+  uint32_t page_size; // Only used when creating the file
+  bool use_wal;
+  WalSyncMode sync_mode;
+  bool use_io_uring; // Falls back to pread/pwrite when the kernel refuses
+  bool concurrent;   // Library mode: threads share the table, see db_execute
+  uint32_t scan_threads; // Threads a full scan may use, see parallel_scan
+} PagerOptions;
+
+typedef struct {
+  uint32_t page_num;
+  void *data;
+  uint32_t pin_count;
+  uint32_t pin_slot;       // Position in Pager.pinned while statement_pinned
+  bool statement_pinned;   // Pinned until the running statement ends
+  bool referenced;         // CLOCK reference bit
+  bool in_use;
+  bool loading;            // Read in flight, pinned until it completes
+} Frame;
+
+/* Image of a page kept for snapshots, see Pager.versions */
+typedef struct PageVersion {
+  uint64_t end_seq; // First commit whose snapshots no longer read it
+  struct PageVersion *older;
+  uint8_t data[];
+} PageVersion;
+
+typedef struct {
+  int file_descriptor;
+  off_t file_length;
+  uint32_t num_pages;
+  /*
+  Size of the pages of this database. It is chosen when the file is
+  created and read back from the header by pager_open, the layout of
+  every node is derived from it.
+  */
+  uint32_t page_size;
+  PagerBackend backend;
+
+  /*
+  mmap backend. The mapping is private: changes stay in copy-on-write
+  pages until pager_flush writes them, just like the buffer pool.
+  */
+  void *map;
+  off_t map_length;
+
+  /*
+  Buffer pool. Frames past `capacity` only exist while a single statement
+  has more pages pinned than the budget allows and are released when it ends.
+  */
+  Frame *frames;
+  uint32_t num_frames;
+  uint32_t capacity;
+  uint32_t clock_hand;
+
+  /* page_num -> frame index, PAGER_NO_FRAME when the page is not cached */
+  uint32_t *page_table;
+  uint32_t page_table_size;
+
+  /* Frames pinned by the running statement */
+  uint32_t *pinned;
+  uint32_t num_pinned;
+  uint32_t pinned_capacity;
+
+  /*
+  Pages modified since the last checkpoint. dirty_map is indexed by page
+  number, dirty_pages lists them in the order they got dirty and may hold
+  stale entries for pages already written back by eviction.
+  */
+  uint8_t *dirty_map;
+  uint32_t dirty_map_size;
+  uint32_t *dirty_pages;
+  uint32_t num_dirty;
+  uint32_t dirty_capacity;
+
+  /* Pages modified by the running statement, logged when it commits */
+  uint32_t *statement_pages;
+  uint32_t num_statement_pages;
+  uint32_t statement_pages_capacity;
+  Wal *wal; // NULL when running without a log
+  /*
+  Set while building pages nothing points to yet (bulk loading). Such
+  pages skip the log and are made durable by a checkpoint instead.
+  */
+  bool unlogged;
+
+  uint32_t checkpoint_interval;
+  uint32_t statements_since_checkpoint;
+
+  uint32_t scan_threads;
+
+  /*
+  Asynchronous I/O, ring.ring_fd is -1 without it. Reads are tagged with
+  their frame number, writes with PAGER_IO_WRITE and their length.
+  */
+  Uring ring;
+  uint32_t num_loading;
+  uint32_t writes_in_flight;
+
+  /*
+  Library mode. mutex serializes everything above, it is recursive as
+  pager functions call each other. Page latches guard page contents and
+  are striped: latches[page_num % PAGER_LATCH_STRIPES].
+  */
+  bool concurrent;
+  pthread_mutex_t mutex;
+  pthread_rwlock_t *latches;
+
+  /*
+  Snapshots, library mode as well. commit_seq counts commits and a
+  snapshot reads the pages as of the commit_seq it began at. Before a
+  statement first changes or drops a page, the image it had is kept in
+  versions[page_num], newest first, ending at the commit of the
+  statement. A snapshot reads the oldest image that ends after it, or the
+  page itself if there is none. Images no snapshot can read any more are
+  freed as commits go by and snapshots end.
+  */
+  uint64_t commit_seq;
+  uint32_t committed_pages;
+  PageVersion **versions;
+  uint32_t versions_size;
+  uint32_t *versioned_pages;
+  uint32_t num_versioned;
+  uint32_t versioned_capacity;
+  uint64_t *snapshots;
+  uint32_t num_snapshots;
+  uint32_t snapshots_capacity;
+
+  Stats stats; // See stats.h
+} Pager;
+
+PagerOptions default_pager_options() {
+  PagerOptions options;
+  options.backend = PAGER_BACKEND_CACHE;
+  options.cache_size = PAGER_DEFAULT_CACHE_SIZE;
+  options.checkpoint_interval = PAGER_DEFAULT_CHECKPOINT_INTERVAL;
+  options.page_size = PAGE_SIZE_DEFAULT;
+  options.use_wal = true;
+  options.sync_mode = WAL_SYNC_NORMAL;
+  options.use_io_uring = true;
+  options.concurrent = false;
+  options.scan_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  return options;
+}
+
+void pager_mmap_open(Pager *pager) {
+  pager->map = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pager->map == MAP_FAILED) {
+    printf("Error reserving address space: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->map_length = 0;
+}
+
+/*
+Grow the file with ftruncate and map the new tail right behind the
+existing mapping, so page pointers handed out earlier stay valid.
+*/
+void pager_mmap_grow(Pager *pager, off_t length) {
+  off_t new_length = pager->map_length * 2;
+  if (new_length < PAGER_MMAP_MIN_GROWTH) {
+    new_length = PAGER_MMAP_MIN_GROWTH;
+  }
+  if (new_length < length) {
+    new_length = length;
+  }
+  if (new_length > (off_t)PAGER_MMAP_RESERVE) {
+    printf("Db file is too large to map. %ld > %llu\n", (long)new_length,
+           PAGER_MMAP_RESERVE);
+    exit(EXIT_FAILURE);
+  }
+
+  if (new_length > pager->file_length) {
+    if (ftruncate(pager->file_descriptor, new_length) == -1) {
+      printf("Error growing file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = new_length;
+  }
+
+  void *tail = mmap(pager->map + pager->map_length,
+                    new_length - pager->map_length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, pager->file_descriptor,
+                    pager->map_length);
+  if (tail == MAP_FAILED) {
+    printf("Error mapping file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->map_length = new_length;
+}
+
+void *pager_mmap_get_page(Pager *pager, uint32_t page_num) {
+  off_t offset = (off_t)page_num * pager->page_size;
+  if (offset + pager->page_size > pager->map_length) {
+    pager_mmap_grow(pager, offset + pager->page_size);
+  }
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;
+  }
+  return pager->map + offset;
+}
+
+void pager_mmap_flush(Pager *pager, uint32_t page_num) {
+  off_t offset = (off_t)page_num * pager->page_size;
+  ssize_t bytes_written = pwrite(pager->file_descriptor, pager->map + offset,
+                                 pager->page_size, offset);
+  if (bytes_written == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  STATS_ADD(&pager->stats, bytes_written, bytes_written);
+  // The file now has this content, drop the private copy
+  madvise(pager->map + offset, pager->page_size, MADV_DONTNEED);
+}
+
+void pager_mmap_close(Pager *pager) {
+  munmap(pager->map, PAGER_MMAP_RESERVE);
+  // Give back the space grown ahead of use
+  off_t length = (off_t)pager->num_pages * pager->page_size;
+  if (ftruncate(pager->file_descriptor, length) == -1) {
+    printf("Error truncating file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Read a page from the file, zeroes past its end */
+void pager_pread(Pager *pager, uint32_t page_num, void *page) {
+  off_t offset = (off_t)page_num * pager->page_size;
+  ssize_t bytes_read =
+      pread(pager->file_descriptor, page, pager->page_size, offset);
+  if (bytes_read == -1) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  STATS_ADD(&pager->stats, bytes_read, bytes_read);
+  if (bytes_read < pager->page_size) {
+    memset(page + bytes_read, 0, pager->page_size - bytes_read);
+  }
+}
+
+void pager_read_page(Pager *pager, uint32_t page_num, void *page) {
+  if ((off_t)page_num * pager->page_size >= pager->file_length) {
+    // Page has never been written, start from zeroes
+    memset(page, 0, pager->page_size);
+    return;
+  }
+  pager_pread(pager, page_num, page);
+}
+
+void pager_write_page(Pager *pager, uint32_t page_num, void *page) {
+  off_t offset = (off_t)page_num * pager->page_size;
+  ssize_t bytes_written =
+      pwrite(pager->file_descriptor, page, pager->page_size, offset);
+
+  if (bytes_written == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  STATS_ADD(&pager->stats, bytes_written, bytes_written);
+
+  if (offset + pager->page_size > pager->file_length) {
+    pager->file_length = offset + pager->page_size;
+  }
+}
+
+/* The pager's bookkeeping is only locked in library mode */
+void pager_lock(Pager *pager) {
+  if (pager->concurrent) {
+    pthread_mutex_lock(&pager->mutex);
+  }
+}
+
+void pager_unlock(Pager *pager) {
+  if (pager->concurrent) {
+    pthread_mutex_unlock(&pager->mutex);
+  }
+}
+
+void pager_latch_shared(Pager *pager, uint32_t page_num) {
+  pthread_rwlock_rdlock(&pager->latches[page_num % PAGER_LATCH_STRIPES]);
+}
+
+/*
+With only_try set a busy latch is not waited for, false is returned. A
+writer holding one latch tries for the others: the stripe it needs may be
+the one it holds, or be held by a reader waiting on it.
+*/
+bool pager_latch_exclusive(Pager *pager, uint32_t page_num, bool only_try) {
+  pthread_rwlock_t *latch = &pager->latches[page_num % PAGER_LATCH_STRIPES];
+  if (only_try) {
+    return pthread_rwlock_trywrlock(latch) == 0;
+  }
+  pthread_rwlock_wrlock(latch);
+  return true;
+}
+
+void pager_unlatch(Pager *pager, uint32_t page_num) {
+  pthread_rwlock_unlock(&pager->latches[page_num % PAGER_LATCH_STRIPES]);
+}
+
+uint32_t pager_lookup(Pager *pager, uint32_t page_num) {
+  if (page_num >= pager->page_table_size) {
+    return PAGER_NO_FRAME;
+  }
+  return pager->page_table[page_num];
+}
+
+void pager_map_page(Pager *pager, uint32_t page_num, uint32_t frame_num) {
+  if (page_num >= pager->page_table_size) {
+    uint32_t new_size = pager->page_table_size * 2;
+    if (new_size <= page_num) {
+      new_size = page_num + 1;
+    }
+    pager->page_table =
+        realloc(pager->page_table, new_size * sizeof(uint32_t));
+    for (uint32_t i = pager->page_table_size; i < new_size; i++) {
+      pager->page_table[i] = PAGER_NO_FRAME;
+    }
+    pager->page_table_size = new_size;
+  }
+  pager->page_table[page_num] = frame_num;
+}
+
+bool pager_is_dirty(Pager *pager, uint32_t page_num) {
+  return page_num < pager->dirty_map_size &&
+         (pager->dirty_map[page_num] & PAGER_DIRTY);
+}
+
+void pager_clear_dirty(Pager *pager, uint32_t page_num) {
+  if (page_num < pager->dirty_map_size) {
+    pager->dirty_map[page_num] &= ~PAGER_DIRTY;
+  }
+}
+
+void pager_append_page_num(uint32_t **list, uint32_t *length,
+                           uint32_t *capacity, uint32_t page_num) {
+  if (*length == *capacity) {
+    *capacity *= 2;
+    *list = realloc(*list, *capacity * sizeof(uint32_t));
+  }
+  (*list)[(*length)++] = page_num;
+}
+
+void pager_pin(Pager *pager, uint32_t page_num) {
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    return;
+  }
+  pager_lock(pager);
+  uint32_t frame_num = pager_lookup(pager, page_num);
+  if (frame_num == PAGER_NO_FRAME) {
+    printf("Tried to pin uncached page %d\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  pager->frames[frame_num].pin_count++;
+  pager_unlock(pager);
+}
+
+void pager_unpin(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  uint32_t frame_num = pager_lookup(pager, page_num);
+  if (frame_num != PAGER_NO_FRAME) {
+    Frame *frame = &pager->frames[frame_num];
+    if (frame->statement_pinned) {
+      // Drop the statement pin: swap the last pinned frame into its slot
+      uint32_t last = pager->pinned[--pager->num_pinned];
+      pager->pinned[frame->pin_slot] = last;
+      pager->frames[last].pin_slot = frame->pin_slot;
+      frame->statement_pinned = false;
+    }
+    if (frame->pin_count > 0) {
+      frame->pin_count--;
+    }
+  }
+  pager_unlock(pager);
+}
+
+void pager_pin_for_statement(Pager *pager, uint32_t frame_num) {
+  Frame *frame = &pager->frames[frame_num];
+  if (frame->statement_pinned) {
+    return;
+  }
+  if (pager->num_pinned == pager->pinned_capacity) {
+    pager->pinned_capacity *= 2;
+    pager->pinned =
+        realloc(pager->pinned, pager->pinned_capacity * sizeof(uint32_t));
+  }
+  frame->pin_slot = pager->num_pinned;
+  frame->statement_pinned = true;
+  frame->pin_count++;
+  pager->pinned[pager->num_pinned++] = frame_num;
+}
+
+void pager_evict(Pager *pager, uint32_t frame_num) {
+  Frame *frame = &pager->frames[frame_num];
+  if (pager_is_dirty(pager, frame->page_num)) {
+    // Write-ahead: the log must be on disk before the page is
+    if (pager->wal) {
+      wal_sync(pager->wal);
+    }
+    pager_write_page(pager, frame->page_num, frame->data);
+    pager_clear_dirty(pager, frame->page_num);
+  }
+  pager->page_table[frame->page_num] = PAGER_NO_FRAME;
+  frame->in_use = false;
+}
+
+uint32_t pager_add_frame(Pager *pager) {
+  uint32_t frame_num = pager->num_frames++;
+  pager->frames = realloc(pager->frames, pager->num_frames * sizeof(Frame));
+  Frame *frame = &pager->frames[frame_num];
+  frame->data = malloc(pager->page_size);
+  frame->pin_count = 0;
+  frame->statement_pinned = false;
+  frame->referenced = false;
+  frame->in_use = false;
+  frame->loading = false;
+  return frame_num;
+}
+
+/*
+Pick a frame for a new page with the CLOCK algorithm. Pinned frames are
+skipped, recently referenced frames get a second chance.
+Returns PAGER_NO_FRAME when every frame is pinned.
+*/
+uint32_t pager_clock_victim(Pager *pager) {
+  for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+    uint32_t frame_num = pager->clock_hand;
+    Frame *frame = &pager->frames[frame_num];
+    pager->clock_hand = (frame_num + 1) % pager->num_frames;
+
+    if (!frame->in_use) {
+      return frame_num;
+    }
+    if (frame->pin_count > 0) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+    pager_evict(pager, frame_num);
+    return frame_num;
+  }
+  return PAGER_NO_FRAME;
+}
+
+uint32_t pager_find_victim(Pager *pager) {
+  if (pager->num_frames < pager->capacity) {
+    return pager_add_frame(pager);
+  }
+  uint32_t frame_num = pager_clock_victim(pager);
+  if (frame_num == PAGER_NO_FRAME) {
+    // Every frame is pinned by the running statement, go over budget for now
+    frame_num = pager_add_frame(pager);
+  }
+  return frame_num;
+}
+
+/*
+Handle one io_uring completion. A finished read makes its frame usable
+and drops the pin that kept it in place while the kernel filled it.
+*/
+void pager_complete(Pager *pager, struct io_uring_cqe *cqe) {
+  if (cqe->user_data & PAGER_IO_WRITE) {
+    if (cqe->res != (int32_t)(cqe->user_data & ~PAGER_IO_WRITE)) {
+      printf("Error writing: %d\n", cqe->res < 0 ? -cqe->res : EIO);
+      exit(EXIT_FAILURE);
+    }
+    pager->writes_in_flight--;
+    return;
+  }
+
+  Frame *frame = &pager->frames[cqe->user_data];
+  if (cqe->res < 0) {
+    printf("Error reading file: %d\n", -cqe->res);
+    exit(EXIT_FAILURE);
+  }
+  if ((uint32_t)cqe->res < pager->page_size) {
+    memset(frame->data + cqe->res, 0, pager->page_size - cqe->res);
+  }
+  frame->loading = false;
+  frame->pin_count--;
+  pager->num_loading--;
+}
+
+/* Handle the completions that are in, waiting for one first if asked to */
+void pager_reap(Pager *pager, bool wait) {
+  if (wait) {
+    uring_submit(&pager->ring, 1);
+  }
+  struct io_uring_cqe cqe;
+  while (uring_reap(&pager->ring, &cqe)) {
+    pager_complete(pager, &cqe);
+  }
+}
+
+/* Wait for everything in flight, before the frames or the file go away */
+void pager_drain(Pager *pager) {
+  while (pager->ring.in_flight > 0 || pager->ring.to_submit > 0) {
+    pager_reap(pager, true);
+  }
+}
+
+void pager_wait_loaded(Pager *pager, uint32_t frame_num) {
+  while (pager->frames[frame_num].loading) {
+    pager_reap(pager, true);
+  }
+}
+
+/* Current content of a page, without bringing it into the buffer pool */
+void pager_copy_page(Pager *pager, uint32_t page_num, void *destination) {
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    memcpy(destination, pager_mmap_get_page(pager, page_num), pager->page_size);
+    return;
+  }
+  uint32_t frame_num = pager_lookup(pager, page_num);
+  if (frame_num == PAGER_NO_FRAME) {
+    // Dirty pages are written back when evicted, the file has it
+    pager_read_page(pager, page_num, destination);
+    return;
+  }
+  pager_wait_loaded(pager, frame_num);
+  memcpy(destination, pager->frames[frame_num].data, pager->page_size);
+}
+
+/*
+Keep the committed image of a page the running statement is about to
+change, once per statement.
+*/
+void pager_keep_version(Pager *pager, uint32_t page_num) {
+  if (!pager->concurrent || pager->unlogged) {
+    return;
+  }
+  if (page_num >= pager->committed_pages) {
+    // Allocated by this statement, no snapshot can reach it
+    return;
+  }
+  if (page_num >= pager->versions_size) {
+    uint32_t new_size = pager->versions_size * 2;
+    if (new_size <= page_num) {
+      new_size = page_num + 1;
+    }
+    pager->versions =
+        realloc(pager->versions, new_size * sizeof(PageVersion *));
+    for (uint32_t i = pager->versions_size; i < new_size; i++) {
+      pager->versions[i] = NULL;
+    }
+    pager->versions_size = new_size;
+  }
+  PageVersion *newest = pager->versions[page_num];
+  if (newest != NULL && newest->end_seq == pager->commit_seq + 1) {
+    return;
+  }
+
+  PageVersion *version = malloc(sizeof(PageVersion) + pager->page_size);
+  version->end_seq = pager->commit_seq + 1;
+  version->older = newest;
+  pager_copy_page(pager, page_num, version->data);
+  if (newest == NULL) {
+    pager_append_page_num(&pager->versioned_pages, &pager->num_versioned,
+                          &pager->versioned_capacity, page_num);
+  }
+  pager->versions[page_num] = version;
+}
+
+/*
+Free the images every running snapshot reads past. Those of the running
+statement are kept for the snapshots that begin before it commits.
+*/
+void pager_collect_versions(Pager *pager) {
+  uint64_t oldest = pager->commit_seq;
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] < oldest) {
+      oldest = pager->snapshots[i];
+    }
+  }
+
+  uint32_t num_kept = 0;
+  for (uint32_t i = 0; i < pager->num_versioned; i++) {
+    uint32_t page_num = pager->versioned_pages[i];
+    PageVersion **link = &pager->versions[page_num];
+    while (*link != NULL && (*link)->end_seq > oldest) {
+      link = &(*link)->older;
+    }
+    PageVersion *version = *link;
+    *link = NULL;
+    while (version != NULL) {
+      PageVersion *older = version->older;
+      free(version);
+      version = older;
+    }
+    if (pager->versions[page_num] != NULL) {
+      pager->versioned_pages[num_kept++] = page_num;
+    }
+  }
+  pager->num_versioned = num_kept;
+}
+
+/* Start a snapshot of everything committed so far */
+uint64_t pager_snapshot_begin(Pager *pager) {
+  pager_lock(pager);
+  uint64_t snapshot = pager->commit_seq;
+  if (pager->num_snapshots == pager->snapshots_capacity) {
+    pager->snapshots_capacity = pager->snapshots_capacity * 2 + 4;
+    pager->snapshots = realloc(pager->snapshots,
+                               pager->snapshots_capacity * sizeof(uint64_t));
+  }
+  pager->snapshots[pager->num_snapshots++] = snapshot;
+  pager_unlock(pager);
+  return snapshot;
+}
+
+void pager_snapshot_end(Pager *pager, uint64_t snapshot) {
+  pager_lock(pager);
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] == snapshot) {
+      pager->snapshots[i] = pager->snapshots[--pager->num_snapshots];
+      break;
+    }
+  }
+  pager_collect_versions(pager);
+  pager_unlock(pager);
+}
+
+/* The image a snapshot reads instead of the page, NULL if none */
+PageVersion *pager_find_version(Pager *pager, uint32_t page_num,
+                                uint64_t snapshot) {
+  PageVersion *found = NULL;
+  PageVersion *version =
+      page_num < pager->versions_size ? pager->versions[page_num] : NULL;
+  for (; version != NULL && version->end_seq > snapshot;
+       version = version->older) {
+    found = version;
+  }
+  return found;
+}
+
+/* Copy out a page as the snapshot sees it */
+void pager_read_snapshot(Pager *pager, uint32_t page_num, uint64_t snapshot,
+                         void *destination) {
+  pager_lock(pager);
+  PageVersion *version = pager_find_version(pager, page_num, snapshot);
+  if (version != NULL || pager->backend == PAGER_BACKEND_MMAP ||
+      pager_lookup(pager, page_num) != PAGER_NO_FRAME) {
+    STATS_ADD(&pager->stats, page_hits, 1);
+    if (version != NULL) {
+      memcpy(destination, version->data, pager->page_size);
+    } else {
+      pager_copy_page(pager, page_num, destination);
+    }
+    pager_unlock(pager);
+    return;
+  }
+  pager_unlock(pager);
+
+  /*
+  Read the file outside the mutex, so that scans on several threads wait
+  for their reads together. A writer changing the page in the meantime
+  keeps its image first, which is what the snapshot reads then.
+  */
+  STATS_ADD(&pager->stats, page_misses, 1);
+  pager_pread(pager, page_num, destination);
+  pager_lock(pager);
+  version = pager_find_version(pager, page_num, snapshot);
+  if (version != NULL) {
+    memcpy(destination, version->data, pager->page_size);
+  }
+  pager_unlock(pager);
+}
+
+/* Called by everything that modifies a page returned by get_page */
+void pager_mark_dirty(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  if (page_num >= pager->dirty_map_size) {
+    uint32_t new_size = pager->dirty_map_size * 2;
+    if (new_size <= page_num) {
+      new_size = page_num + 1;
+    }
+    pager->dirty_map = realloc(pager->dirty_map, new_size);
+    memset(pager->dirty_map + pager->dirty_map_size, 0,
+           new_size - pager->dirty_map_size);
+    pager->dirty_map_size = new_size;
+  }
+  uint8_t state = pager->dirty_map[page_num];
+  if (!(state & PAGER_DIRTY_STATEMENT)) {
+    pager_keep_version(pager, page_num);
+  }
+  if (!(state & PAGER_DIRTY)) {
+    pager_append_page_num(&pager->dirty_pages, &pager->num_dirty,
+                          &pager->dirty_capacity, page_num);
+  }
+  if (pager->unlogged) {
+    pager->dirty_map[page_num] = state | PAGER_DIRTY;
+  } else {
+    if (!(state & PAGER_DIRTY_STATEMENT)) {
+      pager_append_page_num(&pager->statement_pages,
+                            &pager->num_statement_pages,
+                            &pager->statement_pages_capacity, page_num);
+    }
+    pager->dirty_map[page_num] = PAGER_DIRTY | PAGER_DIRTY_STATEMENT;
+  }
+  pager_unlock(pager);
+}
+
+/* Frame holding the page, read in if needed. Cache backend only */
+uint32_t pager_load(Pager *pager, uint32_t page_num) {
+  uint32_t frame_num = pager_lookup(pager, page_num);
+
+  if (frame_num == PAGER_NO_FRAME) {
+    // Cache miss. Find a frame and load from file.
+    STATS_ADD(&pager->stats, page_misses, 1);
+    frame_num = pager_find_victim(pager);
+    TRACE(TRACE_LEVEL_PAGE, TRACE_PAGE_MISS, page_num, frame_num, 0);
+    Frame *frame = &pager->frames[frame_num];
+    pager_read_page(pager, page_num, frame->data);
+    frame->page_num = page_num;
+    frame->in_use = true;
+    pager_map_page(pager, page_num, frame_num);
+
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  } else {
+    STATS_ADD(&pager->stats, page_hits, 1);
+    if (pager->frames[frame_num].loading) {
+      // Prefetched, and the read is not done yet
+      pager_wait_loaded(pager, frame_num);
+    }
+  }
+
+  pager->frames[frame_num].referenced = true;
+  return frame_num;
+}
+
+void *get_page(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  void *page;
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    page = pager_mmap_get_page(pager, page_num);
+  } else {
+    uint32_t frame_num = pager_load(pager, page_num);
+    pager_pin_for_statement(pager, frame_num);
+    page = pager->frames[frame_num].data;
+  }
+  pager_unlock(pager);
+  return page;
+}
+
+/*
+Pin a page for a reader thread in library mode. Unlike get_page the pin
+is not the statement's, pager_release drops it.
+*/
+void *pager_acquire(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  void *page;
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    page = pager_mmap_get_page(pager, page_num);
+  } else {
+    uint32_t frame_num = pager_load(pager, page_num);
+    pager->frames[frame_num].pin_count++;
+    page = pager->frames[frame_num].data;
+  }
+  pager_unlock(pager);
+  return page;
+}
+
+void pager_release(Pager *pager, uint32_t page_num) {
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    return;
+  }
+  pager_lock(pager);
+  pager->frames[pager_lookup(pager, page_num)].pin_count--;
+  pager_unlock(pager);
+}
+
+/*
+Start reading pages into the buffer pool and return without waiting. Each
+frame stays pinned and loading until its completion is reaped, get_page
+only blocks if it gets to the page first. Prefetching stops once half the
+pool is loading so a scan does not crowd out the pages it is working on.
+*/
+void pager_prefetch_async(Pager *pager, uint32_t *page_nums,
+                          uint32_t num_pages) {
+  pager_reap(pager, false);
+  for (uint32_t i = 0; i < num_pages; i++) {
+    uint32_t page_num = page_nums[i];
+    off_t offset = (off_t)page_num * pager->page_size;
+    if (offset >= pager->file_length ||
+        pager_lookup(pager, page_num) != PAGER_NO_FRAME) {
+      continue;
+    }
+    if (!uring_has_room(&pager->ring) ||
+        pager->num_loading >= pager->capacity / 2) {
+      break;
+    }
+    uint32_t frame_num = pager->num_frames < pager->capacity
+                             ? pager_add_frame(pager)
+                             : pager_clock_victim(pager);
+    if (frame_num == PAGER_NO_FRAME) {
+      break;
+    }
+
+    Frame *frame = &pager->frames[frame_num];
+    frame->page_num = page_num;
+    frame->in_use = true;
+    frame->loading = true;
+    frame->referenced = true;
+    frame->pin_count = 1;
+    pager_map_page(pager, page_num, frame_num);
+    pager->num_loading++;
+    uring_queue(&pager->ring, IORING_OP_READ, pager->file_descriptor,
+                frame->data, pager->page_size, offset, frame_num);
+    STATS_ADD(&pager->stats, bytes_read, pager->page_size);
+  }
+  uring_submit(&pager->ring, 0);
+}
+
+/*
+Tell the OS that pages will be read soon so their reads overlap with the
+work on the pages before them. Runs of consecutive pages go out as one
+request, pages already in the buffer pool are left out. With io_uring the
+buffer pool reads them itself.
+*/
+void pager_prefetch(Pager *pager, uint32_t *page_nums, uint32_t num_pages) {
+  bool cache = pager->backend == PAGER_BACKEND_CACHE;
+  pager_lock(pager);
+  if (cache && pager->ring.ring_fd >= 0) {
+    pager_prefetch_async(pager, page_nums, num_pages);
+    pager_unlock(pager);
+    return;
+  }
+  uint32_t i = 0;
+  while (i < num_pages) {
+    uint32_t first = page_nums[i];
+    if (cache && pager_lookup(pager, first) != PAGER_NO_FRAME) {
+      i++;
+      continue;
+    }
+    uint32_t count = 1;
+    while (i + count < num_pages && page_nums[i + count] == first + count &&
+           !(cache && pager_lookup(pager, first + count) != PAGER_NO_FRAME)) {
+      count++;
+    }
+    i += count;
+
+    off_t offset = (off_t)first * pager->page_size;
+    off_t length = (off_t)count * pager->page_size;
+    if (offset >= pager->file_length) {
+      continue;
+    }
+    if (offset + length > pager->file_length) {
+      length = pager->file_length - offset;
+    }
+    if (cache) {
+      posix_fadvise(pager->file_descriptor, offset, length,
+                    POSIX_FADV_WILLNEED);
+    } else if (offset + length <= pager->map_length) {
+      madvise(pager->map + offset, length, MADV_WILLNEED);
+    }
+  }
+  pager_unlock(pager);
+}
+
+/*
+Unpin a page a scan is done with. It loses its CLOCK reference bit, so a
+long scan recycles its own frames instead of pushing out the pages other
+statements keep coming back to.
+*/
+void pager_unpin_cold(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  pager_unpin(pager, page_num);
+  uint32_t frame_num = pager_lookup(pager, page_num);
+  if (frame_num != PAGER_NO_FRAME &&
+      pager->frames[frame_num].pin_count == 0) {
+    pager->frames[frame_num].referenced = false;
+  }
+  pager_unlock(pager);
+}
+
+/*
+Forget a cached page without writing it back. The caller must not use
+pointers to it afterwards.
+*/
+void pager_drop_page(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  pager_keep_version(pager, page_num);
+  if (page_num < pager->dirty_map_size) {
+    pager->dirty_map[page_num] = 0;
+  }
+  uint32_t frame_num = pager->backend == PAGER_BACKEND_CACHE
+                           ? pager_lookup(pager, page_num)
+                           : PAGER_NO_FRAME;
+  if (frame_num != PAGER_NO_FRAME) {
+    pager_wait_loaded(pager, frame_num);
+    pager_unpin(pager, page_num);
+    Frame *frame = &pager->frames[frame_num];
+    frame->pin_count = 0;
+    frame->in_use = false;
+    pager->page_table[page_num] = PAGER_NO_FRAME;
+  }
+  pager_unlock(pager);
+}
+
+char *db_header_magic(void *header) { return header + DB_HEADER_MAGIC_OFFSET; }
+
+uint32_t *db_header_page_size(void *header) {
+  return header + DB_HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t *db_header_root_page(void *header) {
+  return header + DB_HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t *db_header_freelist_trunk(void *header) {
+  return header + DB_HEADER_FREELIST_TRUNK_OFFSET;
+}
+
+uint32_t *db_header_freelist_count(void *header) {
+  return header + DB_HEADER_FREELIST_COUNT_OFFSET;
+}
+
+uint32_t *db_header_index_root(void *header, uint32_t index_num) {
+  return header + DB_HEADER_INDEX_ROOTS_OFFSET +
+         index_num * DB_HEADER_INDEX_ROOT_SIZE;
+}
+
+uint32_t *db_header_num_pages(void *header) {
+  return header + DB_HEADER_NUM_PAGES_OFFSET;
+}
+
+uint32_t *db_header_index_build_root(void *header) {
+  return header + DB_HEADER_INDEX_BUILD_ROOT_OFFSET;
+}
+
+uint32_t *freelist_next_trunk(void *trunk) {
+  return trunk + FREELIST_NEXT_TRUNK_OFFSET;
+}
+
+uint32_t *freelist_num_leaves(void *trunk) {
+  return trunk + FREELIST_NUM_LEAVES_OFFSET;
+}
+
+uint32_t *freelist_leaf(void *trunk, uint32_t leaf_num) {
+  return trunk + FREELIST_HEADER_SIZE + leaf_num * sizeof(uint32_t);
+}
+
+/*
+Hand out a page for a new node, reusing a free page when there is one.
+Free pages are taken from the first trunk page; once that trunk is empty
+the trunk page itself is handed out.
+*/
+uint32_t pager_allocate_page(Pager *pager) {
+  void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+  uint32_t trunk_page_num = *db_header_freelist_trunk(header);
+  if (trunk_page_num == 0) {
+    return pager->num_pages;
+  }
+
+  pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+  *db_header_freelist_count(header) -= 1;
+  void *trunk = get_page(pager, trunk_page_num);
+  uint32_t num_leaves = *freelist_num_leaves(trunk);
+  if (num_leaves == 0) {
+    *db_header_freelist_trunk(header) = *freelist_next_trunk(trunk);
+    return trunk_page_num;
+  }
+
+  pager_mark_dirty(pager, trunk_page_num);
+  *freelist_num_leaves(trunk) = num_leaves - 1;
+  return *freelist_leaf(trunk, num_leaves - 1);
+}
+
+/* Put a page no longer used by the tree on the free list */
+void pager_free_page(Pager *pager, uint32_t page_num) {
+  void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+  *db_header_freelist_count(header) += 1;
+
+  uint32_t trunk_page_num = *db_header_freelist_trunk(header);
+  if (trunk_page_num != 0) {
+    void *trunk = get_page(pager, trunk_page_num);
+    uint32_t num_leaves = *freelist_num_leaves(trunk);
+    if (num_leaves < FREELIST_MAX_LEAVES(pager->page_size)) {
+      pager_mark_dirty(pager, trunk_page_num);
+      *freelist_leaf(trunk, num_leaves) = page_num;
+      *freelist_num_leaves(trunk) = num_leaves + 1;
+      pager_drop_page(pager, page_num);
+      return;
+    }
+  }
+
+  // No room on the first trunk, the freed page becomes the new first trunk
+  void *trunk = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  *freelist_next_trunk(trunk) = trunk_page_num;
+  *freelist_num_leaves(trunk) = 0;
+  *db_header_freelist_trunk(header) = page_num;
+}
+
+/*
+Release everything pinned by the statement that just finished, and give
+back frames that were borrowed beyond the budget.
+*/
+void pager_unpin_all(Pager *pager) {
+  for (uint32_t i = 0; i < pager->num_pinned; i++) {
+    Frame *frame = &pager->frames[pager->pinned[i]];
+    frame->statement_pinned = false;
+    frame->pin_count--;
+  }
+  pager->num_pinned = 0;
+
+  while (pager->num_frames > pager->capacity) {
+    uint32_t frame_num = pager->num_frames - 1;
+    Frame *frame = &pager->frames[frame_num];
+    if (frame->pin_count > 0) {
+      break;
+    }
+    if (frame->in_use) {
+      pager_evict(pager, frame_num);
+    }
+    free(frame->data);
+    pager->num_frames--;
+  }
+  if (pager->clock_hand >= pager->num_frames) {
+    pager->clock_hand = 0;
+  }
+}
+
+void pager_flush(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  if (pager->wal) {
+    wal_sync(pager->wal);
+  }
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    pager_mmap_flush(pager, page_num);
+  } else {
+    uint32_t frame_num = pager_lookup(pager, page_num);
+    if (frame_num == PAGER_NO_FRAME) {
+      printf("Tried to flush null page\n");
+      exit(EXIT_FAILURE);
+    }
+    pager_write_page(pager, page_num, pager->frames[frame_num].data);
+  }
+  pager_clear_dirty(pager, page_num);
+  pager_unlock(pager);
+}
+
+void *pager_page_data(Pager *pager, uint32_t page_num) {
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    return pager->map + (off_t)page_num * pager->page_size;
+  }
+  pager_lock(pager);
+  void *page = pager->frames[pager_lookup(pager, page_num)].data;
+  pager_unlock(pager);
+  return page;
+}
+
+/* Consecutive dirty pages written together by a checkpoint */
+typedef struct {
+  uint32_t first_page_num;
+  uint32_t num_pages;
+  struct iovec *iov;
+} PagerRun;
+
+/* Bookkeeping once a run is in the file */
+void pager_run_written(Pager *pager, PagerRun *run) {
+  off_t offset = (off_t)run->first_page_num * pager->page_size;
+  off_t length = (off_t)run->num_pages * pager->page_size;
+  if (offset + length > pager->file_length) {
+    pager->file_length = offset + length;
+  }
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    madvise(pager->map + offset, length, MADV_DONTNEED);
+  }
+}
+
+void pager_write_run(Pager *pager, PagerRun *run) {
+  off_t offset = (off_t)run->first_page_num * pager->page_size;
+  ssize_t bytes_written =
+      pwritev(pager->file_descriptor, run->iov, run->num_pages, offset);
+  if (bytes_written != (ssize_t)run->num_pages * pager->page_size) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  STATS_ADD(&pager->stats, bytes_written, bytes_written);
+  pager_run_written(pager, run);
+}
+
+/* Queue a run as one writev, making room in the ring if it is full */
+void pager_queue_run(Pager *pager, PagerRun *run) {
+  while (!uring_has_room(&pager->ring)) {
+    pager_reap(pager, true);
+  }
+  uint64_t length = (uint64_t)run->num_pages * pager->page_size;
+  off_t offset = (off_t)run->first_page_num * pager->page_size;
+  uring_queue(&pager->ring, IORING_OP_WRITEV, pager->file_descriptor,
+              run->iov, run->num_pages, offset, PAGER_IO_WRITE | length);
+  pager->writes_in_flight++;
+  STATS_ADD(&pager->stats, bytes_written, length);
+}
+
+int compare_page_nums(const void *a, const void *b) {
+  uint32_t left = *(const uint32_t *)a;
+  uint32_t right = *(const uint32_t *)b;
+  return (left > right) - (left < right);
+}
+
+/*
+Write every dirty page back to the file. Pages are sorted by page number
+and consecutive ones go out as a single write. With io_uring every run is
+submitted by one system call and the file is synced once all are done,
+otherwise each run is a pwritev.
+Returns the number of pages written.
+*/
+uint32_t pager_checkpoint(Pager *pager) {
+  pager_lock(pager);
+  if (pager->wal) {
+    wal_sync(pager->wal);
+  }
+
+  qsort(pager->dirty_pages, pager->num_dirty, sizeof(uint32_t),
+        compare_page_nums);
+
+  struct iovec *iov = malloc((pager->num_dirty + 1) * sizeof(struct iovec));
+  PagerRun *runs = malloc((pager->num_dirty + 1) * sizeof(PagerRun));
+  uint32_t num_runs = 0;
+  uint32_t pages_written = 0;
+  for (uint32_t i = 0; i < pager->num_dirty; i++) {
+    uint32_t page_num = pager->dirty_pages[i];
+    if (!pager_is_dirty(pager, page_num)) {
+      // Already written back by eviction, or listed twice
+      continue;
+    }
+    pager_clear_dirty(pager, page_num);
+
+    PagerRun *run = num_runs > 0 ? &runs[num_runs - 1] : NULL;
+    if (run == NULL || page_num != run->first_page_num + run->num_pages ||
+        run->num_pages == PAGER_MAX_RUN_PAGES) {
+      run = &runs[num_runs++];
+      run->first_page_num = page_num;
+      run->num_pages = 0;
+      run->iov = &iov[pages_written];
+    }
+    iov[pages_written].iov_base = pager_page_data(pager, page_num);
+    iov[pages_written].iov_len = pager->page_size;
+    run->num_pages++;
+    pages_written++;
+  }
+  pager->num_dirty = 0;
+
+  if (pager->ring.ring_fd >= 0) {
+    for (uint32_t i = 0; i < num_runs; i++) {
+      pager_queue_run(pager, &runs[i]);
+    }
+    while (pager->writes_in_flight > 0) {
+      pager_reap(pager, true);
+    }
+    for (uint32_t i = 0; i < num_runs; i++) {
+      pager_run_written(pager, &runs[i]);
+    }
+  } else {
+    for (uint32_t i = 0; i < num_runs; i++) {
+      pager_write_run(pager, &runs[i]);
+    }
+  }
+  free(runs);
+  free(iov);
+
+  if (pages_written > 0 && fdatasync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (pager->wal) {
+    wal_reset(pager->wal);
+  }
+  pager->statements_since_checkpoint = 0;
+  pager_unlock(pager);
+  return pages_written;
+}
+
+/*
+Log an image of every page the running statement modified and commit
+it. Must run while those pages are still pinned.
+*/
+void pager_commit(Pager *pager) {
+  if (pager->num_pages != pager->committed_pages) {
+    // The statement grew the file, log the new size along with its pages
+    void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    *db_header_num_pages(header) = pager->num_pages;
+  }
+  for (uint32_t i = 0; i < pager->num_statement_pages; i++) {
+    uint32_t page_num = pager->statement_pages[i];
+    if (!(pager->dirty_map[page_num] & PAGER_DIRTY_STATEMENT)) {
+      // Dropped by the statement
+      continue;
+    }
+    pager->dirty_map[page_num] &= ~PAGER_DIRTY_STATEMENT;
+    if (pager->wal) {
+      wal_append(pager->wal, page_num, pager_page_data(pager, page_num));
+    }
+  }
+  pager->num_statement_pages = 0;
+
+  if (pager->wal) {
+    off_t wal_length = pager->wal->file_length;
+    wal_commit(pager->wal, pager->num_pages);
+    STATS_ADD(&pager->stats, wal_bytes_written,
+              pager->wal->file_length - wal_length);
+  }
+  pager->commit_seq++;
+  pager->committed_pages = pager->num_pages;
+  if (pager->num_versioned > 0) {
+    pager_collect_versions(pager);
+  }
+}
+
+/* Called once a statement is done with its pages */
+void pager_end_statement(Pager *pager) {
+  pager_lock(pager);
+  pager_commit(pager);
+  pager_unpin_all(pager);
+
+  pager->statements_since_checkpoint++;
+  if (pager->checkpoint_interval > 0 &&
+      pager->statements_since_checkpoint >= pager->checkpoint_interval) {
+    pager_checkpoint(pager);
+  }
+  pager_unlock(pager);
+}
+
+/*
+An existing file has its page size in the header, a new one gets the size
+asked for. Files of another format keep the default and are rejected once
+their header is read.
+*/
+uint32_t pager_read_page_size(int fd, uint32_t new_file_page_size) {
+  uint8_t header[DB_HEADER_PAGE_SIZE_OFFSET + DB_HEADER_PAGE_SIZE_SIZE];
+  uint32_t size = new_file_page_size;
+  ssize_t bytes_read = pread(fd, header, sizeof(header), 0);
+  if (bytes_read == -1) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (bytes_read > 0) {
+    size = PAGE_SIZE_DEFAULT;
+    if (bytes_read == (ssize_t)sizeof(header) &&
+        strncmp(db_header_magic(header), DB_HEADER_MAGIC,
+                DB_HEADER_MAGIC_SIZE) == 0) {
+      size = *db_header_page_size(header);
+    }
+  }
+
+  if (size < PAGE_SIZE_MIN || size > PAGE_SIZE_MAX || (size & (size - 1))) {
+    printf("Unsupported page size %d.\n", size);
+    exit(EXIT_FAILURE);
+  }
+  return size;
+}
+
+/* Pages in use the header records, 0 if it records none */
+uint32_t pager_read_num_pages(int fd) {
+  uint32_t num_pages;
+  if (pread(fd, &num_pages, DB_HEADER_NUM_PAGES_SIZE,
+            DB_HEADER_NUM_PAGES_OFFSET) != DB_HEADER_NUM_PAGES_SIZE) {
+    return 0;
+  }
+  return num_pages;
+}
+
+Pager *pager_open(const char *filename, PagerOptions *options) {
+  int fd = open(filename,
+                O_RDWR |     // Read/Write mode
+                    O_CREAT, // Create file if it does not exist
+                S_IWUSR |    // User write permission
+                    S_IRUSR  // User read permission
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t page_size = pager_read_page_size(fd, options->page_size);
+
+  // Pages in use, as of the last commit replayed or else the header
+  Wal *wal = NULL;
+  uint32_t num_pages = 0;
+  if (options->use_wal) {
+    wal = wal_open(filename, page_size, options->sync_mode);
+    if (wal_recover(wal, fd, &num_pages) > 0) {
+      wal_reset(wal);
+    }
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+  if (num_pages == 0) {
+    num_pages = pager_read_num_pages(fd);
+  }
+  if (num_pages == 0) {
+    if (file_length % page_size != 0) {
+      printf("Db file is not a whole number of pages. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    num_pages = file_length / page_size;
+  } else if (file_length > (off_t)num_pages * page_size) {
+    // Grown ahead by the mmap backend and not closed, the tail is unused
+    file_length = (off_t)num_pages * page_size;
+    if (ftruncate(fd, file_length) == -1) {
+      printf("Error truncating file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->wal = wal;
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->num_pages = num_pages;
+  pager->page_size = page_size;
+  pager->backend = options->backend;
+  pager->map = NULL;
+  pager->map_length = 0;
+
+  pager->capacity = options->cache_size / pager->page_size;
+  if (pager->capacity < PAGER_MIN_CACHE_PAGES) {
+    pager->capacity = PAGER_MIN_CACHE_PAGES;
+  }
+  pager->frames = NULL;
+  pager->num_frames = 0;
+  pager->clock_hand = 0;
+
+  pager->page_table_size = pager->num_pages + 1;
+  pager->page_table = malloc(pager->page_table_size * sizeof(uint32_t));
+  for (uint32_t i = 0; i < pager->page_table_size; i++) {
+    pager->page_table[i] = PAGER_NO_FRAME;
+  }
+
+  pager->pinned_capacity = PAGER_MIN_CACHE_PAGES;
+  pager->pinned = malloc(pager->pinned_capacity * sizeof(uint32_t));
+  pager->num_pinned = 0;
+
+  pager->dirty_map_size = pager->num_pages + 1;
+  pager->dirty_map = calloc(pager->dirty_map_size, 1);
+  pager->dirty_capacity = PAGER_MIN_CACHE_PAGES;
+  pager->dirty_pages = malloc(pager->dirty_capacity * sizeof(uint32_t));
+  pager->num_dirty = 0;
+
+  pager->statement_pages_capacity = PAGER_MIN_CACHE_PAGES;
+  pager->statement_pages =
+      malloc(pager->statement_pages_capacity * sizeof(uint32_t));
+  pager->num_statement_pages = 0;
+  pager->unlogged = false;
+
+  pager->checkpoint_interval = options->checkpoint_interval;
+  pager->statements_since_checkpoint = 0;
+  pager->scan_threads = options->scan_threads;
+
+  pager->ring.ring_fd = -1;
+  if (options->use_io_uring) {
+    uring_open(&pager->ring, URING_ENTRIES);
+  }
+  pager->num_loading = 0;
+  pager->writes_in_flight = 0;
+
+  pager->concurrent = options->concurrent;
+  pager->latches = NULL;
+  pager->commit_seq = 0;
+  pager->committed_pages = pager->num_pages;
+  pager->versions = NULL;
+  pager->versions_size = 0;
+  pager->versioned_capacity = PAGER_MIN_CACHE_PAGES;
+  pager->versioned_pages =
+      malloc(pager->versioned_capacity * sizeof(uint32_t));
+  pager->num_versioned = 0;
+  pager->snapshots = NULL;
+  pager->num_snapshots = 0;
+  pager->snapshots_capacity = 0;
+  stats_reset(&pager->stats);
+  if (pager->concurrent) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&pager->mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    pager->latches = malloc(PAGER_LATCH_STRIPES * sizeof(pthread_rwlock_t));
+    for (uint32_t i = 0; i < PAGER_LATCH_STRIPES; i++) {
+      pthread_rwlock_init(&pager->latches[i], NULL);
+    }
+  }
+
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    pager_mmap_open(pager);
+    if (file_length > 0) {
+      pager_mmap_grow(pager, file_length);
+    }
+  }
+
+  return pager;
+}
+
+void pager_close(Pager *pager) {
+  pager_commit(pager);
+  pager_checkpoint(pager);
+  pager_drain(pager);
+  uring_close(&pager->ring);
+  if (pager->wal) {
+    wal_close(pager->wal);
+  }
+  if (pager->backend == PAGER_BACKEND_MMAP) {
+    pager_mmap_close(pager);
+  }
+
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    free(pager->frames[i].data);
+  }
+
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  free(pager->frames);
+  free(pager->page_table);
+  free(pager->pinned);
+  free(pager->dirty_map);
+  free(pager->dirty_pages);
+  free(pager->statement_pages);
+  if (pager->concurrent) {
+    for (uint32_t i = 0; i < PAGER_LATCH_STRIPES; i++) {
+      pthread_rwlock_destroy(&pager->latches[i]);
+    }
+    free(pager->latches);
+    pthread_mutex_destroy(&pager->mutex);
+  }
+  pager->num_snapshots = 0;
+  pager_collect_versions(pager);
+  free(pager->versions);
+  free(pager->versioned_pages);
+  free(pager->snapshots);
+  free(pager);
+}
+
+#endif
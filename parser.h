@@ -0,0 +1,579 @@
+#ifndef __PARSER_H__
+#define __PARSER_H__
+
+#include "index.h"
+#include "result.h"
+#include "shell.h"
+#include "statement.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+Statement parser. The lexer hands out tokens pointing into the input,
+which is left untouched, and a recursive-descent parser builds the
+statement from them. Everything the statement points to (the row to
+insert, the where tree and its values) is carved out of the arena inside
+the Statement, so preparing a statement never touches the heap.
+
+  insert <id> <username> <email>
+  insert [into <table>] values (<id>, <username>, <email>) {, (...)}
+  select [* | count(*)] [from <table>] [where <condition>]
+         [order by <column> [asc | desc]] [limit <n> [offset <n>]]
+  delete [from <table>] [where <condition>]
+  create index on <column>
+
+  condition := term {or term}
+  term      := factor {and factor}
+  factor    := ( condition )
+             | <column> (= | < | <= | > | >=) <value>
+             | <column> between <value> and <value>
+             | <column> like <pattern>
+             | <column> contains <value>
+
+Keywords are case-insensitive. Values are numbers, words, or strings in
+single or double quotes.
+*/
+
+typedef enum {
+  TOKEN_END,
+  TOKEN_WORD,   // Keywords, names and unquoted values
+  TOKEN_NUMBER, // A word made of digits, with an optional leading -
+  TOKEN_STRING, // Quoted, the token leaves out the quotes
+  TOKEN_OPERATOR,
+  TOKEN_LEFT_PAREN,
+  TOKEN_RIGHT_PAREN,
+  TOKEN_STAR,
+  TOKEN_COMMA,
+  TOKEN_ERROR // A string missing its closing quote
+} TokenType;
+
+typedef struct {
+  TokenType type;
+  const char *start;
+  uint32_t length;
+} Token;
+
+typedef struct {
+  const char *position;
+  const char *end;
+  Token token; // The next token, not yet consumed
+  Statement *statement;
+  PrepareResult error; // First error found, PREPARE_SUCCESS if none
+} Parser;
+
+bool is_word_delimiter(char c) {
+  return isspace((unsigned char)c) || c == '(' || c == ')' || c == '=' ||
+         c == '<' || c == '>' || c == ',';
+}
+
+void lexer_next(Parser *parser) {
+  const char *p = parser->position;
+  while (p < parser->end && isspace((unsigned char)*p)) {
+    p++;
+  }
+
+  Token *token = &parser->token;
+  token->start = p;
+  token->length = 0;
+  if (p == parser->end) {
+    token->type = TOKEN_END;
+  } else if (*p == '"' || *p == '\'') {
+    const char *close = memchr(p + 1, *p, parser->end - (p + 1));
+    if (close == NULL) {
+      token->type = TOKEN_ERROR;
+      p = parser->end;
+    } else {
+      token->type = TOKEN_STRING;
+      token->start = p + 1;
+      token->length = close - (p + 1);
+      p = close + 1;
+    }
+  } else if (*p == '(' || *p == ')' || *p == '*' || *p == ',') {
+    switch (*p) {
+    case '(':
+      token->type = TOKEN_LEFT_PAREN;
+      break;
+    case ')':
+      token->type = TOKEN_RIGHT_PAREN;
+      break;
+    case '*':
+      token->type = TOKEN_STAR;
+      break;
+    default:
+      token->type = TOKEN_COMMA;
+    }
+    token->length = 1;
+    p++;
+  } else if (*p == '=' || *p == '<' || *p == '>') {
+    token->type = TOKEN_OPERATOR;
+    token->length = (*p != '=' && p + 1 < parser->end && p[1] == '=') ? 2 : 1;
+    p += token->length;
+  } else {
+    while (p < parser->end && !is_word_delimiter(*p)) {
+      p++;
+    }
+    token->length = p - token->start;
+    const char *digits = token->start + (*token->start == '-');
+    token->type = digits < p ? TOKEN_NUMBER : TOKEN_WORD;
+    for (const char *d = digits; d < p; d++) {
+      if (!isdigit((unsigned char)*d)) {
+        token->type = TOKEN_WORD;
+        break;
+      }
+    }
+  }
+  parser->position = p;
+}
+
+/* Memory for the statement, NULL once the arena is used up */
+void *statement_alloc(Statement *statement, uint32_t size) {
+  uint32_t aligned = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+  if (statement->arena_used + aligned > STATEMENT_ARENA_SIZE) {
+    return NULL;
+  }
+  void *memory = (char *)statement->arena + statement->arena_used;
+  statement->arena_used += aligned;
+  return memory;
+}
+
+/* Record the first error, later ones are usually caused by it */
+bool parser_fail(Parser *parser, PrepareResult error) {
+  if (parser->error == PREPARE_SUCCESS) {
+    parser->error = error;
+  }
+  return false;
+}
+
+void *parser_alloc(Parser *parser, uint32_t size) {
+  void *memory = statement_alloc(parser->statement, size);
+  if (memory == NULL) {
+    parser_fail(parser, PREPARE_STATEMENT_TOO_LONG);
+  }
+  return memory;
+}
+
+bool token_is(Token *token, const char *text) {
+  return token->length == strlen(text) &&
+         strncasecmp(token->start, text, token->length) == 0;
+}
+
+/* Consume the next token if it is the given keyword */
+bool parser_accept(Parser *parser, const char *keyword) {
+  if (parser->token.type != TOKEN_WORD || !token_is(&parser->token, keyword)) {
+    return false;
+  }
+  lexer_next(parser);
+  return true;
+}
+
+bool parser_expect(Parser *parser, const char *keyword) {
+  return parser_accept(parser, keyword) ||
+         parser_fail(parser, PREPARE_SYNTAX_ERROR);
+}
+
+bool parser_expect_token(Parser *parser, TokenType type) {
+  if (parser->token.type != type) {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  lexer_next(parser);
+  return true;
+}
+
+bool parser_expect_end(Parser *parser) {
+  return parser->token.type == TOKEN_END ||
+         parser_fail(parser, PREPARE_SYNTAX_ERROR);
+}
+
+bool token_is_value(Token *token) {
+  return token->type == TOKEN_WORD || token->type == TOKEN_NUMBER ||
+         token->type == TOKEN_STRING;
+}
+
+/* Copy a value token of at most max_length characters into destination */
+bool parser_copy_value(Parser *parser, char *destination, uint32_t max_length) {
+  Token *token = &parser->token;
+  if (!token_is_value(token)) {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  if (token->length > max_length) {
+    return parser_fail(parser, PREPARE_STRING_TOO_LONG);
+  }
+  memcpy(destination, token->start, token->length);
+  destination[token->length] = '\0';
+  lexer_next(parser);
+  return true;
+}
+
+/* Parse a number token that fits an int, without consuming it */
+bool parser_number(Parser *parser, int64_t *number) {
+  if (parser->token.type != TOKEN_NUMBER) {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  // The token is followed by a delimiter or the end of the input
+  *number = strtoll(parser->token.start, NULL, 10);
+  if (*number > INT32_MAX || *number < INT32_MIN) {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  return true;
+}
+
+/* Values of string columns may be quoted, ids are numbers */
+void *parser_where_value(Parser *parser, WhereClause *where,
+                         VaulueType *value_type) {
+  Token *token = &parser->token;
+  if (token->type == TOKEN_STRING || strcmp(where->column_name, "id") != 0) {
+    *value_type = STRING;
+    char *value = parser_alloc(parser, token->length + 1);
+    if (value == NULL || !parser_copy_value(parser, value, token->length)) {
+      return NULL;
+    }
+    return value;
+  }
+
+  *value_type = INT;
+  int64_t number;
+  int *value = parser_alloc(parser, sizeof(int));
+  if (value == NULL || !parser_number(parser, &number)) {
+    return NULL;
+  }
+  *value = number;
+  lexer_next(parser);
+  return value;
+}
+
+WhereClause *parser_where_node(Parser *parser, WhereType type) {
+  WhereClause *where = parser_alloc(parser, sizeof(WhereClause));
+  if (where != NULL) {
+    memset(where, 0, sizeof(WhereClause));
+    where->type = type;
+  }
+  return where;
+}
+
+WhereClause *parse_condition(Parser *parser);
+
+/*
+<column> <operator> <value>. between takes a second value after "and".
+In a like pattern % matches any run of characters and _ any one, contains
+matches the value anywhere. Neither applies to id.
+*/
+WhereClause *parse_predicate(Parser *parser) {
+  WhereClause *where = parser_where_node(parser, WHERE_PREDICATE);
+  if (where == NULL ||
+      !parser_copy_value(parser, where->column_name, COLUMN_NAME_MAX_SIZE)) {
+    return NULL;
+  }
+  bool is_id = strcmp(where->column_name, "id") == 0;
+  if (!is_id && index_column(where->column_name) == NUM_INDEXES) {
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return NULL;
+  }
+
+  Token *token = &parser->token;
+  if (token->type == TOKEN_OPERATOR) {
+    memcpy(where->operator, token->start, token->length);
+    where->operator[token->length] = '\0';
+    lexer_next(parser);
+  } else if (parser_accept(parser, "between")) {
+    strcpy(where->operator, "between");
+  } else if (parser_accept(parser, "like")) {
+    strcpy(where->operator, "like");
+  } else if (parser_accept(parser, "contains")) {
+    strcpy(where->operator, "contains");
+  } else {
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return NULL;
+  }
+
+  where->value = parser_where_value(parser, where, &where->value_type);
+  if (where->value == NULL) {
+    return NULL;
+  }
+  if (strcmp(where->operator, "between") == 0) {
+    VaulueType upper_value_type;
+    if (!parser_expect(parser, "and")) {
+      return NULL;
+    }
+    where->upper_value = parser_where_value(parser, where, &upper_value_type);
+    if (where->upper_value == NULL) {
+      return NULL;
+    }
+    if (upper_value_type != where->value_type) {
+      parser_fail(parser, PREPARE_SYNTAX_ERROR);
+      return NULL;
+    }
+  }
+  if (is_id && (strcmp(where->operator, "like") == 0 ||
+                strcmp(where->operator, "contains") == 0)) {
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return NULL;
+  }
+  return where;
+}
+
+WhereClause *parse_factor(Parser *parser) {
+  if (parser->token.type != TOKEN_LEFT_PAREN) {
+    return parse_predicate(parser);
+  }
+  lexer_next(parser);
+  WhereClause *where = parse_condition(parser);
+  if (where == NULL) {
+    return NULL;
+  }
+  if (parser->token.type != TOKEN_RIGHT_PAREN) {
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return NULL;
+  }
+  lexer_next(parser);
+  return where;
+}
+
+/* Operands joined by keyword, left-associative */
+WhereClause *parse_binary(Parser *parser, const char *keyword, WhereType type,
+                          WhereClause *(*parse_operand)(Parser *)) {
+  WhereClause *left = parse_operand(parser);
+  while (left != NULL && parser_accept(parser, keyword)) {
+    WhereClause *node = parser_where_node(parser, type);
+    if (node == NULL) {
+      return NULL;
+    }
+    node->left = left;
+    node->right = parse_operand(parser);
+    left = node->right == NULL ? NULL : node;
+  }
+  return left;
+}
+
+WhereClause *parse_term(Parser *parser) {
+  return parse_binary(parser, "and", WHERE_AND, parse_factor);
+}
+
+WhereClause *parse_condition(Parser *parser) {
+  return parse_binary(parser, "or", WHERE_OR, parse_term);
+}
+
+bool parse_id(Parser *parser, Row *row) {
+  int64_t id;
+  if (!parser_number(parser, &id)) {
+    return false;
+  }
+  if (id < 0) {
+    return parser_fail(parser, PREPARE_NEGATIVE_ID);
+  }
+  row->id = id;
+  lexer_next(parser);
+  return true;
+}
+
+/* (<id>, <username>, <email>) */
+bool parse_values_row(Parser *parser, Row *row) {
+  return parser_expect_token(parser, TOKEN_LEFT_PAREN) &&
+         parse_id(parser, row) && parser_expect_token(parser, TOKEN_COMMA) &&
+         parser_copy_value(parser, row->username, COLUMN_USERNAME_SIZE) &&
+         parser_expect_token(parser, TOKEN_COMMA) &&
+         parser_copy_value(parser, row->email, COLUMN_EMAIL_SIZE) &&
+         parser_expect_token(parser, TOKEN_RIGHT_PAREN);
+}
+
+/*
+A batch can hold far more rows than the arena, so the rows are only
+checked here and the statement remembers where they are in the input.
+statement_rows parses them again when the statement runs.
+*/
+bool parse_insert_values(Parser *parser, Statement *statement) {
+  Row row;
+  statement->values = parser->token.start;
+  statement->num_rows = 0;
+  for (;;) {
+    if (!parse_values_row(parser, &row)) {
+      return false;
+    }
+    statement->num_rows++;
+    if (parser->token.type != TOKEN_COMMA) {
+      break;
+    }
+    lexer_next(parser);
+  }
+  statement->values_length = parser->token.start - statement->values;
+  return parser_expect_end(parser);
+}
+
+bool parse_insert(Parser *parser, Statement *statement) {
+  statement->type = STATEMENT_INSERT;
+  if (parser_accept(parser, "into")) {
+    if (parser->token.type != TOKEN_WORD) {
+      return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    }
+    lexer_next(parser);
+  }
+  if (parser_accept(parser, "values")) {
+    return parse_insert_values(parser, statement);
+  }
+
+  Row *row = parser_alloc(parser, sizeof(Row));
+  if (row == NULL) {
+    return false;
+  }
+  statement->row_to_insert = row;
+  return parse_id(parser, row) &&
+         parser_copy_value(parser, row->username, COLUMN_USERNAME_SIZE) &&
+         parser_copy_value(parser, row->email, COLUMN_EMAIL_SIZE) &&
+         parser_expect_end(parser);
+}
+
+/* Parse the rows of an insert values statement into rows */
+void statement_rows(Statement *statement, Row *rows) {
+  Parser parser;
+  parser.position = statement->values;
+  parser.end = statement->values + statement->values_length;
+  parser.statement = statement;
+  parser.error = PREPARE_SUCCESS;
+  lexer_next(&parser);
+  for (uint32_t i = 0; i < statement->num_rows; i++) {
+    parse_values_row(&parser, &rows[i]);
+    if (parser.token.type == TOKEN_COMMA) {
+      lexer_next(&parser);
+    }
+  }
+}
+
+/* [from <table>] [where <condition>], shared by select and delete */
+bool parse_from_where(Parser *parser, Statement *statement) {
+  if (parser_accept(parser, "from")) {
+    if (parser->token.type != TOKEN_WORD) {
+      return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    }
+    lexer_next(parser);
+  }
+  if (parser_accept(parser, "where")) {
+    statement->where = parse_condition(parser);
+    if (statement->where == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* A number of rows for limit or offset */
+bool parse_row_count(Parser *parser, uint32_t *count) {
+  int64_t number;
+  if (!parser_number(parser, &number)) {
+    return false;
+  }
+  if (number < 0) {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  *count = number;
+  lexer_next(parser);
+  return true;
+}
+
+/* order by <column> [asc | desc] */
+bool parse_order_by(Parser *parser, Statement *statement) {
+  if (!parser_expect(parser, "by") ||
+      !parser_copy_value(parser, statement->order_by, COLUMN_NAME_MAX_SIZE)) {
+    return false;
+  }
+  if (strcmp(statement->order_by, "id") != 0 &&
+      index_column(statement->order_by) == NUM_INDEXES) {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  if (parser_accept(parser, "desc")) {
+    statement->descending = true;
+  } else {
+    parser_accept(parser, "asc");
+  }
+  return true;
+}
+
+/* count(*) prints a single row, so it takes no order or limit */
+bool parse_select(Parser *parser, Statement *statement) {
+  statement->type = STATEMENT_SELECT;
+  if (parser->token.type == TOKEN_STAR) {
+    lexer_next(parser);
+  } else if (parser_accept(parser, "count")) {
+    statement->count = true;
+    if (!parser_expect_token(parser, TOKEN_LEFT_PAREN) ||
+        !parser_expect_token(parser, TOKEN_STAR) ||
+        !parser_expect_token(parser, TOKEN_RIGHT_PAREN)) {
+      return false;
+    }
+  }
+  if (!parse_from_where(parser, statement)) {
+    return false;
+  }
+  if (!statement->count && parser_accept(parser, "order") &&
+      !parse_order_by(parser, statement)) {
+    return false;
+  }
+  if (!statement->count && parser_accept(parser, "limit")) {
+    if (!parse_row_count(parser, &statement->limit)) {
+      return false;
+    }
+    if (parser_accept(parser, "offset") &&
+        !parse_row_count(parser, &statement->offset)) {
+      return false;
+    }
+  }
+  return parser_expect_end(parser);
+}
+
+bool parse_delete(Parser *parser, Statement *statement) {
+  statement->type = STATEMENT_DELETE;
+  return parse_from_where(parser, statement) && parser_expect_end(parser);
+}
+
+bool parse_create_index(Parser *parser, Statement *statement) {
+  statement->type = STATEMENT_CREATE_INDEX;
+  char column_name[COLUMN_NAME_MAX_SIZE + 1];
+  if (!parser_expect(parser, "index") || !parser_expect(parser, "on") ||
+      !parser_copy_value(parser, column_name, COLUMN_NAME_MAX_SIZE) ||
+      !parser_expect_end(parser)) {
+    return false;
+  }
+  statement->index_column = index_column(column_name);
+  if (statement->index_column == NUM_INDEXES) {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  return true;
+}
+
+PrepareResult prepare_statement(InputBuffer *input_buffer,
+                                Statement *statement) {
+  statement->row_to_insert = NULL;
+  statement->where = NULL;
+  statement->values = NULL;
+  statement->num_rows = 0;
+  statement->count = false;
+  statement->order_by[0] = '\0';
+  statement->descending = false;
+  statement->limit = UINT32_MAX;
+  statement->offset = 0;
+  statement->arena_used = 0;
+
+  Parser parser;
+  parser.position = input_buffer->buffer;
+  parser.end = input_buffer->buffer + input_buffer->input_length;
+  parser.statement = statement;
+  parser.error = PREPARE_SUCCESS;
+  lexer_next(&parser);
+
+  if (parser_accept(&parser, "insert")) {
+    parse_insert(&parser, statement);
+  } else if (parser_accept(&parser, "select")) {
+    parse_select(&parser, statement);
+  } else if (parser_accept(&parser, "delete")) {
+    parse_delete(&parser, statement);
+  } else if (parser_accept(&parser, "create")) {
+    parse_create_index(&parser, statement);
+  } else {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  return parser.error;
+}
+
+#endif
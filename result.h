@@ -3,6 +3,8 @@
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_UNSUPPORTED_DELETE, // Anything but delete where id = N
 } ExecuteResult;
 
 typedef enum {
@@ -15,7 +17,8 @@ typedef enum {
   PREPARE_NEGATIVE_ID,
   PREPARE_STRING_TOO_LONG,
   PREPARE_SYNTAX_ERROR,
-  PREPARE_UNRECOGNIZED_STATEMENT
+  PREPARE_UNRECOGNIZED_STATEMENT,
+  PREPARE_STATEMENT_TOO_LONG
 } PrepareResult;
 
 #endif
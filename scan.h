@@ -0,0 +1,359 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include "btree.h"
+#include "filter.h"
+#include <pthread.h>
+
+/*
+Parallel scans. The ids to scan are cut into ranges at the separator keys
+of the upper internal levels, and threads take the ranges in turn, each
+walking its own with a SnapshotCursor. The rows a thread keeps go into a
+buffer of the range, bounded to SCAN_BUFFER_PAGES pages, which the
+caller reads out range by range with parallel_scan_next while the
+threads go on, so rows come back in id order as they are found. A thread
+whose buffer is full waits for the caller to empty it.
+*/
+
+/* Ranges cut per thread, so that threads finishing early take another */
+#define SCAN_RANGES_PER_THREAD 4
+#define SCAN_MAX_THREADS 64
+/* Smaller tables are scanned on the calling thread */
+#define SCAN_MIN_LEAVES 64
+/* Bytes of rows a range holds before its thread waits, in pages */
+#define SCAN_BUFFER_PAGES 16
+
+typedef struct {
+  uint32_t low;
+  uint32_t high;
+  uint8_t *rows; // Record size and record of each row kept, not yet read
+  uint32_t length;
+  bool done;
+} ScanRange;
+
+typedef struct {
+  Table *table;
+  uint64_t snapshot;
+  WhereClause *where; // NULL keeps every row
+  ScanRange *ranges;
+  uint32_t num_ranges;
+  uint32_t next_range; // Next range for a thread to take
+  uint32_t capacity;   // Of the buffer of a range
+  pthread_t threads[SCAN_MAX_THREADS];
+  uint32_t num_threads;
+  /* Guards the length and done of ranges and stop */
+  pthread_mutex_t mutex;
+  pthread_cond_t filled;  // A range has more rows or is done
+  pthread_cond_t drained; // A range has room again
+  bool stop;              // The caller is done reading
+  /* Position of parallel_scan_next */
+  uint32_t range_num;
+  uint32_t offset;
+  uint32_t available; // Bytes of the range it may read up to
+} ParallelScan;
+
+int compare_keys(const void *a, const void *b) {
+  uint32_t left = *(const uint32_t *)a;
+  uint32_t right = *(const uint32_t *)b;
+  return (left > right) - (left < right);
+}
+
+/*
+Separator keys to cut the table at, read level by level from the root
+until a level has target children or its children are the leaves.
+Returns their number, 0 if the table is too small to split.
+*/
+uint32_t scan_separators(Table *table, uint64_t snapshot, uint32_t target,
+                         uint32_t **separators) {
+  uint32_t page_size = table->pager->page_size;
+  Pager *pager = table->pager;
+  void *node = malloc(page_size);
+  uint32_t *level = malloc(sizeof(uint32_t));
+  uint32_t level_size = 1;
+  level[0] = table->root_page_num;
+  uint32_t *keys = NULL;
+  uint32_t num_keys = 0;
+  bool leaves = false;
+
+  while (level_size < target) {
+    uint32_t *children = NULL;
+    uint32_t num_children = 0;
+    for (uint32_t i = 0; i < level_size && !leaves; i++) {
+      pager_read_snapshot(pager, level[i], snapshot, node);
+      if (get_node_type(node) == NODE_LEAF) {
+        leaves = true;
+        break;
+      }
+      uint32_t node_keys = *internal_node_num_keys(node);
+      keys = realloc(keys, (num_keys + node_keys) * sizeof(uint32_t));
+      children =
+          realloc(children, (num_children + node_keys + 1) * sizeof(uint32_t));
+      for (uint32_t j = 0; j < node_keys; j++) {
+        keys[num_keys++] = *internal_node_key(node, j);
+        children[num_children++] = *internal_node_child(table, node, j);
+      }
+      children[num_children++] = *internal_node_right_child(node);
+    }
+    if (leaves) {
+      free(children);
+      break;
+    }
+    free(level);
+    level = children;
+    level_size = num_children;
+  }
+  free(level);
+  free(node);
+
+  if (leaves && level_size < SCAN_MIN_LEAVES) {
+    free(keys);
+    return 0;
+  }
+  // Keys of the upper levels are maxima of subtrees as well, sort them in
+  qsort(keys, num_keys, sizeof(uint32_t), compare_keys);
+  uint32_t num_unique = 0;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    if (num_unique == 0 || keys[i] != keys[num_unique - 1]) {
+      keys[num_unique++] = keys[i];
+    }
+  }
+  *separators = keys;
+  return num_unique;
+}
+
+/* Cut low..high into up to target ranges. Returns their number */
+uint32_t scan_split(Table *table, uint64_t snapshot, uint32_t low,
+                    uint32_t high, uint32_t target, ScanRange **ranges) {
+  uint32_t *keys;
+  uint32_t num_keys = scan_separators(table, snapshot, target, &keys);
+  if (num_keys == 0) {
+    return 0;
+  }
+
+  uint32_t first = 0;
+  while (first < num_keys && keys[first] < low) {
+    first++;
+  }
+  uint32_t last = first;
+  while (last < num_keys && keys[last] < high) {
+    last++;
+  }
+  uint32_t step = (last - first + target - 1) / target;
+  if (step == 0) {
+    step = 1;
+  }
+
+  *ranges = calloc(target + 1, sizeof(ScanRange));
+  uint32_t num_ranges = 0;
+  uint32_t range_low = low;
+  for (uint32_t i = first + step - 1; i < last; i += step) {
+    (*ranges)[num_ranges].low = range_low;
+    (*ranges)[num_ranges].high = keys[i];
+    num_ranges++;
+    range_low = keys[i] + 1;
+  }
+  (*ranges)[num_ranges].low = range_low;
+  (*ranges)[num_ranges].high = high;
+  num_ranges++;
+  free(keys);
+  return num_ranges;
+}
+
+/*
+Add the rows kept from a leaf to its range, waiting for room. They are
+copied under the mutex, as the caller empties the buffer by setting its
+length back to 0. Returns false if the caller is done reading.
+*/
+bool scan_range_append(ParallelScan *scan, ScanRange *range, uint8_t *rows,
+                       uint32_t length) {
+  pthread_mutex_lock(&scan->mutex);
+  while (range->length + length > scan->capacity && !scan->stop) {
+    pthread_cond_wait(&scan->drained, &scan->mutex);
+  }
+  bool stop = scan->stop;
+  if (!stop) {
+    memcpy(range->rows + range->length, rows, length);
+    range->length += length;
+    pthread_cond_signal(&scan->filled);
+  }
+  pthread_mutex_unlock(&scan->mutex);
+  return !stop;
+}
+
+void scan_range(ParallelScan *scan, ScanRange *range) {
+  uint32_t page_size = scan->table->pager->page_size;
+  uint32_t cells[LEAF_NODE_MAX_CELLS(page_size)];
+  // A leaf's records and their sizes
+  uint8_t *rows = malloc(page_size + sizeof(cells));
+  bool past_high = false;
+  bool more = true;
+  // Read by the caller once it has rows, see parallel_scan_next
+  range->rows = malloc(scan->capacity);
+  SnapshotCursor *cursor =
+      snapshot_seek(scan->table, scan->snapshot, range->low);
+  while (!(cursor->end_of_table) && !past_high && more) {
+    void *node = cursor->node;
+    uint32_t num_selected = leaf_node_filter(
+        node, cursor->cell_num, range->high, scan->where, cells, &past_high);
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < num_selected; i++) {
+      uint16_t record_size = *leaf_node_record_size(node, cells[i]);
+      memcpy(rows + length, &record_size, sizeof(uint16_t));
+      memcpy(rows + length + sizeof(uint16_t),
+             leaf_node_value(node, cells[i]), record_size);
+      length += sizeof(uint16_t) + record_size;
+    }
+    if (length > 0) {
+      more = scan_range_append(scan, range, rows, length);
+    }
+    snapshot_cursor_next_leaf(cursor);
+  }
+  snapshot_cursor_free(cursor);
+  free(rows);
+
+  pthread_mutex_lock(&scan->mutex);
+  range->done = true;
+  pthread_cond_signal(&scan->filled);
+  pthread_mutex_unlock(&scan->mutex);
+}
+
+void *scan_thread(void *arg) {
+  ParallelScan *scan = arg;
+  while (!__atomic_load_n(&scan->stop, __ATOMIC_RELAXED)) {
+    uint32_t range_num =
+        __atomic_fetch_add(&scan->next_range, 1, __ATOMIC_RELAXED);
+    if (range_num >= scan->num_ranges) {
+      break;
+    }
+    scan_range(scan, &scan->ranges[range_num]);
+  }
+  return NULL;
+}
+
+/*
+Scan the rows with ids from low to high on the pager's scan threads and
+keep those satisfying where, reading the table as of snapshot. Outside
+library mode nothing else may use the pager until parallel_scan_free,
+and snapshot is its commit_seq. Returns NULL if the table is scanned
+faster on one thread, otherwise the rows are read back with
+parallel_scan_next.
+*/
+ParallelScan *parallel_scan(Table *table, uint64_t snapshot, uint32_t low,
+                            uint32_t high, WhereClause *where) {
+  Pager *pager = table->pager;
+  uint32_t num_threads = pager->scan_threads;
+  if (num_threads > SCAN_MAX_THREADS) {
+    num_threads = SCAN_MAX_THREADS;
+  }
+  if (num_threads <= 1) {
+    return NULL;
+  }
+  ScanRange *ranges;
+  uint32_t num_ranges =
+      scan_split(table, snapshot, low, high,
+                 num_threads * SCAN_RANGES_PER_THREAD, &ranges);
+  if (num_ranges < 2) {
+    if (num_ranges > 0) {
+      free(ranges);
+    }
+    return NULL;
+  }
+  if (num_threads > num_ranges) {
+    num_threads = num_ranges;
+  }
+  if (!pager->concurrent) {
+    // Reads completing would change frames under the scan threads
+    pager_drain(pager);
+    // Resolved on first use otherwise, see db_open_with_options
+    key_search_kernel();
+    string_find_kernel();
+  }
+
+  ParallelScan *scan = malloc(sizeof(ParallelScan));
+  scan->table = table;
+  scan->snapshot = snapshot;
+  scan->where = where;
+  scan->ranges = ranges;
+  scan->num_ranges = num_ranges;
+  scan->next_range = 0;
+  scan->capacity = SCAN_BUFFER_PAGES * pager->page_size;
+  pthread_mutex_init(&scan->mutex, NULL);
+  pthread_cond_init(&scan->filled, NULL);
+  pthread_cond_init(&scan->drained, NULL);
+  scan->stop = false;
+  scan->range_num = 0;
+  scan->offset = 0;
+  scan->available = 0;
+
+  // The calling thread reads the rows out meanwhile
+  scan->num_threads = num_threads;
+  for (uint32_t i = 0; i < num_threads; i++) {
+    if (pthread_create(&scan->threads[i], NULL, scan_thread, scan) != 0) {
+      printf("Error creating scan thread: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return scan;
+}
+
+/*
+The next row kept, in id order. Returns false after the last one. Once
+it has read all a range holds, it empties the buffer for the thread to
+go on, and waits for more if the range is not done.
+*/
+bool parallel_scan_next(ParallelScan *scan, Row *row) {
+  while (scan->range_num < scan->num_ranges) {
+    ScanRange *range = &scan->ranges[scan->range_num];
+    if (scan->offset < scan->available) {
+      uint8_t *entry = range->rows + scan->offset;
+      uint16_t record_size;
+      memcpy(&record_size, entry, sizeof(uint16_t));
+      deserialize_row(entry + sizeof(uint16_t), row);
+      scan->offset += sizeof(uint16_t) + record_size;
+      return true;
+    }
+
+    pthread_mutex_lock(&scan->mutex);
+    if (range->length == scan->offset) {
+      range->length = 0;
+      scan->offset = 0;
+      pthread_cond_broadcast(&scan->drained);
+    }
+    while (range->length == scan->offset && !range->done) {
+      pthread_cond_wait(&scan->filled, &scan->mutex);
+    }
+    scan->available = range->length;
+    bool done = range->length == scan->offset;
+    pthread_mutex_unlock(&scan->mutex);
+
+    if (done) {
+      free(range->rows);
+      range->rows = NULL;
+      scan->range_num++;
+      scan->offset = 0;
+      scan->available = 0;
+    }
+  }
+  return false;
+}
+
+/* Stop the threads, whether or not every row was read */
+void parallel_scan_free(ParallelScan *scan) {
+  pthread_mutex_lock(&scan->mutex);
+  __atomic_store_n(&scan->stop, true, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&scan->drained);
+  pthread_mutex_unlock(&scan->mutex);
+  for (uint32_t i = 0; i < scan->num_threads; i++) {
+    pthread_join(scan->threads[i], NULL);
+  }
+  pthread_cond_destroy(&scan->drained);
+  pthread_cond_destroy(&scan->filled);
+  pthread_mutex_destroy(&scan->mutex);
+  for (uint32_t i = 0; i < scan->num_ranges; i++) {
+    free(scan->ranges[i].rows);
+  }
+  free(scan->ranges);
+  free(scan);
+}
+
+#endif
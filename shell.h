@@ -13,13 +13,18 @@ void print_row(Row *row) {
   printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
+void print_constants(uint32_t page_size) {
+  printf("PAGE_SIZE: %d\n", page_size);
+  printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
   printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
   printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n",
+         LEAF_NODE_SPACE_FOR_CELLS(page_size));
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS(page_size));
+  printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS(page_size));
+  printf("KEY_SEARCH_KERNEL: %s\n", key_search_kernel());
+  printf("STRING_FIND_KERNEL: %s\n", string_find_kernel());
 }
 
 void indent(uint32_t level) {
@@ -28,8 +33,8 @@ void indent(uint32_t level) {
   }
 }
 
-void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
-  void *node = get_page(pager, page_num);
+void print_tree(Table *table, uint32_t page_num, uint32_t indentation_level) {
+  void *node = get_page(table->pager, page_num);
   uint32_t num_keys, child;
 
   switch (get_node_type(node)) {
@@ -47,21 +52,44 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
     indent(indentation_level);
     printf("- page %d, internal (size %d)\n", page_num, num_keys);
     for (uint32_t i = 0; i < num_keys; i++) {
-      child = *internal_node_child(node, i);
+      child = *internal_node_child(table, node, i);
       indent(indentation_level + 1);
       printf("- key %d, child %d\n", *internal_node_key(node, i), child);
-      print_tree(pager, child, indentation_level + 1);
+      print_tree(table, child, indentation_level + 1);
     }
     child = *internal_node_right_child(node);
     indent(indentation_level + 1);
     printf("- right child %d\n", child);
-    print_tree(pager, child, indentation_level + 1);
+    print_tree(table, child, indentation_level + 1);
     break;
   }
+
+  /* Only the path from the root stays pinned while printing */
+  pager_unpin(table->pager, page_num);
 }
 
 void print_prompt() { printf("db > "); }
 
+/* Parse a byte count such as 4096, 512K, 64M or 1G */
+size_t parse_size(const char *text) {
+  char *end;
+  size_t size = strtoull(text, &end, 10);
+  switch (*end) {
+  case 'G':
+  case 'g':
+    size *= 1024;
+    // Fall through
+  case 'M':
+  case 'm':
+    size *= 1024;
+    // Fall through
+  case 'K':
+  case 'k':
+    size *= 1024;
+  }
+  return size;
+}
+
 InputBuffer *new_input_buffer() {
   InputBuffer *input_buffer = malloc(sizeof(InputBuffer));
   input_buffer->buffer = NULL;
@@ -1,10 +1,11 @@
 #ifndef __STATEMENT__H__
 #define __STATEMENT__H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define COLUMN_NAME_MAX_SIZE 32
-#define OPERATOR_MAX_SIZE 2
+#define OPERATOR_MAX_SIZE 8
 
 typedef enum { INT, STRING } VaulueType;
 typedef enum { FROM, WHERE, ORDER } ClauseType;
@@ -12,9 +13,14 @@ typedef enum { FROM, WHERE, ORDER } ClauseType;
 typedef enum {
   STATEMENT_INSERT,
   STATEMENT_SELECT,
-  STATEMENT_DELETE
+  STATEMENT_DELETE,
+  STATEMENT_CREATE_INDEX,
+  NUM_STATEMENT_TYPES
 } StatementType;
 
+/* Columns that can have a secondary index */
+typedef enum { INDEX_USERNAME, INDEX_EMAIL, NUM_INDEXES } IndexColumn;
+
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 typedef struct {
@@ -23,17 +29,40 @@ typedef struct {
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
-typedef struct {
+typedef enum { WHERE_PREDICATE, WHERE_AND, WHERE_OR } WhereType;
+
+/* A where condition is a tree of predicates joined by and / or */
+typedef struct WhereClause {
+  WhereType type;
+  struct WhereClause *left; // operands of and / or
+  struct WhereClause *right;
   char column_name[COLUMN_NAME_MAX_SIZE + 1];
   char operator[OPERATOR_MAX_SIZE + 1];
   VaulueType value_type;
   void *value;
+  void *upper_value; // only used by between
 } WhereClause;
 
+/* Room for everything a statement points to, see parser.h */
+#define STATEMENT_ARENA_SIZE 4096
+
 typedef struct {
   StatementType type;
   Row *row_to_insert; // only used by insert statement
+  /* Rows of insert values, left in the input, see statement_rows */
+  const char *values;
+  uint32_t values_length;
+  uint32_t num_rows;
   WhereClause *where;
+  /* Only used by select statement */
+  bool count;      // count(*), print the number of rows instead
+  char order_by[COLUMN_NAME_MAX_SIZE + 1]; // Empty if there is no order by
+  bool descending;
+  uint32_t limit;  // Rows to print at most, UINT32_MAX if there is no limit
+  uint32_t offset; // Rows to skip before printing
+  IndexColumn index_column; // only used by create index statement
+  uint32_t arena_used;
+  uint64_t arena[STATEMENT_ARENA_SIZE / sizeof(uint64_t)];
 } Statement;
 
 #endif
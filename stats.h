@@ -0,0 +1,133 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "statement.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Engine statistics. The pager keeps the counters, as the table and its
+indexes share it, and everything bumps them with relaxed atomic adds so
+that threads in library mode can too. All fields are uint64_t, which lets
+stats_copy and stats_reset go over them as an array.
+
+Statement latencies go into HDR-style histograms: values below
+HISTOGRAM_SUB_BUCKETS nanoseconds have a bucket each, above that every
+power of two is cut into HISTOGRAM_SUB_BUCKETS buckets, so a percentile
+read back is within 1 / HISTOGRAM_SUB_BUCKETS of the value recorded.
+*/
+
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS                                                      \
+  ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum; // Nanoseconds
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct {
+  /* Pager */
+  uint64_t page_hits;   // Pages found in the buffer pool
+  uint64_t page_misses; // Pages read in from the file
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t wal_bytes_written;
+  /* Tree, see leaf_node_split_and_insert and node_merge_then_split */
+  uint64_t leaf_splits;
+  uint64_t internal_splits;
+  uint64_t merges;
+  Histogram latency[NUM_STATEMENT_TYPES];
+} Stats;
+
+/* How .stats names each type of statement */
+const char *STATEMENT_TYPE_NAMES[] = {"insert", "select", "delete",
+                                      "create index"};
+
+#define STATS_ADD(stats, counter, n)                                           \
+  __atomic_fetch_add(&(stats)->counter, n, __ATOMIC_RELAXED)
+
+uint32_t histogram_bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return value;
+  }
+  uint32_t exponent = 63 - __builtin_clzll(value);
+  uint32_t shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+  // The bits below the leading one pick the sub-bucket
+  uint32_t sub_bucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/* Largest value that goes into the bucket */
+uint64_t histogram_bucket_max(uint32_t bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  uint32_t shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+  uint64_t low = (HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+  STATS_ADD(histogram, count, 1);
+  STATS_ADD(histogram, sum, value);
+  STATS_ADD(histogram, buckets[histogram_bucket(value)], 1);
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/* Value at or below which a fraction of the values recorded fall */
+uint64_t histogram_percentile(Histogram *histogram, double fraction) {
+  uint64_t rank = fraction * histogram->count;
+  if (rank >= histogram->count && histogram->count > 0) {
+    rank = histogram->count - 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > rank) {
+      uint64_t value = histogram_bucket_max(i);
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+  return 0;
+}
+
+/* A consistent enough copy to print from while others keep counting */
+void stats_copy(Stats *destination, Stats *source) {
+  uint64_t *to = (uint64_t *)destination;
+  uint64_t *from = (uint64_t *)source;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++) {
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+void stats_reset(Stats *stats) {
+  uint64_t *counters = (uint64_t *)stats;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++) {
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+uint64_t stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Record the latency of a statement that began at start, see stats_now */
+void stats_record_statement(Stats *stats, StatementType type,
+                            uint64_t start) {
+  histogram_record(&stats->latency[type], stats_now() - start);
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef __STRINGSEARCH_H__
+#define __STRINGSEARCH_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+Substring search over column values, which are not NUL-terminated in
+the leaves. The SIMD kernels compare a block of positions at once
+against the first and the last byte of the needle, and only the
+positions matching both are compared in full. Like key_search, the
+kernel is picked on first use from what the CPU supports.
+*/
+
+typedef bool (*StringFind)(const char *haystack, uint32_t haystack_length,
+                           const char *needle, uint32_t needle_length);
+
+bool string_find_scalar(const char *haystack, uint32_t haystack_length,
+                        const char *needle, uint32_t needle_length) {
+  if (needle_length == 0) {
+    return true;
+  }
+  for (uint32_t i = 0; i + needle_length <= haystack_length; i++) {
+    if (haystack[i] == needle[0] &&
+        memcmp(haystack + i, needle, needle_length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) bool
+string_find_avx2(const char *haystack, uint32_t haystack_length,
+                 const char *needle, uint32_t needle_length) {
+  if (needle_length == 0) {
+    return true;
+  }
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+  uint32_t i = 0;
+  // Blocks of 32 start positions, as long as the needle fits after each
+  for (; i + 32 + needle_length - 1 <= haystack_length; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+    __m256i block_last = _mm256_loadu_si256(
+        (const __m256i *)(haystack + i + needle_length - 1));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                         _mm256_cmpeq_epi8(block_last, last)));
+    while (mask != 0) {
+      uint32_t position = i + __builtin_ctz(mask);
+      if (memcmp(haystack + position, needle, needle_length) == 0) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return string_find_scalar(haystack + i, haystack_length - i, needle,
+                            needle_length);
+}
+
+__attribute__((target("sse2"))) bool
+string_find_sse2(const char *haystack, uint32_t haystack_length,
+                 const char *needle, uint32_t needle_length) {
+  if (needle_length == 0) {
+    return true;
+  }
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+  uint32_t i = 0;
+  for (; i + 16 + needle_length - 1 <= haystack_length; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+    __m128i block_last =
+        _mm_loadu_si128((const __m128i *)(haystack + i + needle_length - 1));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+    while (mask != 0) {
+      uint32_t position = i + __builtin_ctz(mask);
+      if (memcmp(haystack + position, needle, needle_length) == 0) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return string_find_scalar(haystack + i, haystack_length - i, needle,
+                            needle_length);
+}
+#endif
+
+bool string_find_resolve(const char *haystack, uint32_t haystack_length,
+                         const char *needle, uint32_t needle_length);
+
+/* Starts out as the resolver, which replaces itself on the first call */
+StringFind string_find = string_find_resolve;
+
+bool string_find_resolve(const char *haystack, uint32_t haystack_length,
+                         const char *needle, uint32_t needle_length) {
+  string_find = string_find_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    string_find = string_find_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    string_find = string_find_sse2;
+  }
+#endif
+  return string_find(haystack, haystack_length, needle, needle_length);
+}
+
+/* Name of the kernel in use, for .constants */
+const char *string_find_kernel() {
+  if (string_find == string_find_resolve) {
+    string_find_resolve(NULL, 0, NULL, 0);
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (string_find == string_find_avx2) {
+    return "avx2";
+  } else if (string_find == string_find_sse2) {
+    return "sse2";
+  }
+#endif
+  return "scalar";
+}
+
+#endif
@@ -51,6 +51,9 @@ int main(int argc, char *argv[]) {
     case (PREPARE_UNRECOGNIZED_STATEMENT):
       printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
       continue;
+    case (PREPARE_STATEMENT_TOO_LONG):
+      printf("Statement is too long.\n");
+      continue;
     }
 
     switch (execute_statement(&statement, table)) {
@@ -60,6 +63,12 @@ int main(int argc, char *argv[]) {
     case (EXECUTE_DUPLICATE_KEY):
       printf("Error: Duplicate key.\n");
       break;
+    case (EXECUTE_INDEX_EXISTS):
+      printf("Error: Index already exists.\n");
+      break;
+    case (EXECUTE_UNSUPPORTED_DELETE):
+      printf("Error: Only delete where id = N is supported.\n");
+      break;
     }
   }
 
@@ -0,0 +1,360 @@
+#!/bin/sh
+# Targeted checks of the shell, the test driver and the bulk loader, after
+# make db test bulkload:
+#   sh test.sh
+# Each check starts from an empty check.db and compares what selects print.
+
+DB=./db
+FILE=check.db
+failures=0
+
+# Statements on stdin, prints the rows and counts the selects return
+run() {
+  "$DB" "$@" "$FILE" | sed 's/^\(db > \)*//' | grep '^('
+}
+
+# insert statements for ids first to last
+inserts() {
+  seq "$1" "$2" |
+    awk '{ print "insert", $1, "user" $1, "user" $1 "@example.com" }'
+}
+
+# delete statements for ids first to last
+deletes() {
+  seq "$1" "$2" | awk '{ print "delete where id =", $1 }'
+}
+
+expect() {
+  if [ "$2" != "$3" ]; then
+    echo "FAIL: $1"
+    echo "  expected: $(echo "$3" | tr '\n' ' ')"
+    echo "  got:      $(echo "$2" | tr '\n' ' ')"
+    failures=$((failures + 1))
+  fi
+}
+
+fresh() {
+  rm -f "$FILE" "$FILE-wal"
+}
+
+# The driver inserts every row of its file
+fresh
+python3 test.py 500 1 > check.txt
+./test check.txt "$FILE" > /dev/null
+got=$(echo "select count(*)" | run)
+expect "test driver inserts" "$got" "(500)"
+rm -f check.txt
+
+# The mmap backend recovers too, and trims the file it grew in chunks
+fresh
+(inserts 1 3000; deletes 1 100) | "$DB" --mmap --sync=full "$FILE" > /dev/null
+got=$(printf 'select count(*)\nselect * where id = 3000\n.exit\n' |
+  run --mmap)
+expect "mmap recovery" "$got" "(2900)
+(3000, user3000, user3000@example.com)"
+size=$(wc -c < "$FILE")
+got=$(printf 'select count(*)\n.exit\n' | run)
+expect "mmap file read without mmap" "$got" "(2900)"
+if [ "$(wc -c < "$FILE")" -ne "$size" ] || [ "$size" -ge 1048576 ]; then
+  echo "FAIL: mmap file not trimmed to its pages, $size bytes"
+  failures=$((failures + 1))
+fi
+
+# Statements logged to the WAL survive an exit without closing the table
+fresh
+got=$( (inserts 1 3000; deletes 1 1000; echo "insert 2 again again@x") |
+  "$DB" --sync=full "$FILE" 2>&1 | tail -1)
+expect "exit without close" "$got" "db > Error reading input"
+if [ ! -s "$FILE-wal" ]; then
+  echo "FAIL: no WAL left to recover"
+  failures=$((failures + 1))
+fi
+got=$(printf 'select count(*)\nselect * where id <= 1002\n.exit\n' | run)
+expect "recovery" "$got" "(2001)
+(2, again, again@x)
+(1001, user1001, user1001@example.com)
+(1002, user1002, user1002@example.com)"
+
+# Pages freed by deletes are reused instead of growing the file
+fresh
+(inserts 1 20000; echo ".exit") | "$DB" "$FILE" > /dev/null
+full_size=$(wc -c < "$FILE")
+(deletes 1 20000; inserts 1 20000; echo ".exit") |
+  "$DB" "$FILE" > /dev/null
+size=$(wc -c < "$FILE")
+if [ "$size" -gt "$full_size" ]; then
+  echo "FAIL: free pages not reused, $full_size bytes grew to $size"
+  failures=$((failures + 1))
+fi
+got=$(printf 'select count(*)\n.exit\n' | run)
+expect "rows after reuse" "$got" "(20000)"
+
+# .load sorts, drops duplicate and negative ids, skips lines it cannot
+# parse and fills the indexes
+fresh
+printf '3 c c@x\n1 a a@x\n2 b b@x\n1 dup dup@x\nx y z\n-4 n n@x\n' > check.txt
+got=$( (echo "create index on username"; echo ".load check.txt";
+  echo "select *"; echo "select * where username = b"; echo ".exit") |
+  "$DB" "$FILE" | sed 's/^\(db > \)*//' | grep -v '^Executed')
+expect ".load" "$got" "Syntax error. Could not parse line 5.
+Loaded 3 rows.
+Skipped 1 duplicate and 1 negative ids.
+Skipped 1 lines that could not be parsed.
+(1, a, a@x)
+(2, b, b@x)
+(3, c, c@x)
+(2, b, b@x)"
+
+# bulkload leaves room in the leaves below a fill factor of 1
+seq 1 20000 | awk '{ print $1, "user" $1, "user" $1 "@example.com" }' \
+  > check.txt
+fresh
+./bulkload check.txt "$FILE" > /dev/null
+full_size=$(wc -c < "$FILE")
+fresh
+./bulkload check.txt "$FILE" 0.5 > /dev/null
+size=$(wc -c < "$FILE")
+if [ "$size" -lt $((full_size * 3 / 2)) ]; then
+  echo "FAIL: fill factor 0.5 took $size bytes against $full_size"
+  failures=$((failures + 1))
+fi
+got=$( (inserts 20001 20010; deletes 1 10;
+  printf 'select count(*)\nselect * where id = 15000\n.exit\n') | run)
+expect "bulkload then insert and delete" "$got" "(20000)
+(15000, user15000, user15000@example.com)"
+rm -f check.txt
+
+# Every id range operator, across many leaves and around deleted ids
+fresh
+got=$( (inserts 1 3000; deletes 2 2; deletes 2999 2999;
+  echo "select * where id < 4";
+  echo "select * where id > 2997";
+  echo "select * where id >= 2998";
+  echo "select * where id between 10 and 12";
+  echo "select * where id > 3 and id < 6";
+  echo "select * where id = 2";
+  echo "select * where id >= 5 and id <= 4";
+  echo "select count(*) where id between 100 and 2999";
+  echo ".exit") | run)
+expect "id ranges" "$got" "(1, user1, user1@example.com)
+(3, user3, user3@example.com)
+(2998, user2998, user2998@example.com)
+(3000, user3000, user3000@example.com)
+(2998, user2998, user2998@example.com)
+(3000, user3000, user3000@example.com)
+(10, user10, user10@example.com)
+(11, user11, user11@example.com)
+(12, user12, user12@example.com)
+(4, user4, user4@example.com)
+(5, user5, user5@example.com)
+(2899)"
+
+# insert values takes rows in any order and skips duplicate ids, within
+# the statement and against the table, leaving them out of the index too
+fresh
+got=$( (echo "create index on username";
+  echo "insert values (1, a, a@x), (3, 'c d', c@x)";
+  echo "insert values (2, b, b@x), (3, dup, d@x)";
+  echo "insert into users values (5, e, e@x), (4, d, d@x), (5, f, f@x)";
+  echo "insert values (6, g, g@x),";
+  echo "select *";
+  echo "select * where username = dup";
+  echo "select * where username = f";
+  echo ".exit") | "$DB" "$FILE" | sed 's/^\(db > \)*//' | grep -v '^Executed')
+expect "insert values" "$got" "Inserted 2 rows.
+Inserted 1 rows.
+Skipped 1 duplicate ids.
+Inserted 2 rows.
+Skipped 1 duplicate ids.
+Syntax error. Could not parse statement.
+(1, a, a@x)
+(2, b, b@x)
+(3, c d, c@x)
+(4, d, d@x)
+(5, e, e@x)"
+
+# One insert values of many rows, in descending order, splits leaves
+fresh
+got=$( (printf 'insert values '
+  seq 1000 -1 1 | awk '{ s = NR > 1 ? ", " : "" }
+    { printf "%s(%d, user%d, user%d@example.com)", s, $1, $1, $1 }
+    END { print "" }'
+  printf 'select count(*)\nselect * where id between 500 and 501\n.exit\n') |
+  run)
+expect "insert values of many rows" "$got" "(1000)
+(500, user500, user500@example.com)
+(501, user501, user501@example.com)"
+
+# With a small cache pages are evicted and read back, by pread and pwrite
+# alone under --no-io-uring, and the two see the same file
+fresh
+(inserts 1 20000; echo ".exit") |
+  "$DB" --no-io-uring --cache-size=64K "$FILE" > /dev/null
+got=$( (echo "select count(*) where username like %99%";
+  echo "select * where id = 12345"; echo ".exit") |
+  run --no-io-uring --cache-size=64K)
+expect "--no-io-uring" "$got" "($(seq 1 20000 | grep -c 99))
+(12345, user12345, user12345@example.com)"
+got=$(printf 'select *\n.exit\n' | run --no-io-uring --cache-size=64K |
+  cksum)
+expect "io_uring and pread read alike" "$got" \
+  "$(printf 'select *\n.exit\n' | run --cache-size=64K | cksum)"
+
+# like and contains, each kind of pattern, and mixed with other predicates
+fresh
+got=$( (echo "insert 1 alice alice@mail.org"; echo "insert 2 bob bob@work.com";
+  echo "insert 3 alicia ali@work.com"; echo "insert 4 carol carol@mail.org";
+  echo "insert 5 mal mal@x.org";
+  echo "select * where username like ali%";
+  echo "select * where username like %ol";
+  echo "select * where username like %li%";
+  echo "select * where username like a_i%";
+  echo "select * where username like b_b";
+  echo "select * where username like ali";
+  echo "select * where email contains work";
+  echo "select * where email like %@mail.org and id > 1";
+  echo "select * where username = bob or email contains x.org";
+  echo "select * where (username contains li or id = 5) and" \
+    "email contains work";
+  echo ".exit") | run)
+expect "like and contains" "$got" "(1, alice, alice@mail.org)
+(3, alicia, ali@work.com)
+(4, carol, carol@mail.org)
+(1, alice, alice@mail.org)
+(3, alicia, ali@work.com)
+(1, alice, alice@mail.org)
+(3, alicia, ali@work.com)
+(2, bob, bob@work.com)
+(2, bob, bob@work.com)
+(3, alicia, ali@work.com)
+(4, carol, carol@mail.org)
+(2, bob, bob@work.com)
+(5, mal, mal@x.org)
+(3, alicia, ali@work.com)"
+
+# A scan cut into ranges across threads returns the rows one thread does,
+# in id order
+fresh
+inserts 1 5000 | run > /dev/null
+scans() {
+  (echo "select * where username like %9%";
+    echo "select * where email contains 12";
+    echo "select * where id > 100 and username like user_1%";
+    echo "select *"; echo ".exit") | run "$@" | cksum
+}
+got=$(scans --scan-threads=1)
+expect "scan on 2 threads" "$(scans --scan-threads=2)" "$got"
+expect "scan on 8 threads" "$(scans --scan-threads=8)" "$got"
+
+# csv quotes fields with commas and quotes, tsv escapes tabs and
+# backslashes, binary writes each record behind its size
+fresh
+tab=$(printf '\t')
+got=$( (printf "insert 1 'a,b' 'say \"hi\"'\n";
+  printf "insert 2 'x\\\\y' 'a\tb'\n"; echo "insert 3 plain p@x";
+  echo ".mode csv"; echo "select *"; echo "select count(*)";
+  echo ".mode tsv"; echo "select *";
+  echo ".mode binary"; echo ".output check.bin";
+  echo "select * where id = 3"; echo "select count(*)"; echo ".output";
+  echo ".mode"; echo ".mode xml"; echo ".exit") |
+  "$DB" "$FILE" | sed 's/^\(db > \)*//' | grep -v '^Executed')
+expect "csv and tsv" "$got" "id,username,email
+1,\"a,b\",\"say \"\"hi\"\"\"
+2,x\\y,a${tab}b
+3,plain,p@x
+count
+3
+id${tab}username${tab}email
+1${tab}a,b${tab}say \"hi\"
+2${tab}x\\\\y${tab}a\\tb
+3${tab}plain${tab}p@x
+Mode: binary
+Usage: .mode table|csv|tsv|binary"
+got=$(od -An -tx1 check.bin | tr -s ' \n' ' ')
+expect "binary" "$got" " 0e 00 00 00 03 00 00 00 05 70 6c 61 69 6e 03 70 \
+40 78 04 00 00 00 03 00 00 00 "
+rm -f check.bin
+
+# .stats counts statements by type and shows each tree, .stats reset
+# starts the counters over. Numbers that depend on timing or on the
+# layout of the index are masked.
+fresh
+got=$( (inserts 1 2000; echo "create index on email"; deletes 1 1500;
+  echo ".stats"; echo ".stats reset"; echo "select * where id = 1999";
+  echo ".stats"; echo ".exit") |
+  "$DB" "$FILE" | sed 's/^\(db > \)*//' | grep -v '^Executed' |
+  awk '$1 == "create" { print $1, $2, $3; next }
+    $1 ~ /^(insert|select|delete)$/ { print $1, $2; next }
+    $1 == "statement" { $1 = $1 }
+    /^(Cache|I\/O|Structure|email)/ { gsub(/[0-9.]+/, "N") } { print }')
+expect ".stats" "$got" "Cache: N hits, N misses, N% hit rate
+I/O: N bytes read, N written, N to the WAL
+Structure: N leaf splits, N internal splits, N merges
+table     height 2, 1 internal and 7 leaf pages, 500 rows, 73.6% full
+email     height N, N internal and N leaf pages, N rows, N% full
+statement count mean p50 p90 p99 p99.9 max
+insert 2000
+delete 1500
+create index 1
+(1999, user1999, user1999@example.com)
+Cache: N hits, N misses, N% hit rate
+I/O: N bytes read, N written, N to the WAL
+Structure: N leaf splits, N internal splits, N merges
+table     height 2, 1 internal and 7 leaf pages, 500 rows, 73.6% full
+email     height N, N internal and N leaf pages, N rows, N% full
+statement count mean p50 p90 p99 p99.9 max
+select 1"
+
+# An index forgets deleted rows and still finds the others
+fresh
+got=$( (inserts 1 2000; echo "create index on username"; deletes 1 1500;
+  echo "select * where username = user1000";
+  echo "select * where username = user1501";
+  echo "select count(*) where username >= user1";
+  echo ".exit") | run)
+expect "index after deletes" "$got" "(1501, user1501, user1501@example.com)
+(500)"
+
+# Values sharing their first four bytes, many of them equal: a lookup
+# and a delete find the exact value and id among them
+fresh
+got=$( (seq 1 3000 |
+  awk '{ print "insert", $1, "user" $1 % 3, "x" }';
+  echo "create index on username"; deletes 1 2990;
+  echo "insert 3001 user1 x"; echo "insert 3002 user11 x";
+  echo "select * where username = user1";
+  echo "select count(*) where username like user1%";
+  echo "select count(*) where username = user2";
+  echo ".exit") | run)
+expect "index over one prefix" "$got" "(2992, user1, x)
+(2995, user1, x)
+(2998, user1, x)
+(3001, user1, x)
+(5)
+(3)"
+
+# order by, limit and offset, by id and by another column
+fresh
+got=$( (echo "insert 1 carol carol@x"; echo "insert 2 alice alice@x";
+  echo "insert 3 dave dave@x"; echo "insert 4 bob bob@x";
+  echo "select * order by id desc limit 2";
+  echo "select * limit 2 offset 1";
+  echo "select * order by username limit 2 offset 1";
+  echo "select * order by username desc limit 1 offset 3";
+  echo "select * limit 0";
+  echo "select * limit 2 offset 10";
+  echo ".exit") | run)
+expect "order by, limit and offset" "$got" "(4, bob, bob@x)
+(3, dave, dave@x)
+(2, alice, alice@x)
+(3, dave, dave@x)
+(4, bob, bob@x)
+(1, carol, carol@x)
+(2, alice, alice@x)"
+
+fresh
+if [ "$failures" -gt 0 ]; then
+  echo "$failures checks failed."
+  exit 1
+fi
+echo "All checks passed."
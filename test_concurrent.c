@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+
+/*
+Library mode under load: reader threads run db_read_row and db_read_range
+while the main thread inserts and deletes through db_execute. Ids grow,
+so inserts append to the rightmost leaf. Those that go through
+execute_statement, a multi-row insert or a split the latched path
+refuses, find it through the append cache in table_find, as do the
+deletes behind them. Another thread reads each snapshot twice with a
+commit in between and must see the same rows both times.
+*/
+
+#define NUM_ROWS 10000
+#define NUM_READERS 4
+#define DELETE_LAG 50   // Delete the row inserted this many ids ago
+#define DELETE_EVERY 3  // Of every DELETE_EVERY ids
+#define MULTI_ROW_EVERY 16
+
+Table *table;
+uint32_t committed;            // Largest id inserted so far
+bool deleted[NUM_ROWS + 1];    // Set before the delete runs
+bool stop;
+uint64_t errors;
+
+void report(const char *what, uint32_t id) {
+  if (__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED) < 10) {
+    printf("Error: %s, id %d.\n", what, id);
+  }
+}
+
+bool row_is_valid(Row *row) {
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
+  sprintf(username, "user%d", row->id);
+  sprintf(email, "user%d@example.com", row->id);
+  return strcmp(row->username, username) == 0 &&
+         strcmp(row->email, email) == 0;
+}
+
+typedef struct {
+  uint32_t next; // Smallest id the range may still return
+  uint32_t last; // Committed before the range began
+} RangeCheck;
+
+/* Rows committed before the range began are missing only if deleted */
+void check_range_gap(RangeCheck *check, uint32_t end) {
+  for (uint32_t id = check->next; id < end && id <= check->last; id++) {
+    if (!__atomic_load_n(&deleted[id], __ATOMIC_ACQUIRE)) {
+      report("range skipped a row", id);
+    }
+  }
+}
+
+bool check_range_row(Row *row, void *arg) {
+  RangeCheck *check = arg;
+  if (row->id < check->next) {
+    report("range out of order", row->id);
+  }
+  if (!row_is_valid(row)) {
+    report("range row corrupt", row->id);
+  }
+  check_range_gap(check, row->id);
+  check->next = row->id + 1;
+  return true;
+}
+
+void *reader(void *arg) {
+  unsigned int seed = (unsigned int)(uintptr_t)arg;
+  while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+    uint32_t last = __atomic_load_n(&committed, __ATOMIC_ACQUIRE);
+    if (last == 0) {
+      continue;
+    }
+    uint32_t id = 1 + rand_r(&seed) % last;
+    Row row;
+    if (!db_read_row(table, id, &row)) {
+      if (!__atomic_load_n(&deleted[id], __ATOMIC_ACQUIRE)) {
+        report("row missing", id);
+      }
+    } else if (row.id != id || !row_is_valid(&row)) {
+      report("row corrupt", id);
+    }
+
+    if (rand_r(&seed) % 16 == 0) {
+      uint32_t low = 1 + rand_r(&seed) % last;
+      RangeCheck check = {low, last};
+      db_read_range(table, low, last, check_range_row, &check);
+      check_range_gap(&check, last + 1);
+    }
+  }
+  return NULL;
+}
+
+typedef struct {
+  uint32_t num_rows;
+  uint64_t hash;
+} SnapshotSum;
+
+bool sum_row(Row *row, void *arg) {
+  SnapshotSum *sum = arg;
+  sum->num_rows++;
+  sum->hash = sum->hash * 31 + row->id;
+  for (char *c = row->username; *c != '\0'; c++) {
+    sum->hash = sum->hash * 31 + *c;
+  }
+  for (char *c = row->email; *c != '\0'; c++) {
+    sum->hash = sum->hash * 31 + *c;
+  }
+  return true;
+}
+
+SnapshotSum sum_snapshot(uint64_t snapshot) {
+  SnapshotSum sum = {0, 0};
+  db_read_snapshot(table, snapshot, 0, UINT32_MAX, sum_row, &sum);
+  return sum;
+}
+
+/* Read a snapshot, wait for the writer to commit, read it again */
+void *snapshot_reader(void *arg) {
+  (void)arg;
+  while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+    uint64_t snapshot = db_snapshot_begin(table);
+    SnapshotSum first = sum_snapshot(snapshot);
+    uint32_t last = __atomic_load_n(&committed, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&committed, __ATOMIC_ACQUIRE) == last &&
+           !__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+      sched_yield();
+    }
+    SnapshotSum second = sum_snapshot(snapshot);
+    if (first.num_rows != second.num_rows || first.hash != second.hash) {
+      report("snapshot changed between reads", last);
+    }
+    db_snapshot_end(table, snapshot);
+  }
+  return NULL;
+}
+
+void run(const char *sql) {
+  InputBuffer input_buffer;
+  input_buffer.buffer = (char *)sql;
+  input_buffer.input_length = strlen(sql);
+  input_buffer.buffer_length = input_buffer.input_length + 1;
+  Statement statement;
+  if (prepare_statement(&input_buffer, &statement) != PREPARE_SUCCESS) {
+    printf("Could not prepare '%s'.\n", sql);
+    exit(EXIT_FAILURE);
+  }
+  if (db_execute(table, &statement) != EXECUTE_SUCCESS) {
+    printf("Could not execute '%s'.\n", sql);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("Must supply a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  PagerOptions options = default_pager_options();
+  options.concurrent = true;
+  table = db_open_with_options(argv[1], &options);
+
+  pthread_t readers[NUM_READERS];
+  for (uintptr_t i = 0; i < NUM_READERS; i++) {
+    pthread_create(&readers[i], NULL, reader, (void *)(i + 1));
+  }
+  pthread_t snapshot_thread;
+  pthread_create(&snapshot_thread, NULL, snapshot_reader, NULL);
+
+  char sql[256];
+  uint32_t id = 1;
+  while (id <= NUM_ROWS) {
+    if (id % MULTI_ROW_EVERY == 0 && id + 1 <= NUM_ROWS) {
+      sprintf(sql,
+              "insert values (%d, user%d, user%d@example.com), "
+              "(%d, user%d, user%d@example.com)",
+              id, id, id, id + 1, id + 1, id + 1);
+      id += 2;
+    } else {
+      sprintf(sql, "insert %d user%d user%d@example.com", id, id, id);
+      id++;
+    }
+    run(sql);
+    __atomic_store_n(&committed, id - 1, __ATOMIC_RELEASE);
+
+    uint32_t victim = id - 1 > DELETE_LAG ? id - 1 - DELETE_LAG : 0;
+    if (victim > 0 && victim % DELETE_EVERY == 0) {
+      __atomic_store_n(&deleted[victim], true, __ATOMIC_RELEASE);
+      sprintf(sql, "delete where id = %d", victim);
+      run(sql);
+    }
+  }
+
+  __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+  for (int i = 0; i < NUM_READERS; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  pthread_join(snapshot_thread, NULL);
+
+  // Quiet now: every row must be where the writer left it
+  for (uint32_t i = 1; i <= NUM_ROWS; i++) {
+    Row row;
+    bool found = db_read_row(table, i, &row);
+    if (found != !deleted[i] || (found && !row_is_valid(&row))) {
+      report("final row wrong", i);
+    }
+  }
+
+  // One snapshot, read before and after a delete and an insert commit
+  uint64_t snapshot = db_snapshot_begin(table);
+  SnapshotSum before = sum_snapshot(snapshot);
+  run("delete where id = 1");
+  sprintf(sql, "insert %d user%d user%d@example.com", NUM_ROWS + 1,
+          NUM_ROWS + 1, NUM_ROWS + 1);
+  run(sql);
+  SnapshotSum after = sum_snapshot(snapshot);
+  if (before.num_rows != after.num_rows || before.hash != after.hash) {
+    report("snapshot saw a later commit", NUM_ROWS + 1);
+  }
+  db_snapshot_end(table, snapshot);
+
+  db_close(table);
+  if (errors > 0) {
+    printf("%lu errors.\n", errors);
+    exit(EXIT_FAILURE);
+  }
+  printf("Concurrent test passed.\n");
+  return 0;
+}
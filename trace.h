@@ -0,0 +1,90 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+Tracing of the tree and the pager. TRACE records an event into a ring
+buffer of the last TRACE_RING_SIZE ones, which .trace prints. Each event
+has a level, and those above TRACE_LEVEL are compiled out along with the
+evaluation of their arguments, so with the default of 0 tracing costs
+nothing at all. Build with -DTRACE_LEVEL=3 to have every event, then
+turn recording on and off at run time with .trace on and .trace off.
+*/
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 0
+#endif
+
+#define TRACE_LEVEL_STRUCTURE 1 // Splits and merges of nodes
+#define TRACE_LEVEL_PAGE 2      // Pages read in on a cache miss
+#define TRACE_LEVEL_PATH 3      // Each step of a lookup or a scan
+
+#define TRACE_RING_SIZE 4096 // A power of two
+
+typedef enum {
+  TRACE_DESCENT,        // page, key, child index taken
+  TRACE_NEXT_LEAF,      // page, next page
+  TRACE_LEAF_SPLIT,     // page, new page, key inserted
+  TRACE_INTERNAL_SPLIT, // page, new page, child added
+  TRACE_MERGE,          // parent page, left page, right page
+  TRACE_PAGE_MISS,      // page, frame
+  TRACE_DELETE,         // page, key, cell
+  NUM_TRACE_EVENTS
+} TraceEventType;
+
+typedef struct {
+  uint64_t seq;
+  TraceEventType type;
+  uint32_t args[3];
+} TraceEvent;
+
+/* How .trace prints each type of event */
+const char *TRACE_EVENT_FORMATS[] = {
+    "descent page %u key %u child %u",
+    "next leaf page %u next %u",
+    "leaf split page %u new %u key %u",
+    "internal split page %u new %u child %u",
+    "merge parent %u left %u right %u",
+    "page miss page %u frame %u",
+    "delete page %u key %u cell %u",
+};
+
+bool trace_enabled = false;
+TraceEvent trace_ring[TRACE_RING_SIZE];
+uint64_t trace_next_seq = 0;
+
+/* Threads in library mode may record at once, each claims a slot */
+void trace_record(TraceEventType type, uint32_t a, uint32_t b, uint32_t c) {
+  uint64_t seq = __atomic_fetch_add(&trace_next_seq, 1, __ATOMIC_RELAXED);
+  TraceEvent *event = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+  event->seq = seq;
+  event->type = type;
+  event->args[0] = a;
+  event->args[1] = b;
+  event->args[2] = c;
+}
+
+#define TRACE(level, type, a, b, c)                                            \
+  do {                                                                         \
+    if ((level) <= TRACE_LEVEL && trace_enabled) {                             \
+      trace_record(type, a, b, c);                                             \
+    }                                                                          \
+  } while (0)
+
+/* Print the events in the ring buffer, oldest first */
+void trace_print() {
+  uint64_t end = trace_next_seq;
+  uint64_t seq = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+  for (; seq < end; seq++) {
+    TraceEvent *event = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+    printf("%llu ", (unsigned long long)event->seq);
+    printf(TRACE_EVENT_FORMATS[event->type], event->args[0], event->args[1],
+           event->args[2]);
+    printf("\n");
+  }
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+A small io_uring over the raw system calls. Requests are queued into the
+submission ring and handed to the kernel together by one io_uring_enter,
+which is what keeps several of them in flight at once. Each carries a tag
+that comes back with its completion. Kernels without io_uring, or
+sandboxes that refuse it, make uring_open fail and the pager falls back
+to pread/pwrite.
+*/
+
+#define URING_ENTRIES 64
+
+typedef struct {
+  int ring_fd; // -1 when io_uring is not in use
+  uint32_t entries;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t *sq_mask;
+  uint32_t *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  void *cq_ring;
+  size_t cq_ring_size;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  uint32_t to_submit; // Queued since the last io_uring_enter
+  uint32_t in_flight; // Submitted and not reaped yet
+} Uring;
+
+bool uring_open(Uring *ring, uint32_t entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(Uring));
+  ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->ring_fd < 0) {
+    ring->ring_fd = -1;
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    // Older than the plain read opcode used for pages
+    close(ring->ring_fd);
+    ring->ring_fd = -1;
+    return false;
+  }
+  ring->entries = params.sq_entries;
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                       IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                       IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    printf("Error mapping io_uring: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  ring->sq_head = ring->sq_ring + params.sq_off.head;
+  ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+  ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+  ring->sq_array = ring->sq_ring + params.sq_off.array;
+  ring->cq_head = ring->cq_ring + params.cq_off.head;
+  ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+  ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+  ring->cqes = ring->cq_ring + params.cq_off.cqes;
+  return true;
+}
+
+void uring_close(Uring *ring) {
+  if (ring->ring_fd < 0) {
+    return;
+  }
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->ring_fd);
+  ring->ring_fd = -1;
+}
+
+/* Room for another request, counting those not reaped yet */
+bool uring_has_room(Uring *ring) {
+  return ring->to_submit + ring->in_flight < ring->entries;
+}
+
+/* Queue a request, the caller has checked uring_has_room */
+void uring_queue(Uring *ring, uint8_t opcode, int fd, void *address,
+                 uint32_t length, off_t offset, uint64_t tag) {
+  uint32_t tail = *ring->sq_tail;
+  uint32_t index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)address;
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->user_data = tag;
+  ring->sq_array[index] = index;
+  // The kernel may read the entry as soon as it sees the new tail
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+/* Hand the queued requests to the kernel, waiting for min_complete of them */
+void uring_submit(Uring *ring, uint32_t min_complete) {
+  uint32_t flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (ring->to_submit > 0 || min_complete > 0) {
+    int submitted = syscall(__NR_io_uring_enter, ring->ring_fd,
+                            ring->to_submit, min_complete, flags, NULL, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error submitting io: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    ring->to_submit -= submitted;
+    ring->in_flight += submitted;
+    if (ring->to_submit == 0) {
+      break;
+    }
+  }
+}
+
+/* Take one completion if there is any */
+bool uring_reap(Uring *ring, struct io_uring_cqe *cqe) {
+  uint32_t head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  *cqe = ring->cqes[head & *ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  ring->in_flight--;
+  return true;
+}
+
+#endif
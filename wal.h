@@ -0,0 +1,270 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+Write-ahead log. Every statement that modifies pages appends an image of
+each page it touched, the last one flagged as the commit frame. The data
+file is only written at checkpoints (or when the buffer pool evicts a
+dirty page), after the log is synced. On open, committed frames are
+replayed into the data file and the log is emptied.
+*/
+
+#define WAL_FRAME_MAGIC 0x57414c46
+/*
+WAL_SYNC_NORMAL syncs on the commit that makes a group of this many, or
+on the first commit once this long has passed since the last sync. No
+commit waits for the fsync of its group: the commits of a group that is
+not closed, say the last ones before the database goes idle, are only
+synced by the next commit, a checkpoint or the close, and may be lost to
+a crash of the machine in the meantime. They are never torn, recovery
+stops at the last whole commit.
+*/
+#define WAL_DEFAULT_GROUP_COMMIT_SIZE 64
+#define WAL_DEFAULT_GROUP_COMMIT_WINDOW_US 10000
+
+typedef enum {
+  WAL_SYNC_OFF,    // Never fsync the log, the OS decides
+  WAL_SYNC_NORMAL, // One fsync per group of commits, see above
+  WAL_SYNC_FULL    // fsync before every commit returns
+} WalSyncMode;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t page_num;
+  uint32_t commit;   // Database size in pages on a commit frame, otherwise 0
+  uint32_t checksum; // Of the header (with checksum 0) and the page
+} WalFrameHeader;
+
+const uint32_t WAL_FRAME_HEADER_SIZE = sizeof(WalFrameHeader);
+
+typedef struct {
+  int file_descriptor;
+  uint32_t page_size;
+  WalSyncMode sync_mode;
+  uint32_t group_commit_size;
+  uint32_t group_commit_window_us;
+
+  /* Frames of the running statement, written out at commit */
+  void *buffer;
+  size_t buffer_length;
+  size_t buffer_capacity;
+
+  off_t file_length;
+  uint32_t pending_commits; // Written to the OS but not yet synced
+  struct timespec last_sync;
+} Wal;
+
+uint32_t wal_checksum(uint32_t hash, const void *data, size_t length) {
+  // FNV-1a
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+uint32_t wal_frame_checksum(WalFrameHeader *header, const void *page,
+                            uint32_t page_size) {
+  WalFrameHeader copy = *header;
+  copy.checksum = 0;
+  uint32_t hash = wal_checksum(2166136261u, &copy, sizeof(copy));
+  return wal_checksum(hash, page, page_size);
+}
+
+uint64_t wal_elapsed_us(struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000000 +
+         (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+Wal *wal_open(const char *db_filename, uint32_t page_size,
+              WalSyncMode sync_mode) {
+  char *filename = malloc(strlen(db_filename) + 5);
+  sprintf(filename, "%s-wal", db_filename);
+  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  free(filename);
+
+  if (fd == -1) {
+    printf("Unable to open wal file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Wal *wal = malloc(sizeof(Wal));
+  wal->file_descriptor = fd;
+  wal->page_size = page_size;
+  wal->sync_mode = sync_mode;
+  wal->group_commit_size = WAL_DEFAULT_GROUP_COMMIT_SIZE;
+  wal->group_commit_window_us = WAL_DEFAULT_GROUP_COMMIT_WINDOW_US;
+  wal->buffer_capacity = 4 * (WAL_FRAME_HEADER_SIZE + page_size);
+  wal->buffer = malloc(wal->buffer_capacity);
+  wal->buffer_length = 0;
+  wal->file_length = lseek(fd, 0, SEEK_END);
+  wal->pending_commits = 0;
+  clock_gettime(CLOCK_MONOTONIC, &wal->last_sync);
+  return wal;
+}
+
+/*
+Replay every committed statement found in the log into the data file.
+Frames after the last valid commit frame belong to a statement that never
+committed and are ignored. Returns the number of statements replayed, and
+the database size in pages as of the last one in num_pages.
+*/
+uint32_t wal_recover(Wal *wal, int db_file_descriptor, uint32_t *num_pages) {
+  uint32_t frame_size = WAL_FRAME_HEADER_SIZE + wal->page_size;
+  void *frame = malloc(frame_size);
+  off_t offset = 0;
+  off_t commit_start = 0;
+  uint32_t commits = 0;
+  *num_pages = 0;
+
+  while (offset + frame_size <= wal->file_length) {
+    ssize_t bytes_read =
+        pread(wal->file_descriptor, frame, frame_size, offset);
+    if (bytes_read != frame_size) {
+      break;
+    }
+    WalFrameHeader *header = frame;
+    void *page = frame + WAL_FRAME_HEADER_SIZE;
+    if (header->magic != WAL_FRAME_MAGIC ||
+        header->checksum != wal_frame_checksum(header, page, wal->page_size)) {
+      break;
+    }
+    offset += frame_size;
+
+    if (header->commit == 0) {
+      continue;
+    }
+    *num_pages = header->commit;
+    // Statement is complete, apply its frames
+    for (off_t o = commit_start; o < offset; o += frame_size) {
+      if (pread(wal->file_descriptor, frame, frame_size, o) != frame_size ||
+          pwrite(db_file_descriptor, page, wal->page_size,
+                 (off_t)header->page_num * wal->page_size) == -1) {
+        printf("Error replaying wal: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+    }
+    commit_start = offset;
+    commits++;
+  }
+  free(frame);
+
+  if (commits > 0 && fsync(db_file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  return commits;
+}
+
+void wal_append(Wal *wal, uint32_t page_num, void *page) {
+  uint32_t frame_size = WAL_FRAME_HEADER_SIZE + wal->page_size;
+  if (wal->buffer_length + frame_size > wal->buffer_capacity) {
+    wal->buffer_capacity *= 2;
+    wal->buffer = realloc(wal->buffer, wal->buffer_capacity);
+  }
+
+  WalFrameHeader *header = wal->buffer + wal->buffer_length;
+  header->magic = WAL_FRAME_MAGIC;
+  header->page_num = page_num;
+  header->commit = 0;
+  header->checksum = 0;
+  memcpy((void *)header + WAL_FRAME_HEADER_SIZE, page, wal->page_size);
+  wal->buffer_length += frame_size;
+}
+
+void wal_sync(Wal *wal) {
+  if (wal->pending_commits == 0) {
+    return;
+  }
+  if (wal->sync_mode != WAL_SYNC_OFF &&
+      fdatasync(wal->file_descriptor) == -1) {
+    printf("Error syncing wal: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->pending_commits = 0;
+  clock_gettime(CLOCK_MONOTONIC, &wal->last_sync);
+}
+
+/*
+Close the running statement: flag its last frame as the commit frame and
+hand the frames to the OS. Depending on the sync mode the fsync happens
+now, on this commit if it closes a group, or never.
+*/
+void wal_commit(Wal *wal, uint32_t num_pages) {
+  if (wal->buffer_length == 0) {
+    return;
+  }
+
+  uint32_t frame_size = WAL_FRAME_HEADER_SIZE + wal->page_size;
+  for (size_t o = 0; o < wal->buffer_length; o += frame_size) {
+    WalFrameHeader *header = wal->buffer + o;
+    if (o + frame_size == wal->buffer_length) {
+      header->commit = num_pages;
+    }
+    header->checksum = wal_frame_checksum(
+        header, (void *)header + WAL_FRAME_HEADER_SIZE, wal->page_size);
+  }
+
+  ssize_t bytes_written = pwrite(wal->file_descriptor, wal->buffer,
+                                 wal->buffer_length, wal->file_length);
+  if (bytes_written != (ssize_t)wal->buffer_length) {
+    printf("Error writing wal: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->file_length += bytes_written;
+  wal->buffer_length = 0;
+  wal->pending_commits++;
+
+  switch (wal->sync_mode) {
+  case (WAL_SYNC_OFF):
+    break;
+  case (WAL_SYNC_NORMAL):
+    if (wal->pending_commits >= wal->group_commit_size ||
+        wal_elapsed_us(&wal->last_sync) >= wal->group_commit_window_us) {
+      wal_sync(wal);
+    }
+    break;
+  case (WAL_SYNC_FULL):
+    wal_sync(wal);
+    break;
+  }
+}
+
+/* The data file has everything in the log, start over */
+void wal_reset(Wal *wal) {
+  if (wal->file_length == 0) {
+    return;
+  }
+  if (ftruncate(wal->file_descriptor, 0) == -1) {
+    printf("Error truncating wal: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (wal->sync_mode != WAL_SYNC_OFF && fsync(wal->file_descriptor) == -1) {
+    printf("Error syncing wal: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->file_length = 0;
+  wal->pending_commits = 0;
+}
+
+void wal_close(Wal *wal) {
+  close(wal->file_descriptor);
+  free(wal->buffer);
+  free(wal);
+}
+
+#endif